@@ -0,0 +1,55 @@
+#include "block_checksum.h"
+#include "crc32c.h"
+#include "globals.h"
+#include "raid.h"
+#include <stdint.h>
+
+/*
+ * With WFS_FEATURE_CHECKSUMS each disk keeps the CRC32C of every data block
+ * row in a table at sb.csum_ptr. Writes refresh the entries of the blocks
+ * they touch, and mirrored modes replicate the entries along with the data,
+ * so each disk's table describes its own copies. A read then checks one
+ * copy against its entry instead of comparing copies.
+ */
+int has_block_checksums(void) {
+  return (sb.features & WFS_FEATURE_CHECKSUMS) != 0;
+}
+
+static uint32_t *checksum_entry(int disk_index, size_t offset) {
+  uint32_t *table =
+      (uint32_t *)((char *)wfs_ctx.disk_mmaps[disk_index] + sb.csum_ptr);
+  return &table[(offset - sb.d_blocks_ptr) / BLOCK_SIZE];
+}
+
+/*
+ * Recomputes the checksums of the whole blocks in [offset, offset + size),
+ * just written to disk_index, and mirrors them.
+ */
+void store_block_checksums(int disk_index, size_t offset, size_t size) {
+  if (!has_block_checksums()) {
+    return;
+  }
+
+  const char *data = (const char *)wfs_ctx.disk_mmaps[disk_index] + offset;
+  uint32_t *entries = checksum_entry(disk_index, offset);
+  size_t count = size / BLOCK_SIZE;
+
+  for (size_t i = 0; i < count; i++) {
+    entries[i] = crc32c(0, data + i * BLOCK_SIZE, BLOCK_SIZE);
+  }
+
+  if (sb.raid_mode == RAID_1 || sb.raid_mode == RAID_1v) {
+    size_t entries_offset =
+        (char *)entries - (char *)wfs_ctx.disk_mmaps[disk_index];
+    replicate(entries, entries_offset, count * sizeof(uint32_t), disk_index);
+  }
+}
+
+// Whether disk_index's copy of the data block at offset matches its entry.
+int block_checksum_ok(int disk_index, size_t offset) {
+  if (!has_block_checksums()) {
+    return 1;
+  }
+  const char *block = (const char *)wfs_ctx.disk_mmaps[disk_index] + offset;
+  return crc32c(0, block, BLOCK_SIZE) == *checksum_entry(disk_index, offset);
+}
@@ -0,0 +1,9 @@
+#ifndef BLOCK_CHECKSUM_H
+#define BLOCK_CHECKSUM_H
+
+#include <stddef.h>
+
+int has_block_checksums(void);
+void store_block_checksums(int disk_index, size_t offset, size_t size);
+int block_checksum_ok(int disk_index, size_t offset);
+#endif
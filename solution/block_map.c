@@ -0,0 +1,208 @@
+#include "block_map.h"
+#include "data_block.h"
+#include "extent.h"
+#include "globals.h"
+#include "wfs.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Logical-to-physical block map cache. Each slot remembers, for one inode,
+ * the data blocks behind a few windows of the file. The direct blocks form
+ * the first window and every later one covers the logical blocks under a
+ * single leaf indirect block, so filling a window reads one indirect block
+ * per tree level and the memory held does not depend on how far into the
+ * file a request lands. Slots are direct-mapped by inode number and dropped
+ * whenever the inode's block map changes. block_map_lock is held while a
+ * range is resolved, including the indirect block reads that fill it.
+ *
+ * Extent-mapped files bypass the cache: their root sits in the inode and a
+ * lookup reads at most one node per tree level anyway.
+ */
+
+#define BLOCK_MAP_SLOTS 64
+#define BLOCK_MAP_WINDOWS 8
+
+struct map_window {
+  int in_use;
+  size_t start; /* first logical block covered */
+  size_t count;
+  int *blocks; /* PTRS_PER_BLOCK entries, also used to walk the tree */
+};
+
+struct block_map {
+  int in_use;
+  int inode_num;
+  size_t next_victim;
+  struct map_window windows[BLOCK_MAP_WINDOWS];
+};
+
+static struct block_map block_maps[BLOCK_MAP_SLOTS];
+static pthread_mutex_t block_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void drop_windows(struct block_map *map) {
+  for (int i = 0; i < BLOCK_MAP_WINDOWS; i++) {
+    free(map->windows[i].blocks);
+    map->windows[i].blocks = NULL;
+    map->windows[i].in_use = 0;
+  }
+}
+
+static struct block_map *get_block_map(int inode_num) {
+  struct block_map *map = &block_maps[inode_num % BLOCK_MAP_SLOTS];
+
+  if (!map->in_use || map->inode_num != inode_num) {
+    DEBUG_LOG("Block map cache miss for inode %d", inode_num);
+    drop_windows(map);
+    map->inode_num = inode_num;
+    map->in_use = 1;
+  }
+
+  return map;
+}
+
+/*
+ * Loads the window starting at window->start. Intermediate tree levels are
+ * read into the window's own buffer on the way down to the leaf.
+ */
+static int fill_window(struct map_window *window,
+                       const struct wfs_inode *inode) {
+  int slot, depth;
+  size_t base, span;
+
+  if (window->start < DIRECT_BLOCKS) {
+    for (size_t i = 0; i < window->count; i++) {
+      window->blocks[i] = inode->blocks[i];
+    }
+    return 0;
+  }
+
+  for (depth = 1; get_indirect_region(depth, &slot, &base, &span) == 0;
+       depth++) {
+    if (window->start < base + span) {
+      break;
+    }
+  }
+
+  int node = inode->blocks[slot];
+  for (; node != -1; depth--) {
+    int res = read_data_block(window->blocks, node);
+    if (res < 0) {
+      return res;
+    }
+    if (depth == 1) {
+      DEBUG_LOG("Loaded indirect block %d into block map of inode %d", node,
+                inode->num);
+      return 0;
+    }
+    span /= PTRS_PER_BLOCK;
+    size_t index = (window->start - base) / span;
+    base += index * span;
+    node = window->blocks[index];
+  }
+
+  for (size_t i = 0; i < window->count; i++) {
+    window->blocks[i] = -1;
+  }
+  return 0;
+}
+
+/*
+ * Returns the window holding logical block, loading it over the oldest
+ * window on a miss. block must be below max_file_blocks().
+ */
+static struct map_window *get_window(struct block_map *map,
+                                     const struct wfs_inode *inode,
+                                     size_t block, int *res) {
+  size_t start = 0, count = DIRECT_BLOCKS;
+  if (block >= DIRECT_BLOCKS) {
+    start = block - (block - DIRECT_BLOCKS) % PTRS_PER_BLOCK;
+    count = PTRS_PER_BLOCK;
+  }
+
+  for (int i = 0; i < BLOCK_MAP_WINDOWS; i++) {
+    struct map_window *window = &map->windows[i];
+    if (window->in_use && window->start == start) {
+      return window;
+    }
+  }
+
+  struct map_window *window =
+      &map->windows[map->next_victim++ % BLOCK_MAP_WINDOWS];
+  window->in_use = 0;
+  if (!window->blocks) {
+    window->blocks = malloc(PTRS_PER_BLOCK * sizeof(int));
+    if (!window->blocks) {
+      ERROR_LOG("Failed to allocate block map window for inode %d",
+                inode->num);
+      *res = -ENOMEM;
+      return NULL;
+    }
+  }
+
+  window->start = start;
+  window->count = count;
+  if ((*res = fill_window(window, inode)) < 0) {
+    return NULL;
+  }
+  window->in_use = 1;
+  return window;
+}
+
+static int resolve_locked(const struct wfs_inode *inode, size_t first_block,
+                          size_t num_blocks, int *blocks) {
+  struct block_map *map = get_block_map(inode->num);
+  size_t max_blocks = max_file_blocks();
+  size_t end = first_block + num_blocks;
+
+  for (size_t b = first_block; b < end;) {
+    if (b >= max_blocks) {
+      // Past the largest mappable file: nothing can be allocated there.
+      for (; b < end; b++) {
+        blocks[b - first_block] = -1;
+      }
+      break;
+    }
+
+    int res;
+    struct map_window *window = get_window(map, inode, b, &res);
+    if (!window) {
+      return res;
+    }
+
+    size_t window_end = window->start + window->count;
+    size_t n = (end < window_end ? end : window_end) - b;
+    memcpy(blocks + (b - first_block), window->blocks + (b - window->start),
+           n * sizeof(int));
+    b += n;
+  }
+
+  return 0;
+}
+
+int resolve_block_range(const struct wfs_inode *inode, size_t first_block,
+                        size_t num_blocks, int *blocks) {
+  if (inode_uses_extents(inode)) {
+    return fill_extent_range(inode, first_block, first_block + num_blocks,
+                             blocks);
+  }
+
+  pthread_mutex_lock(&block_map_lock);
+  int res = resolve_locked(inode, first_block, num_blocks, blocks);
+  pthread_mutex_unlock(&block_map_lock);
+  return res;
+}
+
+void invalidate_block_map(int inode_num) {
+  struct block_map *map = &block_maps[inode_num % BLOCK_MAP_SLOTS];
+
+  pthread_mutex_lock(&block_map_lock);
+  if (map->in_use && map->inode_num == inode_num) {
+    DEBUG_LOG("Invalidating block map of inode %d", inode_num);
+    drop_windows(map);
+    map->in_use = 0;
+  }
+  pthread_mutex_unlock(&block_map_lock);
+}
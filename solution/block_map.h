@@ -0,0 +1,10 @@
+#ifndef BLOCK_MAP_H
+#define BLOCK_MAP_H
+
+#include "wfs.h"
+#include <stddef.h>
+
+int resolve_block_range(const struct wfs_inode *inode, size_t first_block,
+                        size_t num_blocks, int *blocks);
+void invalidate_block_map(int inode_num);
+#endif
@@ -0,0 +1,71 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/*
+ * CRC32C (Castagnoli), the checksum SSE4.2 and ARMv8 compute in hardware.
+ * x86-64 picks the instruction at run time, since the build does not
+ * assume SSE4.2; other machines fall back to a nibble table, which needs no
+ * setup and is small enough to stay in cache.
+ */
+static const uint32_t crc32c_nibbles[16] = {
+    0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3,
+    0x61c69362, 0x7198540d, 0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9,
+    0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75,
+};
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+  while (len--) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ crc32c_nibbles[crc & 15];
+    crc = (crc >> 4) ^ crc32c_nibbles[crc & 15];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  while (len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  while (len--) {
+    crc = __crc32cb(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+// Continues crc over buf; start from 0.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    return ~crc32c_hw(crc, buf, len);
+  }
+#elif defined(__ARM_FEATURE_CRC32)
+  return ~crc32c_hw(crc, buf, len);
+#endif
+  return ~crc32c_sw(crc, buf, len);
+}
@@ -1,8 +1,18 @@
+#include "block_checksum.h"
+#include "block_map.h"
+#include "data_block.h"
+#include "dir_filter.h"
+#include "dir_index.h"
+#include "extent.h"
+#include "free_space.h"
 #include "globals.h"
 #include "inode.h"
 #include "raid.h"
+#include "read_balance.h"
+#include "replication.h"
 #include "wfs.h"
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,32 +27,44 @@
     }                                                                          \
   } while (0)
 
-void read_data_block(void *block, size_t block_index) {
+size_t get_data_block_location(size_t block_index, int *disk_index) {
+  block_index = get_raid_disk(block_index, disk_index);
+  return DATA_BLOCK_OFFSET(block_index);
+}
+
+/*
+ * Returns -EIO when block checksums show every copy is corrupt. The block
+ * is still copied out, since most metadata readers cannot fail.
+ */
+int read_data_block(void *block, size_t block_index) {
   int disk_index;
   block_index = get_raid_disk(block_index, &disk_index);
   if (disk_index < 0) {
     ERROR_LOG("Unable to get disk index for block %zu\n", block_index);
-    return;
+    return -EIO;
   }
 
   size_t block_offset = DATA_BLOCK_OFFSET(block_index);
+  if (sb.raid_mode == RAID_1) {
+    disk_index = begin_disk_read(block_offset, BLOCK_SIZE);
+  }
 
-  if (sb.raid_mode == RAID_0 || sb.raid_mode == RAID_1) {
-
-    memcpy(block, (char *)wfs_ctx.disk_mmaps[disk_index] + block_offset,
-           BLOCK_SIZE);
-    DEBUG_LOG("Read block %zu (offset: %zu) from disk %d\n", block_index,
-              block_offset, disk_index);
-  } else if (sb.raid_mode == RAID_1v) {
-    if (get_majority_block(block, block_offset) < 0) {
-      ERROR_LOG("Failed to read majority block for block index %zu\n",
-                block_index);
-      return;
-    }
+  int read_disk = find_read_disk(block_offset, disk_index);
+  int res = 0;
+  if (read_disk < 0) {
+    ERROR_LOG("Block %zu is corrupt on every disk\n", block_index);
+    res = read_disk;
+    read_disk = disk_index;
+  }
 
-    DEBUG_LOG("Read majority block %zu (offset: %zu) successfully\n",
-              block_index, block_offset);
+  memcpy(block, (char *)wfs_ctx.disk_mmaps[read_disk] + block_offset,
+         BLOCK_SIZE);
+  if (sb.raid_mode == RAID_1) {
+    end_disk_read(disk_index);
   }
+  DEBUG_LOG("Read block %zu (offset: %zu) from disk %d\n", block_index,
+            block_offset, read_disk);
+  return res;
 }
 
 void write_data_block(const void *block, size_t block_index) {
@@ -56,6 +78,7 @@ void write_data_block(const void *block, size_t block_index) {
   size_t block_offset = DATA_BLOCK_OFFSET(block_index);
   memcpy((char *)wfs_ctx.disk_mmaps[disk_index] + block_offset, block,
          BLOCK_SIZE);
+  store_block_checksums(disk_index, block_offset, BLOCK_SIZE);
   DEBUG_LOG("Wrote block %zu (offset: %zu) to disk %d\n", block_index,
             block_offset, disk_index);
 
@@ -96,44 +119,113 @@ void write_data_block_bitmap(const char *data_block_bitmap, int disk_index) {
 }
 
 int allocate_free_data_block() {
+  int block_num = claim_free_block();
+  if (block_num < 0) {
+    ERROR_LOG("No free data blocks available\n");
+    return -ENOSPC;
+  }
+
+  DEBUG_LOG("Allocated data block %d", block_num);
+  return block_num;
+}
+
+/*
+ * Claims up to want physically consecutive blocks for a file, starting at
+ * goal if that block is still available and otherwise inside the file's
+ * reservation window. Under RAID 0 consecutive block numbers are the disks
+ * of one stripe row in turn, so a run fans out across every disk. Returns
+ * the first block number and the run length through got.
+ */
+int allocate_file_data_run(const struct wfs_inode *inode, int goal,
+                           size_t want, size_t *got) {
+  int start = claim_file_blocks(inode->num, goal, want, got);
+  if (start < 0) {
+    ERROR_LOG("No free data blocks available\n");
+    return -ENOSPC;
+  }
+
+  DEBUG_LOG("Allocated run of %zu data blocks starting at %d for inode %d",
+            *got, start, inode->num);
+  return start;
+}
+
+/*
+ * While a free batch is open, free_data_block only records the block in a
+ * per-disk mask. Closing the batch applies each mask in one pass, so every
+ * affected bitmap is written and replicated once no matter how many blocks
+ * were released. Each thread has its own batch; blocks stay marked used
+ * until it closes, so no other thread can reuse them early.
+ */
+static _Thread_local struct {
+  char *masks;
+  int *dirty;
+  int depth;
+} free_batch;
+
+void begin_free_batch(void) {
   size_t data_bitmap_size = (sb.num_data_blocks + 7) / 8;
-  char data_block_bitmap[data_bitmap_size];
 
-  for (int i = 0; i < sb.num_data_blocks; i++) {
-    for (int j = 0; j < wfs_ctx.num_disks; j++) {
-      read_data_block_bitmap(data_block_bitmap, j);
+  if (free_batch.depth++ > 0) {
+    return;
+  }
 
-      if (!IS_BIT_SET(data_block_bitmap, i)) {
-        SET_BIT(data_block_bitmap, i);
-        write_data_block_bitmap(data_block_bitmap, j);
-        DEBUG_LOG("Allocated data block %d on disk %d", i, j);
-        return i * wfs_ctx.num_disks + j;
-      }
+  free_batch.masks = calloc(wfs_ctx.num_disks, data_bitmap_size);
+  free_batch.dirty = calloc(wfs_ctx.num_disks, sizeof(int));
+  if (!free_batch.masks || !free_batch.dirty) {
+    // Fall back to freeing block by block.
+    ERROR_LOG("Memory allocation failed for free batch");
+    free(free_batch.masks);
+    free(free_batch.dirty);
+    free_batch.masks = NULL;
+    free_batch.dirty = NULL;
+  }
+}
+
+void end_free_batch(void) {
+  size_t data_bitmap_size = (sb.num_data_blocks + 7) / 8;
+
+  if (free_batch.depth == 0 || --free_batch.depth > 0 || !free_batch.masks) {
+    return;
+  }
+
+  // Blocks go back only after their queued copies have landed.
+  flush_replica_batch();
+  for (int j = 0; j < wfs_ctx.num_disks; j++) {
+    if (free_batch.dirty[j]) {
+      release_data_block_mask(j, free_batch.masks + j * data_bitmap_size);
     }
   }
 
-  ERROR_LOG("No free data blocks available\n");
-  return -ENOSPC;
+  free(free_batch.masks);
+  free(free_batch.dirty);
+  free_batch.masks = NULL;
+  free_batch.dirty = NULL;
 }
 
 void free_data_block(int block_index) {
   int disk_index;
-  block_index = get_raid_disk(block_index, &disk_index);
-  if (block_index < 0 || block_index >= sb.num_data_blocks) {
+  int row = get_raid_disk(block_index, &disk_index);
+  if (row < 0 || row >= sb.num_data_blocks) {
     ERROR_LOG("Invalid data block index %d\n", block_index);
     return;
   }
 
-  char data_block_bitmap[(sb.num_data_blocks + 7) / 8];
-  read_data_block_bitmap(data_block_bitmap, disk_index);
+  if (free_batch.masks) {
+    size_t data_bitmap_size = (sb.num_data_blocks + 7) / 8;
+    char *mask = free_batch.masks + disk_index * data_bitmap_size;
+    SET_BIT(mask, row);
+    free_batch.dirty[disk_index] = 1;
+    return;
+  }
 
-  CLEAR_BIT(data_block_bitmap, block_index);
-  write_data_block_bitmap(data_block_bitmap, disk_index);
+  flush_replica_batch();
+  release_data_block(block_index);
   DEBUG_LOG("Freed data block %d\n", block_index);
 }
 
 void free_direct_data_blocks(struct wfs_inode *inode) {
-  for (int i = 0; i < N_BLOCKS - 1; i++) {
+  invalidate_block_map(inode->num);
+  for (size_t i = 0; i < DIRECT_BLOCKS; i++) {
     if (inode->blocks[i] != -1) {
       free_data_block(inode->blocks[i]);
       inode->blocks[i] = -1;
@@ -141,40 +233,231 @@ void free_direct_data_blocks(struct wfs_inode *inode) {
   }
 }
 
-void free_indirect_data_block(struct wfs_inode *inode) {
-  if (inode->blocks[N_BLOCKS - 1] != -1) {
-    char block_buffer[BLOCK_SIZE];
-    read_data_block(block_buffer, inode->blocks[N_BLOCKS - 1]);
+static const int indirect_root_slots[MAX_TREE_DEPTH] = {IND_BLOCK, DIND_BLOCK,
+                                                        TIND_BLOCK};
 
-    int *indirect_blocks = (int *)block_buffer;
+int get_indirect_region(int depth, int *slot, size_t *base, size_t *span) {
+  int max_depth =
+      (sb.features & WFS_FEATURE_MULTI_INDIRECT) ? MAX_TREE_DEPTH : 1;
+  if (depth < 1 || depth > max_depth) {
+    return -EFBIG;
+  }
 
-    for (int i = 0; i < BLOCK_SIZE / sizeof(int); i++) {
-      if (indirect_blocks[i] != -1) {
-        free_data_block(indirect_blocks[i]);
-        indirect_blocks[i] = -1;
-      }
+  *base = DIRECT_BLOCKS;
+  *span = PTRS_PER_BLOCK;
+  for (int d = 1; d < depth; d++) {
+    *base += *span;
+    *span *= PTRS_PER_BLOCK;
+  }
+  *slot = indirect_root_slots[depth - 1];
+  return 0;
+}
+
+size_t max_file_blocks(void) {
+  int slot;
+  size_t base, span, max_blocks = DIRECT_BLOCKS;
+
+  for (int depth = 1; get_indirect_region(depth, &slot, &base, &span) == 0;
+       depth++) {
+    max_blocks = base + span;
+  }
+  return max_blocks;
+}
+
+/*
+ * The tree walks below read the node at each depth into its own block of
+ * one heap buffer, MAX_TREE_DEPTH blocks long, as allocate_block_range()'s
+ * cursor does, rather than into block-sized arrays on the stack.
+ */
+#define TREE_LEVEL(nodes, depth) ((nodes) + ((depth) - 1) * PTRS_PER_BLOCK)
+
+static int *alloc_tree_levels(void) {
+  int *nodes = malloc(MAX_TREE_DEPTH * BLOCK_SIZE);
+  if (!nodes) {
+    ERROR_LOG("Memory allocation failed for indirect block walk");
+  }
+  return nodes;
+}
+
+static void free_indirect_tree(int block_num, int depth, int *nodes) {
+  int *entries = TREE_LEVEL(nodes, depth);
+  read_data_block(entries, block_num);
+
+  for (int i = 0; i < PTRS_PER_BLOCK; i++) {
+    if (entries[i] == -1) {
+      continue;
+    }
+    if (depth > 1) {
+      free_indirect_tree(entries[i], depth - 1, nodes);
+    } else {
+      free_data_block(entries[i]);
     }
+  }
+
+  free_data_block(block_num);
+}
+
+int free_indirect_data_block(struct wfs_inode *inode) {
+  invalidate_block_map(inode->num);
+
+  int *nodes = alloc_tree_levels();
+  if (!nodes) {
+    return -ENOMEM;
+  }
 
-    free_data_block(inode->blocks[N_BLOCKS - 1]);
-    inode->blocks[N_BLOCKS - 1] = -1;
+  int slot;
+  size_t base, span;
+  for (int depth = 1; get_indirect_region(depth, &slot, &base, &span) == 0;
+       depth++) {
+    if (inode->blocks[slot] != -1) {
+      free_indirect_tree(inode->blocks[slot], depth, nodes);
+      inode->blocks[slot] = -1;
+    }
   }
+
+  free(nodes);
+  return 0;
 }
 
-int add_dentry_to_parent(struct wfs_inode *parent_inode, int parent_inode_num,
-                         const char *dirname, int inode_num) {
-  for (int i = 0; i < N_BLOCKS; i++) {
-    if (parent_inode->blocks[i] == -1) {
+/*
+ * Frees the leaves of the subtree under node that fall in [lo, hi).
+ * Returns 1 if that left node without any entries, in which case node
+ * itself has been freed too.
+ */
+static int free_tree_range(int node, int depth, size_t base, size_t span,
+                           size_t lo, size_t hi, int *nodes) {
+  int *entries = TREE_LEVEL(nodes, depth);
+  size_t child_span = span / PTRS_PER_BLOCK;
+  int dirty = 0, in_use = 0;
+
+  read_data_block(entries, node);
+
+  for (size_t i = 0; i < PTRS_PER_BLOCK; i++) {
+    size_t child_base = base + i * child_span;
+    if (entries[i] == -1) {
+      continue;
+    }
+
+    if (child_base >= hi || child_base + child_span <= lo ||
+        (depth > 1 && !free_tree_range(entries[i], depth - 1, child_base,
+                                       child_span, lo, hi, nodes))) {
+      in_use = 1;
+      continue;
+    }
+
+    if (depth == 1) {
+      free_data_block(entries[i]);
+    }
+    entries[i] = -1;
+    dirty = 1;
+  }
+
+  if (!in_use) {
+    free_data_block(node);
+    return 1;
+  }
+  if (dirty) {
+    write_data_block(entries, node);
+  }
+  return 0;
+}
+
+/*
+ * Unmaps logical blocks [lo, hi) of a regular file, leaving a hole. The
+ * bitmap updates are batched per disk. The caller writes the inode back.
+ */
+int free_block_range(struct wfs_inode *inode, size_t lo, size_t hi) {
+  int N_DIRECT = DIRECT_BLOCKS;
+  int slot;
+  size_t base, span;
+
+  if (inode_uses_extents(inode)) {
+    begin_free_batch();
+    int res = remove_extent_range(inode, lo, hi);
+    end_free_batch();
+    return res;
+  }
+
+  int *nodes = alloc_tree_levels();
+  if (!nodes) {
+    return -ENOMEM;
+  }
+
+  invalidate_block_map(inode->num);
+  begin_free_batch();
+
+  for (size_t i = lo; i < hi && i < N_DIRECT; i++) {
+    if (inode->blocks[i] != -1) {
+      free_data_block(inode->blocks[i]);
+      inode->blocks[i] = -1;
+    }
+  }
+
+  for (int depth = 1; get_indirect_region(depth, &slot, &base, &span) == 0;
+       depth++) {
+    if (base >= hi) {
+      break;
+    }
+    if (base + span <= lo || inode->blocks[slot] == -1) {
+      continue;
+    }
+
+    if (free_tree_range(inode->blocks[slot], depth, base, span, lo, hi,
+                        nodes)) {
+      inode->blocks[slot] = -1;
+    }
+  }
+
+  end_free_batch();
+  free(nodes);
+  DEBUG_LOG("Freed blocks [%zu, %zu) of inode %d", lo, hi, inode->num);
+  return 0;
+}
+
+static int add_hashed_dentry(struct wfs_inode *parent_inode,
+                             int parent_inode_num, const char *dirname,
+                             int inode_num) {
+  int res = dir_index_add(parent_inode, dirname, inode_num);
+  if (res == 0) {
+    parent_inode->size += sizeof(struct wfs_dentry);
+    parent_inode->nlinks++;
+    dir_filter_add(parent_inode, dirname);
+  }
+  write_inode(parent_inode, parent_inode_num);
+  DEBUG_LOG("Added dentry %s (inode %d) to hashed parent %d: %d", dirname,
+            inode_num, parent_inode_num, res);
+  return res;
+}
+
+static int add_unhashed_dentry(struct wfs_inode *parent_inode,
+                               int parent_inode_num, const char *dirname,
+                               int inode_num, char *block_buffer) {
+  // Slots before the free-slot hint are known to be full.
+  int first_slot =
+      inode_has_inline_data(parent_inode) ? 0 : dir_free_slot(parent_inode_num);
+  for (int i = first_slot; i < N_BLOCKS; i++) {
+    if (!inode_has_inline_data(parent_inode) && parent_inode->blocks[i] == -1) {
+      if (i > 0 && (sb.features & WFS_FEATURE_DIR_INDEX)) {
+        // The first block is full: switch to a hashed index instead.
+        int res = dir_index_convert(parent_inode);
+        if (res < 0) {
+          return res;
+        }
+        return add_hashed_dentry(parent_inode, parent_inode_num, dirname,
+                                 inode_num);
+      }
+
       int new_block = allocate_free_data_block();
       if (new_block < 0)
         return new_block;
 
       parent_inode->blocks[i] = new_block;
+      invalidate_block_map(parent_inode_num);
       DEBUG_LOG("Allocated new data block %d for parent inode %d\n", new_block,
                 parent_inode_num);
 
-      struct wfs_dentry
-          new_block_content[BLOCK_SIZE / sizeof(struct wfs_dentry)];
-      memset(new_block_content, -1, sizeof(new_block_content));
+      struct wfs_dentry *new_block_content = (struct wfs_dentry *)block_buffer;
+      memset(new_block_content, -1, BLOCK_SIZE);
 
       new_block_content[0].num = inode_num;
       strncpy(new_block_content[0].name, dirname, MAX_NAME);
@@ -184,29 +467,45 @@ int add_dentry_to_parent(struct wfs_inode *parent_inode, int parent_inode_num,
       parent_inode->size += sizeof(struct wfs_dentry);
       parent_inode->nlinks++;
       write_inode(parent_inode, parent_inode_num);
+      dir_filter_add(parent_inode, dirname);
+      dir_set_free_slot(parent_inode_num, i);
       DEBUG_LOG("Added dentry %s (inode %d) to parent %d in a new block\n",
                 dirname, inode_num, parent_inode_num);
       return 0;
     }
 
-    struct wfs_dentry block_content[BLOCK_SIZE / sizeof(struct wfs_dentry)];
-    read_data_block(block_content, parent_inode->blocks[i]);
+    size_t num_entries;
+    const struct wfs_dentry *slot =
+        map_dentry_slot(parent_inode, i, &num_entries);
+    struct wfs_dentry *block_content = (struct wfs_dentry *)block_buffer;
+    memcpy(block_content, slot, num_entries * sizeof(struct wfs_dentry));
 
-    for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+    for (int j = 0; j < num_entries; j++) {
       if (block_content[j].num == -1) {
         block_content[j].num = inode_num;
         strncpy(block_content[j].name, dirname, MAX_NAME);
 
-        write_data_block(block_content, parent_inode->blocks[i]);
+        write_dentry_slot(parent_inode, i, block_content);
 
         parent_inode->size += sizeof(struct wfs_dentry);
         parent_inode->nlinks++;
         write_inode(parent_inode, parent_inode_num);
+        dir_filter_add(parent_inode, dirname);
+        dir_set_free_slot(parent_inode_num, i);
         DEBUG_LOG("Added dentry %s (inode %d) to parent %d\n", dirname,
                   inode_num, parent_inode_num);
         return 0;
       }
     }
+
+    if (inode_has_inline_data(parent_inode)) {
+      // Inline area is full: move the entries to a block and retry there.
+      int res = unpack_inline_data(parent_inode);
+      if (res < 0) {
+        return res;
+      }
+      i--;
+    }
   }
 
   ERROR_LOG("No space left to add directory entry in parent inode %d\n",
@@ -214,40 +513,60 @@ int add_dentry_to_parent(struct wfs_inode *parent_inode, int parent_inode_num,
   return -ENOSPC;
 }
 
-int allocate_direct_block(struct wfs_inode *inode, size_t block_index) {
+int add_dentry_to_parent(struct wfs_inode *parent_inode, int parent_inode_num,
+                         const char *dirname, int inode_num) {
+  if (dir_is_hashed(parent_inode)) {
+    return add_hashed_dentry(parent_inode, parent_inode_num, dirname,
+                             inode_num);
+  }
+
+  char *block_buffer = malloc(BLOCK_SIZE);
+  if (!block_buffer) {
+    return -ENOMEM;
+  }
+  int res = add_unhashed_dentry(parent_inode, parent_inode_num, dirname,
+                                inode_num, block_buffer);
+  free(block_buffer);
+  return res;
+}
+
+int allocate_direct_block(struct wfs_inode *inode, size_t block_index,
+                          int goal) {
   if (inode->blocks[block_index] == -1) {
-    inode->blocks[block_index] = allocate_free_data_block();
-    if (inode->blocks[block_index] < 0) {
+    size_t got;
+    int block_num = allocate_file_data_run(inode, goal, 1, &got);
+    if (block_num < 0) {
       ERROR_LOG("Failed to allocate data block for direct block %zu\n",
                 block_index);
       return -EIO;
     }
+    inode->blocks[block_index] = block_num;
   }
   return inode->blocks[block_index];
 }
 
 int check_duplicate_dentry(const struct wfs_inode *parent_inode,
                            const char *dirname) {
-  struct wfs_dentry *dentry;
-
-  for (int i = 0; i < N_BLOCKS && parent_inode->blocks[i] != -1; i++) {
-    DEBUG_LOG("Checking block for duplicate directory entry");
+  if (!dir_may_contain(parent_inode, dirname)) {
+    DEBUG_LOG("Filter rules out duplicate dentry %s", dirname);
+    return -ENOENT;
+  }
 
-    int block_index = parent_inode->blocks[i];
+  if (dir_is_hashed(parent_inode)) {
+    return dir_index_lookup(parent_inode, dirname) >= 0 ? 0 : -ENOENT;
+  }
 
-    int disk_index;
-    block_index = get_raid_disk(block_index, &disk_index);
+  for (int i = 0; i < N_BLOCKS; i++) {
+    DEBUG_LOG("Checking block for duplicate directory entry");
 
-    if (disk_index < 0) {
-      ERROR_LOG("Failed to get disk index");
-      return -EIO;
+    size_t num_entries;
+    const struct wfs_dentry *dentry =
+        map_dentry_slot(parent_inode, i, &num_entries);
+    if (!dentry) {
+      break;
     }
 
-    size_t block_offset = DATA_BLOCK_OFFSET(block_index);
-    dentry = (struct wfs_dentry *)((char *)wfs_ctx.disk_mmaps[disk_index] +
-                                   block_offset);
-
-    for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+    for (int j = 0; j < num_entries; j++) {
       if (dentry[j].num != -1 && strcmp(dentry[j].name, dirname) == 0) {
         DEBUG_LOG("Found duplicate dentry");
         return 0; // Found duplicate entry
@@ -258,67 +577,250 @@ int check_duplicate_dentry(const struct wfs_inode *parent_inode,
   return -ENOENT; // No duplicate found
 }
 
-int allocate_indirect_block(struct wfs_inode *inode, size_t block_index,
-                            char *block_buffer) {
-  int N_DIRECT = N_BLOCKS - 1;
+void update_inode_size(struct wfs_inode *inode, size_t inode_num,
+                       off_t new_size) {
+  if (new_size > inode->size) {
+    DEBUG_LOG("Updating inode size");
+    inode->size = new_size;
+    write_inode(inode, inode_num);
+  } else {
+    DEBUG_LOG("Inode size remains unchanged");
+  }
+}
 
-  if (inode->blocks[N_DIRECT] == -1) {
-    DEBUG_LOG("Indirect block not allocated, allocating now");
-    inode->blocks[N_DIRECT] = allocate_free_data_block();
-    if (inode->blocks[N_DIRECT] < 0) {
-      ERROR_LOG("Failed to allocate indirect block");
-      return -EIO;
-    }
+/*
+ * Holds the indirect block currently loaded at each depth of the tree while
+ * a range is being allocated, so every intermediate block is read and written
+ * at most once per request.
+ */
+struct tree_cursor {
+  int block_num[MAX_TREE_DEPTH];
+  int dirty[MAX_TREE_DEPTH];
+  int *entries[MAX_TREE_DEPTH];
+};
+
+static void load_tree_level(struct tree_cursor *cursor, int level,
+                            int block_num, int fresh) {
+  if (cursor->block_num[level] == block_num) {
+    return;
+  }
 
-    memset(block_buffer, -1, BLOCK_SIZE);
-    write_data_block(block_buffer, inode->blocks[N_DIRECT]);
+  if (cursor->block_num[level] != -1 && cursor->dirty[level]) {
+    write_data_block(cursor->entries[level], cursor->block_num[level]);
   }
 
-  read_data_block(block_buffer, inode->blocks[N_DIRECT]);
-  int *indirect_blocks = (int *)block_buffer;
+  cursor->block_num[level] = block_num;
+  cursor->dirty[level] = fresh;
+  if (fresh) {
+    memset(cursor->entries[level], -1, BLOCK_SIZE);
+  } else {
+    read_data_block(cursor->entries[level], block_num);
+  }
+}
 
-  size_t indirect_index = block_index - N_DIRECT;
-  if (indirect_index >= BLOCK_SIZE / sizeof(int)) {
-    ERROR_LOG("Indirect index out of bounds");
-    return -EIO;
+static void flush_tree_cursor(struct tree_cursor *cursor) {
+  for (int level = 0; level < MAX_TREE_DEPTH; level++) {
+    if (cursor->block_num[level] != -1 && cursor->dirty[level]) {
+      write_data_block(cursor->entries[level], cursor->block_num[level]);
+      cursor->dirty[level] = 0;
+    }
   }
+}
 
-  if (indirect_blocks[indirect_index] == -1) {
-    DEBUG_LOG("Indirect entry not allocated, performing lazy allocation");
-    return -1; // Lazy allocation
+static int allocate_tree_node(struct tree_cursor *cursor, int level) {
+  int block_num = allocate_free_data_block();
+  if (block_num < 0) {
+    return block_num;
   }
 
-  return indirect_blocks[indirect_index];
+  DEBUG_LOG("Allocated indirect block %d at tree level %d", block_num, level);
+  load_tree_level(cursor, level, block_num, 1);
+  return block_num;
 }
 
-void update_inode_size(struct wfs_inode *inode, size_t inode_num,
-                       off_t new_size) {
-  if (new_size > inode->size) {
-    DEBUG_LOG("Updating inode size");
-    inode->size = new_size;
-    write_inode(inode, inode_num);
+static int allocate_tree_block(struct wfs_inode *inode,
+                               struct tree_cursor *cursor, size_t block_index,
+                               int goal) {
+  int slot, depth;
+  size_t base, span;
+
+  for (depth = 1;; depth++) {
+    if (get_indirect_region(depth, &slot, &base, &span) < 0) {
+      ERROR_LOG("Block index %zu exceeds maximum file size", block_index);
+      return -EFBIG;
+    }
+    if (block_index < base + span) {
+      break;
+    }
+  }
+
+  if (inode->blocks[slot] == -1) {
+    int node = allocate_tree_node(cursor, 0);
+    if (node < 0) {
+      return node;
+    }
+    inode->blocks[slot] = node;
   } else {
-    DEBUG_LOG("Inode size remains unchanged");
+    load_tree_level(cursor, 0, inode->blocks[slot], 0);
+  }
+
+  size_t rel = block_index - base;
+  size_t stride = span / PTRS_PER_BLOCK;
+  for (int level = 0; level < depth - 1; level++) {
+    size_t entry = (rel / stride) % PTRS_PER_BLOCK;
+    int child = cursor->entries[level][entry];
+
+    if (child == -1) {
+      child = allocate_tree_node(cursor, level + 1);
+      if (child < 0) {
+        return child;
+      }
+      cursor->entries[level][entry] = child;
+      cursor->dirty[level] = 1;
+    } else {
+      load_tree_level(cursor, level + 1, child, 0);
+    }
+    stride /= PTRS_PER_BLOCK;
+  }
+
+  size_t got;
+  int data_block_num = allocate_file_data_run(inode, goal, 1, &got);
+  if (data_block_num < 0) {
+    DEBUG_LOG("Failed to allocate data block for index %zu", block_index);
+    return data_block_num;
   }
+
+  cursor->entries[depth - 1][rel % PTRS_PER_BLOCK] = data_block_num;
+  cursor->dirty[depth - 1] = 1;
+  return data_block_num;
 }
 
-int read_from_indirect_block(struct wfs_inode *inode, size_t indirect_index,
-                             char *block_buffer) {
-  int N_DIRECT = N_BLOCKS - 1;
+/*
+ * Block that would continue the file physically after logical block
+ * first_block - 1, or -1 if there is no such block to follow.
+ */
+static int next_block_goal(const struct wfs_inode *inode, size_t first_block) {
+  int prev;
 
-  if (inode->blocks[N_DIRECT] == -1) {
-    ERROR_LOG("Indirect block not allocated\n");
+  if (first_block == 0 ||
+      resolve_block_range(inode, first_block - 1, 1, &prev) < 0 || prev < 0) {
     return -1;
   }
+  return prev + get_raid_stride();
+}
+
+static int allocate_extent_range(struct wfs_inode *inode, size_t first_block,
+                                 size_t num_blocks, int *blocks) {
+  int stride = get_raid_stride();
+  int changed = 0;
+  int res = 0;
+
+  if (first_block + num_blocks > UINT32_MAX) {
+    ERROR_LOG("Block index %zu exceeds maximum file size",
+              first_block + num_blocks - 1);
+    return -EFBIG;
+  }
 
-  read_data_block(block_buffer, inode->blocks[N_DIRECT]);
+  for (size_t i = 0; i < num_blocks && res == 0;) {
+    if (blocks[i] != -1) {
+      i++;
+      continue;
+    }
 
-  int *indirect_blocks = (int *)block_buffer;
-  if (indirect_blocks[indirect_index] == -1) {
-    DEBUG_LOG("No data block allocated at indirect index %zu\n",
-              indirect_index);
-    return -1;
+    size_t hole = 0;
+    while (i + hole < num_blocks && blocks[i + hole] == -1) {
+      hole++;
+    }
+
+    size_t got;
+    int goal = i > 0 ? blocks[i - 1] + stride
+                     : next_block_goal(inode, first_block);
+    int start = allocate_file_data_run(inode, goal, hole, &got);
+    if (start < 0) {
+      res = start;
+      break;
+    }
+
+    res = insert_extent(inode, first_block + i, start, got);
+    if (res < 0) {
+      for (size_t k = 0; k < got; k++) {
+        free_data_block(start + k * stride);
+      }
+      break;
+    }
+
+    for (size_t k = 0; k < got; k++) {
+      blocks[i + k] = start + k * stride;
+    }
+    i += got;
+    changed = 1;
+  }
+
+  if (changed) {
+    invalidate_block_map(inode->num);
+  }
+
+  return res;
+}
+
+int allocate_block_range(struct wfs_inode *inode, size_t first_block,
+                         size_t num_blocks, int *blocks) {
+  int N_DIRECT = DIRECT_BLOCKS;
+  struct tree_cursor cursor;
+  int changed = 0;
+  int res = 0;
+  int goal;
+
+  if (inode_uses_extents(inode)) {
+    return allocate_extent_range(inode, first_block, num_blocks, blocks);
+  }
+
+  int *cursor_blocks = malloc(MAX_TREE_DEPTH * BLOCK_SIZE);
+  if (!cursor_blocks) {
+    ERROR_LOG("Memory allocation failed for indirect block cursor");
+    return -ENOMEM;
+  }
+
+  for (int level = 0; level < MAX_TREE_DEPTH; level++) {
+    cursor.block_num[level] = -1;
+    cursor.dirty[level] = 0;
+    cursor.entries[level] = cursor_blocks + level * PTRS_PER_BLOCK;
+  }
+
+  goal = next_block_goal(inode, first_block);
+  for (size_t i = 0; i < num_blocks; i++) {
+    size_t block_index = first_block + i;
+    if (blocks[i] != -1) {
+      goal = blocks[i] + get_raid_stride();
+      continue;
+    }
+
+    int data_block_num;
+    if (block_index < N_DIRECT) {
+      data_block_num = allocate_direct_block(inode, block_index, goal);
+      if (data_block_num < 0) {
+        data_block_num = -ENOSPC;
+      }
+    } else {
+      data_block_num =
+          allocate_tree_block(inode, &cursor, block_index, goal);
+    }
+
+    if (data_block_num < 0) {
+      res = data_block_num;
+      break;
+    }
+
+    blocks[i] = data_block_num;
+    goal = data_block_num + get_raid_stride();
+    changed = 1;
+  }
+
+  flush_tree_cursor(&cursor);
+  free(cursor_blocks);
+  if (changed) {
+    invalidate_block_map(inode->num);
   }
 
-  return indirect_blocks[indirect_index];
+  return res;
 }
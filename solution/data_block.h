@@ -3,23 +3,34 @@
 
 #include "wfs.h"
 #include <stddef.h>
-void read_data_block(void *block, size_t block_index);
+
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(int))
+#define MAX_TREE_DEPTH 3
+
+size_t get_data_block_location(size_t block_index, int *disk_index);
+int read_data_block(void *block, size_t block_index);
 void write_data_block(const void *block, size_t block_index);
-void read_data_block_bitmap(char *data_block_bitmap);
-void write_data_block_bitmap(const char *data_block_bitmap);
+void read_data_block_bitmap(char *data_block_bitmap, int disk_index);
+void write_data_block_bitmap(const char *data_block_bitmap, int disk_index);
 int allocate_free_data_block();
+int allocate_file_data_run(const struct wfs_inode *inode, int goal,
+                           size_t want, size_t *got);
 void free_data_block(int block_index);
+void begin_free_batch(void);
+void end_free_batch(void);
 int check_duplicate_dentry(const struct wfs_inode *parent_inode,
                            const char *dirname);
 int add_dentry_to_parent(struct wfs_inode *parent_inode, int parent_inode_num,
                          const char *dirname, int inode_num);
-int allocate_indirect_block(struct wfs_inode *inode, size_t block_index,
-                            char *block_buffer);
-int allocate_direct_block(struct wfs_inode *inode, size_t block_index);
+int allocate_direct_block(struct wfs_inode *inode, size_t block_index,
+                          int goal);
+int allocate_block_range(struct wfs_inode *inode, size_t first_block,
+                         size_t num_blocks, int *blocks);
 void update_inode_size(struct wfs_inode *inode, size_t inode_num,
                        off_t new_size);
-int read_from_indirect_block(struct wfs_inode *inode, size_t indirect_index,
-                             char *block_buffer);
 void free_direct_data_blocks(struct wfs_inode *inode);
-void free_indirect_data_block(struct wfs_inode *inode);
+int free_indirect_data_block(struct wfs_inode *inode);
+int free_block_range(struct wfs_inode *inode, size_t lo, size_t hi);
+int get_indirect_region(int depth, int *slot, size_t *base, size_t *span);
+size_t max_file_blocks(void);
 #endif
@@ -0,0 +1,196 @@
+#include "dcache.h"
+#include "globals.h"
+#include "wfs.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DCACHE_SLOTS 4096
+#define PATH_CACHE_SLOTS 1024
+
+/*
+ * Lookup results kept in memory so a path is not resolved by scanning
+ * every dentry block of every ancestor on each call. The dentry cache maps
+ * (parent inode, name) to an inode number and the path cache maps a whole
+ * path; both also remember -ENOENT. Tables are direct-mapped by hash and a
+ * colliding entry simply replaces the old one.
+ *
+ * Entries are only dropped when the namespace changes under them: creating
+ * or removing a name invalidates that name and its path, and removing a
+ * directory forgets everything that was looked up inside it. Directories
+ * are created and removed empty, so no other cached path changes meaning.
+ *
+ * dcache_lock guards both tables. Dentry entries are filled while the
+ * parent directory is locked, so they cannot race a change to it. A path
+ * is resolved without holding every directory on it, so path entries are
+ * only stored if no invalidation happened since the walk began.
+ */
+struct dentry_entry {
+  int in_use;
+  int parent_inode_num;
+  int inode_num; /* -ENOENT for a negative entry */
+  char name[MAX_NAME];
+};
+
+struct path_entry {
+  char *path; /* NULL when the slot is unused */
+  int inode_num;
+};
+
+static struct dentry_entry dentries[DCACHE_SLOTS];
+static struct path_entry paths[PATH_CACHE_SLOTS];
+static unsigned long path_generation;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_name(uint32_t hash, const char *name) {
+  // FNV-1a
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static struct dentry_entry *dentry_slot(int parent_inode_num,
+                                        const char *name) {
+  uint32_t hash = hash_name(2166136261u ^ (uint32_t)parent_inode_num, name);
+  return &dentries[hash % DCACHE_SLOTS];
+}
+
+static struct path_entry *path_slot(const char *path) {
+  return &paths[hash_name(2166136261u, path) % PATH_CACHE_SLOTS];
+}
+
+static void clear_path_entry(struct path_entry *entry) {
+  free(entry->path);
+  entry->path = NULL;
+}
+
+int dcache_lookup(int parent_inode_num, const char *name, int *inode_num) {
+  int found = 0;
+  pthread_mutex_lock(&dcache_lock);
+  const struct dentry_entry *entry = dentry_slot(parent_inode_num, name);
+  if (entry->in_use && entry->parent_inode_num == parent_inode_num &&
+      strcmp(entry->name, name) == 0) {
+    *inode_num = entry->inode_num;
+    found = 1;
+  }
+  pthread_mutex_unlock(&dcache_lock);
+  return found;
+}
+
+void dcache_insert(int parent_inode_num, const char *name, int inode_num) {
+  // Longer names can never match a dentry, so they are not worth a slot.
+  if (strlen(name) >= MAX_NAME) {
+    return;
+  }
+
+  pthread_mutex_lock(&dcache_lock);
+  struct dentry_entry *entry = dentry_slot(parent_inode_num, name);
+  entry->in_use = 1;
+  entry->parent_inode_num = parent_inode_num;
+  entry->inode_num = inode_num;
+  strcpy(entry->name, name);
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+int path_cache_lookup(const char *path, int *inode_num) {
+  int found = 0;
+  pthread_mutex_lock(&dcache_lock);
+  const struct path_entry *entry = path_slot(path);
+  if (entry->path && strcmp(entry->path, path) == 0) {
+    *inode_num = entry->inode_num;
+    found = 1;
+  }
+  pthread_mutex_unlock(&dcache_lock);
+  return found;
+}
+
+/*
+ * Taken before resolving a path and handed back to path_cache_insert().
+ */
+unsigned long path_cache_generation(void) {
+  pthread_mutex_lock(&dcache_lock);
+  unsigned long generation = path_generation;
+  pthread_mutex_unlock(&dcache_lock);
+  return generation;
+}
+
+void path_cache_insert(const char *path, int inode_num,
+                       unsigned long generation) {
+  pthread_mutex_lock(&dcache_lock);
+  struct path_entry *entry = path_slot(path);
+  if (generation != path_generation) {
+    // The namespace changed during the walk; the answer may be stale.
+  } else if (entry->path && strcmp(entry->path, path) == 0) {
+    entry->inode_num = inode_num;
+  } else {
+    char *copy = strdup(path);
+    if (copy) {
+      clear_path_entry(entry);
+      entry->path = copy;
+      entry->inode_num = inode_num;
+    }
+  }
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * Called once a name has been added to or removed from a directory. path
+ * is NULL for callers that address files by inode number; they never fill
+ * the path cache, so there is nothing there to drop.
+ */
+void dcache_invalidate(int parent_inode_num, const char *name,
+                       const char *path) {
+  pthread_mutex_lock(&dcache_lock);
+  struct dentry_entry *entry = dentry_slot(parent_inode_num, name);
+  if (entry->in_use && entry->parent_inode_num == parent_inode_num &&
+      strcmp(entry->name, name) == 0) {
+    entry->in_use = 0;
+  }
+  path_generation++;
+
+  if (path) {
+    struct path_entry *path_entry = path_slot(path);
+    if (path_entry->path && strcmp(path_entry->path, path) == 0) {
+      clear_path_entry(path_entry);
+    }
+    DEBUG_LOG("Invalidated cached lookup of %s", path);
+  }
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * Called when a directory is removed. Its inode number can be reused by a
+ * new directory, so nothing looked up beneath it may survive. path may be
+ * NULL, as for dcache_invalidate().
+ */
+void dcache_forget_dir(int dir_inode_num, const char *path) {
+  pthread_mutex_lock(&dcache_lock);
+  for (size_t i = 0; i < DCACHE_SLOTS; i++) {
+    if (dentries[i].parent_inode_num == dir_inode_num) {
+      dentries[i].in_use = 0;
+    }
+  }
+  path_generation++;
+
+  if (path) {
+    size_t len = strlen(path);
+    for (size_t i = 0; i < PATH_CACHE_SLOTS; i++) {
+      if (paths[i].path && strncmp(paths[i].path, path, len) == 0 &&
+          paths[i].path[len] == '/') {
+        clear_path_entry(&paths[i]);
+      }
+    }
+    DEBUG_LOG("Forgot cached lookups under %s", path);
+  }
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+void destroy_dcache(void) {
+  for (size_t i = 0; i < PATH_CACHE_SLOTS; i++) {
+    clear_path_entry(&paths[i]);
+  }
+  memset(dentries, 0, sizeof(dentries));
+}
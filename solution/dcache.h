@@ -0,0 +1,14 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+int dcache_lookup(int parent_inode_num, const char *name, int *inode_num);
+void dcache_insert(int parent_inode_num, const char *name, int inode_num);
+int path_cache_lookup(const char *path, int *inode_num);
+unsigned long path_cache_generation(void);
+void path_cache_insert(const char *path, int inode_num,
+                       unsigned long generation);
+void dcache_invalidate(int parent_inode_num, const char *name,
+                       const char *path);
+void dcache_forget_dir(int dir_inode_num, const char *path);
+void destroy_dcache(void);
+#endif
@@ -0,0 +1,188 @@
+#include "dir_filter.h"
+#include "globals.h"
+#include "inode.h"
+#include "wfs.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIR_FILTER_SLOTS 64
+#define DIR_FILTER_PROBES 3
+// Bits per name a filter is built with, and the fewest it may fall to.
+#define DIR_FILTER_BITS_PER_NAME 16
+#define DIR_FILTER_MIN_BITS_PER_NAME 8
+#define DIR_FILTER_MIN_BITS 1024
+
+/*
+ * In-memory hints about one directory, so creating a name does not scan
+ * the whole directory twice. The Bloom filter holds every name in the
+ * directory and answers "definitely absent" for most others; it is built
+ * by one scan the first time it is needed after mount and rebuilt larger
+ * once it fills up. Removed names stay in it until then. free_slot is a
+ * dentry slot such that every slot before it is known to be full.
+ *
+ * Slots are direct-mapped by inode number and a colliding directory
+ * simply takes the slot over. dir_filter_lock guards the table, since two
+ * directories can share a slot.
+ */
+struct dir_filter {
+  int in_use;
+  int inode_num;
+  uint64_t *bits; /* NULL until built */
+  size_t num_bits; /* power of two */
+  size_t num_names;
+  int free_slot;
+};
+
+static struct dir_filter dir_filters[DIR_FILTER_SLOTS];
+static pthread_mutex_t dir_filter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dir_filter *get_dir_filter(int inode_num) {
+  struct dir_filter *filter = &dir_filters[inode_num % DIR_FILTER_SLOTS];
+
+  if (!filter->in_use || filter->inode_num != inode_num) {
+    free(filter->bits);
+    memset(filter, 0, sizeof(*filter));
+    filter->in_use = 1;
+    filter->inode_num = inode_num;
+  }
+  return filter;
+}
+
+static void hash_probes(const char *name, uint32_t *h1, uint32_t *h2) {
+  // FNV-1a, and a second hash for double hashing.
+  uint32_t a = 2166136261u, b = 0x9747b28cu;
+  for (size_t i = 0; i < MAX_NAME && name[i]; i++) {
+    a = (a ^ (unsigned char)name[i]) * 16777619u;
+    b = (b ^ (unsigned char)name[i]) * 0x5bd1e995u;
+    b ^= b >> 15;
+  }
+  *h1 = a;
+  *h2 = b | 1;
+}
+
+static void add_name(struct dir_filter *filter, const char *name) {
+  uint32_t h1, h2;
+  hash_probes(name, &h1, &h2);
+  for (int k = 0; k < DIR_FILTER_PROBES; k++) {
+    size_t bit = (h1 + k * h2) & (filter->num_bits - 1);
+    filter->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+  filter->num_names++;
+}
+
+static int has_name(const struct dir_filter *filter, const char *name) {
+  uint32_t h1, h2;
+  hash_probes(name, &h1, &h2);
+  for (int k = 0; k < DIR_FILTER_PROBES; k++) {
+    size_t bit = (h1 + k * h2) & (filter->num_bits - 1);
+    if (!(filter->bits[bit / 64] & ((uint64_t)1 << (bit % 64)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int add_dentry_name(const struct wfs_dentry *entry, void *arg) {
+  char name[MAX_NAME + 1];
+  memcpy(name, entry->name, MAX_NAME);
+  name[MAX_NAME] = '\0';
+  add_name(arg, name);
+  return 0;
+}
+
+static int build_dir_filter(struct dir_filter *filter,
+                            const struct wfs_inode *dir) {
+  // Sizes only grow, so this overestimates the names left in dir.
+  size_t names = dir->size / sizeof(struct wfs_dentry);
+  size_t num_bits = DIR_FILTER_MIN_BITS;
+  while (num_bits < names * DIR_FILTER_BITS_PER_NAME) {
+    num_bits *= 2;
+  }
+
+  filter->bits = calloc(num_bits / 64, sizeof(uint64_t));
+  if (!filter->bits) {
+    ERROR_LOG("Failed to allocate filter for directory %d", dir->num);
+    return -1;
+  }
+  filter->num_bits = num_bits;
+  filter->num_names = 0;
+
+  for_each_dentry(dir, add_dentry_name, filter);
+
+  DEBUG_LOG("Built %zu-bit filter over %zu names of directory %d", num_bits,
+            filter->num_names, dir->num);
+  return 0;
+}
+
+/*
+ * Returns 0 when name is certainly not in dir, 1 when it may be.
+ */
+int dir_may_contain(const struct wfs_inode *dir, const char *name) {
+  int may_contain = 1;
+  pthread_mutex_lock(&dir_filter_lock);
+  struct dir_filter *filter = get_dir_filter(dir->num);
+  if (filter->bits || build_dir_filter(filter, dir) == 0) {
+    may_contain = has_name(filter, name);
+  }
+  pthread_mutex_unlock(&dir_filter_lock);
+  return may_contain;
+}
+
+void dir_filter_add(const struct wfs_inode *dir, const char *name) {
+  pthread_mutex_lock(&dir_filter_lock);
+  struct dir_filter *filter = get_dir_filter(dir->num);
+  if (!filter->bits) {
+    // Not built yet; the first query will pick the name up.
+  } else if ((filter->num_names + 1) * DIR_FILTER_MIN_BITS_PER_NAME >
+             filter->num_bits) {
+    // Too full to stay useful; rebuild on the next query.
+    free(filter->bits);
+    filter->bits = NULL;
+  } else {
+    add_name(filter, name);
+  }
+  pthread_mutex_unlock(&dir_filter_lock);
+}
+
+int dir_free_slot(int dir_inode_num) {
+  pthread_mutex_lock(&dir_filter_lock);
+  int slot = get_dir_filter(dir_inode_num)->free_slot;
+  pthread_mutex_unlock(&dir_filter_lock);
+  return slot;
+}
+
+void dir_set_free_slot(int dir_inode_num, int slot) {
+  pthread_mutex_lock(&dir_filter_lock);
+  get_dir_filter(dir_inode_num)->free_slot = slot;
+  pthread_mutex_unlock(&dir_filter_lock);
+}
+
+void dir_note_free_slot(int dir_inode_num, int slot) {
+  pthread_mutex_lock(&dir_filter_lock);
+  struct dir_filter *filter = get_dir_filter(dir_inode_num);
+  if (slot < filter->free_slot) {
+    filter->free_slot = slot;
+  }
+  pthread_mutex_unlock(&dir_filter_lock);
+}
+
+void dir_filter_forget(int inode_num) {
+  struct dir_filter *filter = &dir_filters[inode_num % DIR_FILTER_SLOTS];
+  pthread_mutex_lock(&dir_filter_lock);
+  if (filter->in_use && filter->inode_num == inode_num) {
+    free(filter->bits);
+    memset(filter, 0, sizeof(*filter));
+  }
+  pthread_mutex_unlock(&dir_filter_lock);
+}
+
+void destroy_dir_filters(void) {
+  pthread_mutex_lock(&dir_filter_lock);
+  for (int i = 0; i < DIR_FILTER_SLOTS; i++) {
+    free(dir_filters[i].bits);
+    memset(&dir_filters[i], 0, sizeof(dir_filters[i]));
+  }
+  pthread_mutex_unlock(&dir_filter_lock);
+}
@@ -0,0 +1,13 @@
+#ifndef DIR_FILTER_H
+#define DIR_FILTER_H
+
+#include "wfs.h"
+
+int dir_may_contain(const struct wfs_inode *dir, const char *name);
+void dir_filter_add(const struct wfs_inode *dir, const char *name);
+int dir_free_slot(int dir_inode_num);
+void dir_set_free_slot(int dir_inode_num, int slot);
+void dir_note_free_slot(int dir_inode_num, int slot);
+void dir_filter_forget(int inode_num);
+void destroy_dir_filters(void);
+#endif
@@ -0,0 +1,549 @@
+#include "dir_index.h"
+#include "block_map.h"
+#include "data_block.h"
+#include "globals.h"
+#include "inode.h"
+#include "wfs.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIR_INDEX_MAGIC 0xd1e7
+#define DIR_BUCKET_MAGIC 0xb0c7
+#define DIR_INDEX_MAX_DEPTH 24
+
+// Table entries follow the header in the directory's first block.
+#define TABLE_BASE (sizeof(struct wfs_dir_index) / sizeof(int32_t))
+#define BUCKET_ENTRIES (BLOCK_SIZE / sizeof(struct wfs_dentry) - 1)
+#define BUCKET_DENTRIES(bucket) ((struct wfs_dentry *)((bucket) + 1))
+
+/*
+ * One block of the bucket table, read in and written back when the cursor
+ * moves on. Table blocks are allocated on first use, which is how the
+ * table grows into the directory's indirect blocks. The cursor also
+ * carries the block buffers its callers work on, so none of them sit on
+ * the stack; they share one heap allocation with entries.
+ */
+struct table_cursor {
+  struct wfs_inode *dir;
+  size_t logical; /* directory block held in entries, SIZE_MAX for none */
+  int block_num;
+  int dirty;
+  int32_t *entries;
+  char *bucket; /* the bucket being read or changed */
+  char *spare;  /* a new bucket, or a second table block */
+};
+
+// FNV-1a over at most the MAX_NAME bytes a dentry can hold.
+static uint32_t hash_name(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < MAX_NAME && name[i]; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t low_bits(uint32_t value, uint32_t depth) {
+  return depth == 0 ? 0 : value & (UINT32_MAX >> (32 - depth));
+}
+
+int dir_is_hashed(const struct wfs_inode *inode) {
+  return (inode->flags & WFS_INODE_HASHED) != 0;
+}
+
+static int init_cursor(struct table_cursor *cursor, struct wfs_inode *dir) {
+  char *buffers = malloc(3 * BLOCK_SIZE);
+  if (!buffers) {
+    ERROR_LOG("Failed to allocate index buffers for directory %d", dir->num);
+    return -ENOMEM;
+  }
+
+  cursor->dir = dir;
+  cursor->logical = SIZE_MAX;
+  cursor->block_num = -1;
+  cursor->dirty = 0;
+  cursor->entries = (int32_t *)buffers;
+  cursor->bucket = buffers + BLOCK_SIZE;
+  cursor->spare = buffers + 2 * BLOCK_SIZE;
+  return 0;
+}
+
+static void release_cursor(struct table_cursor *cursor) {
+  free(cursor->entries);
+}
+
+static void flush_cursor(struct table_cursor *cursor) {
+  if (cursor->dirty) {
+    write_data_block(cursor->entries, cursor->block_num);
+    cursor->dirty = 0;
+  }
+}
+
+static int load_table_block(struct table_cursor *cursor, size_t logical,
+                            int allocate) {
+  if (cursor->logical == logical) {
+    return 0;
+  }
+  flush_cursor(cursor);
+  cursor->logical = SIZE_MAX;
+
+  int block_num;
+  int res = resolve_block_range(cursor->dir, logical, 1, &block_num);
+  if (res < 0) {
+    return res;
+  }
+
+  if (block_num != -1) {
+    read_data_block(cursor->entries, block_num);
+  } else if (allocate) {
+    res = allocate_block_range(cursor->dir, logical, 1, &block_num);
+    if (res < 0) {
+      return res;
+    }
+    memset(cursor->entries, -1, BLOCK_SIZE);
+    cursor->dirty = 1;
+  } else {
+    ERROR_LOG("Directory %d has no table block %zu", cursor->dir->num,
+              logical);
+    return -EIO;
+  }
+
+  cursor->logical = logical;
+  cursor->block_num = block_num;
+  return 0;
+}
+
+static struct wfs_dir_index *load_header(struct table_cursor *cursor) {
+  if (load_table_block(cursor, 0, 0) < 0) {
+    return NULL;
+  }
+  return (struct wfs_dir_index *)cursor->entries;
+}
+
+static int get_table_entry(struct table_cursor *cursor, size_t i) {
+  size_t pos = TABLE_BASE + i;
+  int res = load_table_block(cursor, pos / PTRS_PER_BLOCK, 0);
+  if (res < 0) {
+    return res;
+  }
+  return cursor->entries[pos % PTRS_PER_BLOCK];
+}
+
+static int set_table_entry(struct table_cursor *cursor, size_t i,
+                           int bucket_num) {
+  size_t pos = TABLE_BASE + i;
+  int res = load_table_block(cursor, pos / PTRS_PER_BLOCK, 1);
+  if (res < 0) {
+    return res;
+  }
+  cursor->entries[pos % PTRS_PER_BLOCK] = bucket_num;
+  cursor->dirty = 1;
+  return 0;
+}
+
+/*
+ * Returns the block number of the bucket covering hash.
+ */
+static int find_bucket(struct table_cursor *cursor, uint32_t hash) {
+  const struct wfs_dir_index *header = load_header(cursor);
+  if (!header || header->magic != DIR_INDEX_MAGIC) {
+    ERROR_LOG("Directory %d has a corrupt index", cursor->dir->num);
+    return -EIO;
+  }
+  return get_table_entry(cursor, low_bits(hash, header->global_depth));
+}
+
+static int new_bucket(uint32_t depth, char *buffer) {
+  int bucket_num = allocate_free_data_block();
+  if (bucket_num < 0) {
+    return bucket_num;
+  }
+
+  struct wfs_dir_bucket *bucket = (struct wfs_dir_bucket *)buffer;
+  memset(buffer, -1, BLOCK_SIZE);
+  memset(bucket, 0, sizeof(*bucket));
+  bucket->magic = DIR_BUCKET_MAGIC;
+  bucket->depth = depth;
+  return bucket_num;
+}
+
+/*
+ * Doubles the bucket table; every new entry starts out sharing the bucket
+ * of the entry it mirrors.
+ */
+static int double_table(struct table_cursor *cursor) {
+  const struct wfs_dir_index *header = load_header(cursor);
+  if (!header) {
+    return -EIO;
+  }
+
+  uint32_t depth = header->global_depth;
+  size_t size = (size_t)1 << depth;
+  if (depth >= DIR_INDEX_MAX_DEPTH ||
+      TABLE_BASE + 2 * size > max_file_blocks() * PTRS_PER_BLOCK) {
+    ERROR_LOG("Directory %d index cannot grow past depth %u",
+              cursor->dir->num, depth);
+    return -ENOSPC;
+  }
+
+  flush_cursor(cursor);
+  cursor->logical = SIZE_MAX;
+
+  // A second cursor reads the old half while the first writes the new one.
+  struct table_cursor source = *cursor;
+  source.entries = (int32_t *)cursor->spare;
+
+  for (size_t i = 0; i < size; i++) {
+    int bucket_num = get_table_entry(&source, i);
+    if (bucket_num < 0) {
+      return bucket_num;
+    }
+    int res = set_table_entry(cursor, size + i, bucket_num);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  struct wfs_dir_index *new_header = load_header(cursor);
+  if (!new_header) {
+    return -EIO;
+  }
+  new_header->global_depth = depth + 1;
+  cursor->dirty = 1;
+  DEBUG_LOG("Directory %d index grew to depth %u", cursor->dir->num,
+            depth + 1);
+  return 0;
+}
+
+/*
+ * Splits the full bucket covering hash in two on the next hash bit,
+ * doubling the table first when the bucket is already as deep as it.
+ */
+static int split_bucket(struct table_cursor *cursor, int bucket_num,
+                        uint32_t hash) {
+  char *buffer = cursor->bucket;
+  struct wfs_dir_bucket *bucket = (struct wfs_dir_bucket *)buffer;
+  uint32_t depth = bucket->depth;
+
+  const struct wfs_dir_index *header = load_header(cursor);
+  if (!header) {
+    return -EIO;
+  }
+  if (depth == header->global_depth) {
+    int res = double_table(cursor);
+    if (res < 0) {
+      return res;
+    }
+    header = load_header(cursor);
+    if (!header) {
+      return -EIO;
+    }
+  }
+  size_t size = (size_t)1 << header->global_depth;
+
+  char *sibling_buffer = cursor->spare;
+  int sibling_num = new_bucket(depth + 1, sibling_buffer);
+  if (sibling_num < 0) {
+    return sibling_num;
+  }
+  struct wfs_dir_bucket *sibling = (struct wfs_dir_bucket *)sibling_buffer;
+
+  struct wfs_dentry *entries = BUCKET_DENTRIES(bucket);
+  struct wfs_dentry *sibling_entries = BUCKET_DENTRIES(sibling);
+  for (size_t j = 0; j < BUCKET_ENTRIES; j++) {
+    if (entries[j].num == -1 ||
+        ((hash_name(entries[j].name) >> depth) & 1) == 0) {
+      continue;
+    }
+    sibling_entries[sibling->count++] = entries[j];
+    memset(&entries[j], -1, sizeof(entries[j]));
+    bucket->count--;
+  }
+  bucket->depth = depth + 1;
+  write_data_block(buffer, bucket_num);
+  write_data_block(sibling_buffer, sibling_num);
+
+  size_t step = (size_t)1 << (depth + 1);
+  for (size_t i = low_bits(hash, depth) | ((size_t)1 << depth); i < size;
+       i += step) {
+    int res = set_table_entry(cursor, i, sibling_num);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  DEBUG_LOG("Split bucket %d of directory %d into %d at depth %u", bucket_num,
+            cursor->dir->num, sibling_num, depth + 1);
+  return 0;
+}
+
+static int init_dir_index(struct wfs_inode *dir) {
+  struct table_cursor cursor;
+  int res = init_cursor(&cursor, dir);
+  if (res < 0) {
+    return res;
+  }
+
+  int bucket_num = new_bucket(0, cursor.bucket);
+  if (bucket_num < 0) {
+    release_cursor(&cursor);
+    return bucket_num;
+  }
+  write_data_block(cursor.bucket, bucket_num);
+
+  res = set_table_entry(&cursor, 0, bucket_num);
+  if (res < 0) {
+    free_data_block(bucket_num);
+    release_cursor(&cursor);
+    return res;
+  }
+
+  struct wfs_dir_index *header = (struct wfs_dir_index *)cursor.entries;
+  memset(header, 0, sizeof(*header));
+  header->magic = DIR_INDEX_MAGIC;
+  flush_cursor(&cursor);
+  release_cursor(&cursor);
+  return 0;
+}
+
+int dir_index_lookup(const struct wfs_inode *dir, const char *name) {
+  struct wfs_inode copy = *dir;
+  struct table_cursor cursor;
+  int res = init_cursor(&cursor, &copy);
+  if (res < 0) {
+    return res;
+  }
+
+  res = find_bucket(&cursor, hash_name(name));
+  if (res >= 0) {
+    read_data_block(cursor.bucket, res);
+    const struct wfs_dentry *entries =
+        BUCKET_DENTRIES((struct wfs_dir_bucket *)cursor.bucket);
+    res = -ENOENT;
+    for (size_t j = 0; j < BUCKET_ENTRIES; j++) {
+      if (entries[j].num != -1 && strcmp(entries[j].name, name) == 0) {
+        res = entries[j].num;
+        break;
+      }
+    }
+  }
+
+  release_cursor(&cursor);
+  return res;
+}
+
+/*
+ * Adds a dentry to a hashed directory. The table may grow, so the caller
+ * writes the directory inode back whatever the outcome.
+ */
+int dir_index_add(struct wfs_inode *dir, const char *name, int inode_num) {
+  uint32_t hash = hash_name(name);
+  struct table_cursor cursor;
+  int res = init_cursor(&cursor, dir);
+  if (res < 0) {
+    return res;
+  }
+  char *buffer = cursor.bucket;
+
+  for (;;) {
+    int bucket_num = find_bucket(&cursor, hash);
+    if (bucket_num < 0) {
+      res = bucket_num;
+      break;
+    }
+
+    read_data_block(buffer, bucket_num);
+    struct wfs_dir_bucket *bucket = (struct wfs_dir_bucket *)buffer;
+    if (bucket->count < BUCKET_ENTRIES) {
+      struct wfs_dentry *entries = BUCKET_DENTRIES(bucket);
+      size_t j = 0;
+      while (entries[j].num != -1) {
+        j++;
+      }
+      entries[j].num = inode_num;
+      strncpy(entries[j].name, name, MAX_NAME);
+      bucket->count++;
+      write_data_block(buffer, bucket_num);
+      res = 0;
+      break;
+    }
+
+    res = split_bucket(&cursor, bucket_num, hash);
+    if (res < 0) {
+      break;
+    }
+  }
+
+  flush_cursor(&cursor);
+  release_cursor(&cursor);
+  return res;
+}
+
+int dir_index_remove(struct wfs_inode *dir, const char *name,
+                     int inode_num) {
+  struct table_cursor cursor;
+  int res = init_cursor(&cursor, dir);
+  if (res < 0) {
+    return res;
+  }
+
+  int bucket_num = find_bucket(&cursor, hash_name(name));
+  res = bucket_num < 0 ? bucket_num : -ENOENT;
+  if (bucket_num >= 0) {
+    char *buffer = cursor.bucket;
+    read_data_block(buffer, bucket_num);
+    struct wfs_dir_bucket *bucket = (struct wfs_dir_bucket *)buffer;
+    struct wfs_dentry *entries = BUCKET_DENTRIES(bucket);
+    for (size_t j = 0; j < BUCKET_ENTRIES; j++) {
+      if (entries[j].num == inode_num && strcmp(entries[j].name, name) == 0) {
+        memset(&entries[j], -1, sizeof(entries[j]));
+        bucket->count--;
+        write_data_block(buffer, bucket_num);
+        res = 0;
+        break;
+      }
+    }
+  }
+
+  release_cursor(&cursor);
+  return res;
+}
+
+/*
+ * Calls fn on every dentry until it returns non-zero, and returns that.
+ * Each bucket is visited at the first table entry pointing at it, which is
+ * the one below 2^depth.
+ */
+int dir_index_for_each(const struct wfs_inode *dir,
+                       int (*fn)(const struct wfs_dentry *, void *),
+                       void *arg) {
+  struct wfs_inode copy = *dir;
+  struct table_cursor cursor;
+  int res = init_cursor(&cursor, &copy);
+  if (res < 0) {
+    return res;
+  }
+
+  const struct wfs_dir_index *header = load_header(&cursor);
+  if (!header) {
+    release_cursor(&cursor);
+    return -EIO;
+  }
+  size_t size = (size_t)1 << header->global_depth;
+
+  const struct wfs_dir_bucket *bucket = (struct wfs_dir_bucket *)cursor.bucket;
+  for (size_t i = 0; res == 0 && i < size; i++) {
+    int bucket_num = get_table_entry(&cursor, i);
+    if (bucket_num < 0) {
+      res = bucket_num;
+      break;
+    }
+
+    read_data_block(cursor.bucket, bucket_num);
+    if (i >= ((size_t)1 << bucket->depth) || bucket->count == 0) {
+      continue;
+    }
+
+    const struct wfs_dentry *entries = BUCKET_DENTRIES(bucket);
+    for (size_t j = 0; res == 0 && j < BUCKET_ENTRIES; j++) {
+      if (entries[j].num != -1) {
+        res = fn(&entries[j], arg);
+      }
+    }
+  }
+
+  release_cursor(&cursor);
+  return res;
+}
+
+/*
+ * Frees every bucket and the table itself. Callers batch the frees.
+ */
+int dir_index_free(struct wfs_inode *dir) {
+  struct table_cursor cursor;
+  int res = init_cursor(&cursor, dir);
+  if (res < 0) {
+    return res;
+  }
+
+  const struct wfs_dir_index *header = load_header(&cursor);
+  if (header) {
+    size_t size = (size_t)1 << header->global_depth;
+    const struct wfs_dir_bucket *bucket =
+        (struct wfs_dir_bucket *)cursor.bucket;
+
+    for (size_t i = 0; i < size; i++) {
+      int bucket_num = get_table_entry(&cursor, i);
+      if (bucket_num < 0) {
+        break;
+      }
+      read_data_block(cursor.bucket, bucket_num);
+      if (i < ((size_t)1 << bucket->depth)) {
+        free_data_block(bucket_num);
+      }
+    }
+  }
+  release_cursor(&cursor);
+
+  res = free_block_range(dir, 0, SIZE_MAX);
+  dir->flags &= ~WFS_INODE_HASHED;
+  return res;
+}
+
+/*
+ * Turns a directory whose single dentry block is full into a hashed one.
+ * On failure the directory is left as it was.
+ */
+int dir_index_convert(struct wfs_inode *dir) {
+  size_t num_entries;
+  const struct wfs_dentry *slot = map_dentry_slot(dir, 0, &num_entries);
+  if (!slot) {
+    return -EIO;
+  }
+
+  size_t entries_size = num_entries * sizeof(struct wfs_dentry);
+  struct wfs_dentry *entries = malloc(entries_size);
+  if (!entries) {
+    return -ENOMEM;
+  }
+  off_t old_blocks[N_BLOCKS];
+  memcpy(entries, slot, entries_size);
+  memcpy(old_blocks, dir->blocks, sizeof(old_blocks));
+
+  for (int i = 0; i < N_BLOCKS; i++) {
+    dir->blocks[i] = -1;
+  }
+  dir->flags |= WFS_INODE_HASHED;
+  invalidate_block_map(dir->num);
+
+  int res = init_dir_index(dir);
+  for (size_t j = 0; res == 0 && j < num_entries; j++) {
+    if (entries[j].num == -1) {
+      continue;
+    }
+    char name[MAX_NAME + 1];
+    memcpy(name, entries[j].name, MAX_NAME);
+    name[MAX_NAME] = '\0';
+    res = dir_index_add(dir, name, entries[j].num);
+  }
+  free(entries);
+
+  if (res < 0) {
+    if (dir->blocks[0] != -1) {
+      begin_free_batch();
+      dir_index_free(dir);
+      end_free_batch();
+    }
+    memcpy(dir->blocks, old_blocks, sizeof(old_blocks));
+    dir->flags &= ~WFS_INODE_HASHED;
+    invalidate_block_map(dir->num);
+    ERROR_LOG("Failed to index directory %d", dir->num);
+    return res;
+  }
+
+  free_data_block(old_blocks[0]);
+  DEBUG_LOG("Converted directory %d to a hashed index", dir->num);
+  return 0;
+}
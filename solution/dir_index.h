@@ -0,0 +1,15 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include "wfs.h"
+
+int dir_is_hashed(const struct wfs_inode *inode);
+int dir_index_convert(struct wfs_inode *dir);
+int dir_index_lookup(const struct wfs_inode *dir, const char *name);
+int dir_index_add(struct wfs_inode *dir, const char *name, int inode_num);
+int dir_index_remove(struct wfs_inode *dir, const char *name, int inode_num);
+int dir_index_for_each(const struct wfs_inode *dir,
+                       int (*fn)(const struct wfs_dentry *, void *),
+                       void *arg);
+int dir_index_free(struct wfs_inode *dir);
+#endif
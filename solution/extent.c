@@ -0,0 +1,474 @@
+#include "extent.h"
+#include "data_block.h"
+#include "globals.h"
+#include "raid.h"
+#include "wfs.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EXTENT_ENTRIES(hdr) ((struct wfs_extent *)((hdr) + 1))
+
+/*
+ * A walk down the tree reads each node into a buffer of its own, taken
+ * from one heap allocation with a block per level below the root. A node
+ * at depth d goes to NODE_BUFFER(nodes, d), so the recursion keeps no
+ * block-sized buffers on the stack.
+ */
+#define NODE_BUFFER(nodes, depth) ((nodes) + (size_t)(depth) * BLOCK_SIZE)
+
+static int alloc_node_buffers(int levels, char **nodes) {
+  *nodes = NULL;
+  if (levels == 0) {
+    return 0;
+  }
+  *nodes = malloc(levels * BLOCK_SIZE);
+  if (!*nodes) {
+    ERROR_LOG("Failed to allocate %d extent node buffers", levels);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+static struct wfs_extent_header *extent_root(const struct wfs_inode *inode) {
+  return (struct wfs_extent_header *)inode->blocks;
+}
+
+void init_extent_root(struct wfs_inode *inode) {
+  struct wfs_extent_header *root = extent_root(inode);
+
+  memset(inode->blocks, 0, sizeof(inode->blocks));
+  root->max = EXTENT_ROOT_ENTRIES;
+  root->magic = EXTENT_MAGIC;
+  inode->flags |= WFS_INODE_EXTENTS;
+}
+
+int inode_uses_extents(const struct wfs_inode *inode) {
+  return (inode->flags & WFS_INODE_EXTENTS) != 0;
+}
+
+static void fill_extent_node(const struct wfs_extent_header *hdr, size_t lo,
+                             size_t hi, int *blocks, char *nodes) {
+  const struct wfs_extent *entries = EXTENT_ENTRIES(hdr);
+  int stride = get_raid_stride();
+
+  for (int i = 0; i < hdr->entries; i++) {
+    size_t first = entries[i].logical;
+
+    if (hdr->depth == 0) {
+      size_t last = first + entries[i].length;
+      for (size_t b = first > lo ? first : lo; b < last && b < hi; b++) {
+        blocks[b - lo] = entries[i].start + (b - first) * stride;
+      }
+      continue;
+    }
+
+    size_t next = (i + 1 < hdr->entries) ? entries[i + 1].logical : SIZE_MAX;
+    if (next <= lo || first >= hi) {
+      continue;
+    }
+
+    char *node = NODE_BUFFER(nodes, hdr->depth - 1);
+    read_data_block(node, entries[i].start);
+    fill_extent_node((struct wfs_extent_header *)node, lo, hi, blocks, nodes);
+  }
+}
+
+/*
+ * Fills blocks[0 .. hi - lo) with the data blocks backing logical blocks
+ * [lo, hi), one extent at a time; holes are reported as -1.
+ */
+int fill_extent_range(const struct wfs_inode *inode, size_t lo, size_t hi,
+                      int *blocks) {
+  const struct wfs_extent_header *root = extent_root(inode);
+  char *nodes;
+  int res = alloc_node_buffers(root->depth, &nodes);
+  if (res < 0) {
+    return res;
+  }
+
+  for (size_t b = lo; b < hi; b++) {
+    blocks[b - lo] = -1;
+  }
+
+  fill_extent_node(root, lo, hi, blocks, nodes);
+  free(nodes);
+  return 0;
+}
+
+static void node_insert_at(struct wfs_extent_header *hdr, int pos,
+                           const struct wfs_extent *ext) {
+  struct wfs_extent *entries = EXTENT_ENTRIES(hdr);
+
+  memmove(&entries[pos + 1], &entries[pos],
+          (hdr->entries - pos) * sizeof(struct wfs_extent));
+  entries[pos] = *ext;
+  hdr->entries++;
+}
+
+/*
+ * Node blocks needed by a split are claimed before the tree is touched, so
+ * running out of space can never leave a half-split tree behind. `nodes`
+ * holds the walk's node buffers and, after them, one to build a split-off
+ * node in.
+ */
+struct extent_spares {
+  int count;
+  int blocks[EXTENT_MAX_DEPTH + 2];
+  char *nodes;
+  char *split_node;
+};
+
+static int find_slot(const struct wfs_extent_header *hdr, uint32_t logical) {
+  const struct wfs_extent *entries = EXTENT_ENTRIES(hdr);
+  int pos = 0;
+
+  while (pos < hdr->entries && entries[pos].logical <= logical) {
+    pos++;
+  }
+  return pos;
+}
+
+static int extends_extent(const struct wfs_extent *prev,
+                          const struct wfs_extent *ext) {
+  int stride = get_raid_stride();
+
+  return prev->logical + prev->length == ext->logical &&
+         prev->start + (int64_t)prev->length * stride == ext->start &&
+         (uint64_t)prev->length + ext->length <= UINT32_MAX;
+}
+
+/*
+ * Returns how many node blocks inserting ext below hdr will allocate: one
+ * per full node on the way up, plus one more if the root itself splits.
+ */
+static int count_new_nodes(const struct wfs_extent_header *hdr,
+                           const struct wfs_extent *ext, int is_root,
+                           char *nodes) {
+  const struct wfs_extent *entries = EXTENT_ENTRIES(hdr);
+  int pos = find_slot(hdr, ext->logical);
+  int needed = 0;
+
+  if (hdr->depth == 0) {
+    if (pos > 0 && extends_extent(&entries[pos - 1], ext)) {
+      return 0;
+    }
+  } else {
+    char *node = NODE_BUFFER(nodes, hdr->depth - 1);
+    read_data_block(node, entries[pos > 0 ? pos - 1 : 0].start);
+    needed = count_new_nodes((struct wfs_extent_header *)node, ext, 0, nodes);
+    if (needed == 0) {
+      return 0;
+    }
+  }
+
+  if (hdr->entries < hdr->max) {
+    return needed;
+  }
+  return needed + (is_root ? 2 : 1);
+}
+
+/*
+ * Adds ext at pos, splitting hdr into a new right sibling block when it is
+ * full. The sibling's index entry is returned through split.
+ */
+static int node_add(struct wfs_extent_header *hdr, int pos,
+                    const struct wfs_extent *ext, struct extent_spares *spares,
+                    struct wfs_extent *split) {
+  if (hdr->entries < hdr->max) {
+    node_insert_at(hdr, pos, ext);
+    return 0;
+  }
+
+  int sibling_block = spares->blocks[--spares->count];
+  char *buffer = spares->split_node;
+  struct wfs_extent_header *sibling = (struct wfs_extent_header *)buffer;
+  // Appends leave the full node as is so sequential growth packs nodes.
+  int keep = pos == hdr->entries ? hdr->entries : hdr->entries / 2;
+
+  memset(buffer, 0, BLOCK_SIZE);
+  sibling->entries = hdr->entries - keep;
+  sibling->max = EXTENT_NODE_ENTRIES;
+  sibling->depth = hdr->depth;
+  sibling->magic = EXTENT_MAGIC;
+  memcpy(EXTENT_ENTRIES(sibling), EXTENT_ENTRIES(hdr) + keep,
+         sibling->entries * sizeof(struct wfs_extent));
+  hdr->entries = keep;
+
+  if (pos <= keep && hdr->entries < hdr->max) {
+    node_insert_at(hdr, pos, ext);
+  } else {
+    node_insert_at(sibling, pos - keep, ext);
+  }
+  write_data_block(buffer, sibling_block);
+
+  split->logical = EXTENT_ENTRIES(sibling)[0].logical;
+  split->length = 0;
+  split->start = sibling_block;
+
+  DEBUG_LOG("Split extent node at depth %d into block %d", hdr->depth,
+            sibling_block);
+  return 1;
+}
+
+static int node_insert(struct wfs_extent_header *hdr,
+                       const struct wfs_extent *ext,
+                       struct extent_spares *spares, struct wfs_extent *split) {
+  struct wfs_extent *entries = EXTENT_ENTRIES(hdr);
+  int pos = find_slot(hdr, ext->logical);
+
+  if (hdr->depth == 0) {
+    if (pos > 0 && extends_extent(&entries[pos - 1], ext)) {
+      entries[pos - 1].length += ext->length;
+      return 0;
+    }
+    return node_add(hdr, pos, ext, spares, split);
+  }
+
+  int child = pos > 0 ? pos - 1 : 0;
+  if (ext->logical < entries[child].logical) {
+    entries[child].logical = ext->logical;
+  }
+
+  char *buffer = NODE_BUFFER(spares->nodes, hdr->depth - 1);
+  struct wfs_extent child_split;
+
+  read_data_block(buffer, entries[child].start);
+  int child_did_split = node_insert((struct wfs_extent_header *)buffer, ext,
+                                    spares, &child_split);
+  write_data_block(buffer, entries[child].start);
+
+  if (!child_did_split) {
+    return 0;
+  }
+  return node_add(hdr, child + 1, &child_split, spares, split);
+}
+
+/*
+ * Records that logical blocks [logical, logical + length) live in the data
+ * blocks starting at start. Extents that continue their predecessor both
+ * logically and physically are merged into it.
+ */
+int insert_extent(struct wfs_inode *inode, size_t logical, int start,
+                  size_t length) {
+  struct wfs_extent_header *root = extent_root(inode);
+  struct wfs_extent ext = {
+      .logical = logical, .length = length, .start = start};
+  struct extent_spares spares = {.count = 0};
+  struct wfs_extent split;
+
+  int res = alloc_node_buffers(root->depth + 1, &spares.nodes);
+  if (res < 0) {
+    return res;
+  }
+  spares.split_node = NODE_BUFFER(spares.nodes, root->depth);
+
+  int needed = count_new_nodes(root, &ext, 1, spares.nodes);
+  if (needed > 0 && root->depth >= EXTENT_MAX_DEPTH) {
+    ERROR_LOG("Extent tree of inode %d is at maximum depth", inode->num);
+    free(spares.nodes);
+    return -EFBIG;
+  }
+
+  while (spares.count < needed) {
+    int block_num = allocate_free_data_block();
+    if (block_num < 0) {
+      while (spares.count > 0) {
+        free_data_block(spares.blocks[--spares.count]);
+      }
+      free(spares.nodes);
+      return block_num;
+    }
+    spares.blocks[spares.count++] = block_num;
+  }
+
+  if (!node_insert(root, &ext, &spares, &split)) {
+    free(spares.nodes);
+    return 0;
+  }
+
+  // The root cannot split in place: push its left half down into a new
+  // block and make the root an index over both halves.
+  int left_block = spares.blocks[--spares.count];
+  char *buffer = spares.split_node;
+  struct wfs_extent_header *left = (struct wfs_extent_header *)buffer;
+  memset(buffer, 0, BLOCK_SIZE);
+  *left = *root;
+  left->max = EXTENT_NODE_ENTRIES;
+  memcpy(EXTENT_ENTRIES(left), EXTENT_ENTRIES(root),
+         root->entries * sizeof(struct wfs_extent));
+  write_data_block(buffer, left_block);
+
+  struct wfs_extent *entries = EXTENT_ENTRIES(root);
+  entries[0].logical = EXTENT_ENTRIES(left)[0].logical;
+  entries[0].length = 0;
+  entries[0].start = left_block;
+  entries[1] = split;
+  root->entries = 2;
+  root->depth++;
+  free(spares.nodes);
+
+  DEBUG_LOG("Extent tree of inode %d grew to depth %d", inode->num,
+            root->depth);
+  return 0;
+}
+
+static void free_extent_node(const struct wfs_extent_header *hdr,
+                             char *nodes) {
+  const struct wfs_extent *entries = EXTENT_ENTRIES(hdr);
+  int stride = get_raid_stride();
+
+  for (int i = 0; i < hdr->entries; i++) {
+    if (hdr->depth == 0) {
+      for (uint32_t b = 0; b < entries[i].length; b++) {
+        free_data_block(entries[i].start + b * stride);
+      }
+      continue;
+    }
+
+    char *node = NODE_BUFFER(nodes, hdr->depth - 1);
+    read_data_block(node, entries[i].start);
+    free_extent_node((struct wfs_extent_header *)node, nodes);
+    free_data_block(entries[i].start);
+  }
+}
+
+int free_extent_tree(struct wfs_inode *inode) {
+  char *nodes;
+  int res = alloc_node_buffers(extent_root(inode)->depth, &nodes);
+  if (res < 0) {
+    return res;
+  }
+
+  free_extent_node(extent_root(inode), nodes);
+  free(nodes);
+  init_extent_root(inode);
+  return 0;
+}
+
+static int find_extent(const struct wfs_extent_header *hdr, size_t block,
+                       struct wfs_extent *found, char *nodes) {
+  const struct wfs_extent *entries = EXTENT_ENTRIES(hdr);
+  int pos = find_slot(hdr, block);
+
+  if (pos == 0) {
+    return 0;
+  }
+
+  if (hdr->depth == 0) {
+    *found = entries[pos - 1];
+    return block < (size_t)found->logical + found->length;
+  }
+
+  char *node = NODE_BUFFER(nodes, hdr->depth - 1);
+  read_data_block(node, entries[pos - 1].start);
+  return find_extent((struct wfs_extent_header *)node, block, found, nodes);
+}
+
+/*
+ * Drops logical blocks [lo, hi) from the subtree under hdr, freeing their
+ * data blocks along with any node left without entries. An extent that
+ * straddles lo keeps its head; one that straddles hi keeps its tail.
+ */
+static void remove_from_node(struct wfs_extent_header *hdr, size_t lo,
+                             size_t hi, char *nodes) {
+  struct wfs_extent *entries = EXTENT_ENTRIES(hdr);
+  int stride = get_raid_stride();
+  int kept = 0;
+
+  for (int i = 0; i < hdr->entries; i++) {
+    struct wfs_extent ext = entries[i];
+
+    if (hdr->depth == 0) {
+      size_t first = ext.logical, last = first + ext.length;
+      if (last <= lo || first >= hi) {
+        entries[kept++] = ext;
+        continue;
+      }
+
+      size_t from = first > lo ? first : lo;
+      size_t to = last < hi ? last : hi;
+      for (size_t b = from; b < to; b++) {
+        free_data_block(ext.start + (b - first) * stride);
+      }
+
+      if (first < lo) {
+        ext.length = lo - first;
+        entries[kept++] = ext;
+      } else if (last > hi) {
+        ext.start += (hi - first) * stride;
+        ext.logical = hi;
+        ext.length = last - hi;
+        entries[kept++] = ext;
+      }
+      continue;
+    }
+
+    size_t next = (i + 1 < hdr->entries) ? entries[i + 1].logical : SIZE_MAX;
+    if (next <= lo || ext.logical >= hi) {
+      entries[kept++] = ext;
+      continue;
+    }
+
+    char *node = NODE_BUFFER(nodes, hdr->depth - 1);
+    struct wfs_extent_header *child = (struct wfs_extent_header *)node;
+    read_data_block(node, ext.start);
+    remove_from_node(child, lo, hi, nodes);
+
+    if (child->entries == 0) {
+      free_data_block(ext.start);
+      continue;
+    }
+    write_data_block(node, ext.start);
+    entries[kept++] = ext;
+  }
+
+  hdr->entries = kept;
+}
+
+/*
+ * Unmaps logical blocks [lo, hi) and frees the data behind them. Punching
+ * into the middle of an extent needs a new entry for its tail, which is the
+ * only step that can fail, so it is inserted before anything is removed.
+ */
+int remove_extent_range(struct wfs_inode *inode, size_t lo, size_t hi) {
+  struct wfs_extent_header *root = extent_root(inode);
+  struct wfs_extent ext;
+  char *nodes;
+  int res;
+
+  if (lo >= hi) {
+    return 0;
+  }
+
+  if ((res = alloc_node_buffers(root->depth, &nodes)) < 0) {
+    return res;
+  }
+  int straddles = find_extent(root, lo, &ext, nodes) && ext.logical < lo &&
+                  (size_t)ext.logical + ext.length > hi;
+  free(nodes);
+
+  if (straddles) {
+    size_t tail = (size_t)ext.logical + ext.length - hi;
+    res = insert_extent(
+        inode, hi, ext.start + (hi - ext.logical) * get_raid_stride(), tail);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  // The insert may have deepened the tree.
+  if ((res = alloc_node_buffers(root->depth, &nodes)) < 0) {
+    return res;
+  }
+  remove_from_node(root, lo, hi, nodes);
+  free(nodes);
+  if (root->entries == 0) {
+    root->depth = 0;
+  }
+
+  DEBUG_LOG("Removed blocks [%zu, %zu) from extent tree of inode %d", lo, hi,
+            inode->num);
+  return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "wfs.h"
+#include <stddef.h>
+
+#define EXTENT_MAGIC 0xf30a
+#define EXTENT_MAX_DEPTH 5
+#define EXTENT_ROOT_ENTRIES                                                    \
+  ((sizeof(((struct wfs_inode *)0)->blocks) -                                  \
+    sizeof(struct wfs_extent_header)) /                                        \
+   sizeof(struct wfs_extent))
+#define EXTENT_NODE_ENTRIES                                                    \
+  ((BLOCK_SIZE - sizeof(struct wfs_extent_header)) / sizeof(struct wfs_extent))
+
+void init_extent_root(struct wfs_inode *inode);
+int inode_uses_extents(const struct wfs_inode *inode);
+int fill_extent_range(const struct wfs_inode *inode, size_t lo, size_t hi,
+                      int *blocks);
+int insert_extent(struct wfs_inode *inode, size_t logical, int start,
+                  size_t length);
+int remove_extent_range(struct wfs_inode *inode, size_t lo, size_t hi);
+int free_extent_tree(struct wfs_inode *inode);
+#endif
@@ -0,0 +1,781 @@
+#include "free_space.h"
+#include "globals.h"
+#include "raid.h"
+#include "wfs.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BITS_PER_WORD 64
+// Inodes covered by one summary word; the unit of inode placement.
+#define INODE_GROUP_SIZE (BITS_PER_WORD * BITS_PER_WORD)
+// Fewest bitmap rows worth a block group of their own.
+#define BLOCK_GROUP_MIN_ROWS (BITS_PER_WORD * BITS_PER_WORD)
+#define RESERVATION_SLOTS 64
+// Stripe rows spanned by a first reservation window and by the largest one.
+#define RESERVATION_MIN_ROWS 8
+#define RESERVATION_MAX_ROWS 128
+#define BITMAP_LOCK_STRIPES 64
+
+/*
+ * In-memory index over an on-disk bitmap, built at mount. The bitmap is
+ * viewed as 64-bit words, and a summary bitmap keeps one bit per word that
+ * still has a clear bit. A search skips 64 full words per summary word and
+ * only ever loads the bitmap word it lands on. The on-disk bitmap stays
+ * authoritative.
+ *
+ * Bits are claimed and released with a compare-and-swap on the mapped
+ * bitmap itself; a thread that loses a race searches again. The summary and
+ * free count are updated with atomics afterwards. A mirrored bitmap also
+ * takes the striped lock of the word it changes, so the change reaches the
+ * mirrors before any other change to that word does.
+ */
+struct bitmap_index {
+  int disk_index; /* disk whose mapping holds the bitmap */
+  off_t offset;   /* bitmap offset within the disk image */
+  size_t num_bits;
+  size_t num_words;
+  size_t summary_words;
+  uint64_t *summary;
+  size_t free;
+  int mirrored; /* copy every change to the other disks */
+};
+
+/*
+ * A slice of the block numbers with a next-fit cursor of its own. There is
+ * one per CPU when the disks are big enough. Each thread is handed a home
+ * group, and its directory blocks and new files start from that group's
+ * cursor, so writers on different threads work on different bitmap words.
+ * A full group spills over into the ones after it.
+ */
+struct block_group {
+  size_t start, end; /* block numbers, [start, end) */
+  size_t next;
+};
+
+/*
+ * Data bitmaps get one index per disk, except that mirrored modes keep
+ * identical bitmaps everywhere and only index disk 0. The inode bitmap is
+ * mirrored in every mode.
+ */
+static struct {
+  struct bitmap_index *disks;
+  int num_disks;
+  struct block_group *block_groups;
+  size_t num_block_groups;
+  size_t homes_given;
+  struct bitmap_index inodes;
+  size_t *group_free;
+  size_t num_groups;
+} free_space;
+
+static _Thread_local size_t home_group = SIZE_MAX;
+
+/*
+ * Reservation windows keep the blocks ahead of a file's last allocation
+ * free for that file, so appending writers that interleave still lay their
+ * files out contiguously. A window is a range of block numbers that other
+ * allocations step over while they can; it is not recorded on disk. A file
+ * that fills its window and keeps going gets one twice the size. Slots are
+ * direct-mapped by inode number, and a file that collides simply takes the
+ * slot over.
+ *
+ * Allocations share reservations_lock; only opening or dropping a window
+ * takes it exclusively.
+ */
+struct reservation {
+  int in_use;
+  int inode_num;
+  size_t start, end; /* block numbers, [start, end) */
+  size_t rows;
+};
+
+static struct reservation reservations[RESERVATION_SLOTS];
+static pthread_rwlock_t reservations_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_mutex_t bitmap_locks[BITMAP_LOCK_STRIPES];
+
+static int bitmaps_mirrored(void) {
+  return sb.raid_mode == RAID_1 || sb.raid_mode == RAID_1v;
+}
+
+static unsigned char *index_bitmap(const struct bitmap_index *idx) {
+  return (unsigned char *)wfs_ctx.disk_mmaps[idx->disk_index] + idx->offset;
+}
+
+/*
+ * Returns bitmap word w with a bit set for every used entry. Bits past the
+ * end of the bitmap count as used.
+ */
+static uint64_t load_bitmap_word(const struct bitmap_index *idx, size_t w) {
+  const unsigned char *bitmap = index_bitmap(idx);
+  size_t bitmap_size = (idx->num_bits + 7) / 8;
+  size_t first = w * BITS_PER_WORD;
+  uint64_t bits = 0;
+
+  for (size_t k = 0; k < 8 && w * 8 + k < bitmap_size; k++) {
+    uint64_t byte = __atomic_load_n(&bitmap[w * 8 + k], __ATOMIC_SEQ_CST);
+    bits |= byte << (k * 8);
+  }
+  if (first + BITS_PER_WORD > idx->num_bits) {
+    bits |= ~0ULL << (idx->num_bits - first);
+  }
+  return bits;
+}
+
+/*
+ * A word that looks full is checked again after its summary bit is
+ * cleared, since a release may have set the bit just before.
+ */
+static void update_summary(struct bitmap_index *idx, size_t w) {
+  uint64_t *summary = &idx->summary[w / BITS_PER_WORD];
+  uint64_t bit = 1ULL << (w % BITS_PER_WORD);
+
+  if (!~load_bitmap_word(idx, w)) {
+    __atomic_fetch_and(summary, ~bit, __ATOMIC_SEQ_CST);
+    if (!~load_bitmap_word(idx, w)) {
+      return;
+    }
+  }
+  __atomic_fetch_or(summary, bit, __ATOMIC_SEQ_CST);
+}
+
+static int init_index(struct bitmap_index *idx, int disk_index, off_t offset,
+                      size_t num_bits, int mirrored) {
+  idx->disk_index = disk_index;
+  idx->offset = offset;
+  idx->num_bits = num_bits;
+  idx->num_words = (num_bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  idx->summary_words = (idx->num_words + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  idx->mirrored = mirrored;
+  idx->free = 0;
+
+  idx->summary = calloc(idx->summary_words, sizeof(uint64_t));
+  if (!idx->summary) {
+    ERROR_LOG("Memory allocation failed for free space summary");
+    return -ENOMEM;
+  }
+
+  for (size_t w = 0; w < idx->num_words; w++) {
+    update_summary(idx, w);
+    idx->free += __builtin_popcountll(~load_bitmap_word(idx, w));
+  }
+  return 0;
+}
+
+/*
+ * Returns the first clear bit at or after bit, or -1.
+ */
+static long find_clear_bit(const struct bitmap_index *idx, size_t bit) {
+  size_t w = bit / BITS_PER_WORD;
+
+  if (w >= idx->num_words) {
+    return -1;
+  }
+
+  uint64_t free_bits =
+      ~load_bitmap_word(idx, w) & (~0ULL << (bit % BITS_PER_WORD));
+  if (free_bits) {
+    return w * BITS_PER_WORD + __builtin_ctzll(free_bits);
+  }
+
+  for (size_t s = (w + 1) / BITS_PER_WORD; s < idx->summary_words; s++) {
+    uint64_t words = __atomic_load_n(&idx->summary[s], __ATOMIC_RELAXED);
+    if (s == (w + 1) / BITS_PER_WORD) {
+      words &= ~0ULL << ((w + 1) % BITS_PER_WORD);
+    }
+
+    for (; words; words &= words - 1) {
+      size_t cw = s * BITS_PER_WORD + __builtin_ctzll(words);
+      free_bits = ~load_bitmap_word(idx, cw);
+      if (free_bits) {
+        return cw * BITS_PER_WORD + __builtin_ctzll(free_bits);
+      }
+    }
+  }
+  return -1;
+}
+
+/*
+ * Returns the lock that orders changes to bitmap word w of a mirrored
+ * bitmap, or NULL for a bitmap with no mirrors.
+ */
+static pthread_mutex_t *word_lock(const struct bitmap_index *idx, size_t w) {
+  if (!idx->mirrored) {
+    return NULL;
+  }
+  return &bitmap_locks[((size_t)idx->offset / 8 + w) % BITMAP_LOCK_STRIPES];
+}
+
+static void lock_word(pthread_mutex_t *lock) {
+  if (lock) {
+    pthread_mutex_lock(lock);
+  }
+}
+
+static void unlock_word(pthread_mutex_t *lock) {
+  if (lock) {
+    pthread_mutex_unlock(lock);
+  }
+}
+
+/*
+ * Applies a change to the same bitmap bytes on the other disks. Copying
+ * the byte over with replicate() could undo a bit another thread changed
+ * in between, so mirrors get the same atomic update instead. The caller
+ * holds the word's lock.
+ */
+static void mirror_bits(const struct bitmap_index *idx, size_t byte,
+                        unsigned char bits, int used) {
+  for (int i = 0; i < wfs_ctx.num_disks; i++) {
+    if (i == idx->disk_index || !wfs_ctx.disk_mmaps[i]) {
+      continue;
+    }
+
+    unsigned char *copy =
+        (unsigned char *)wfs_ctx.disk_mmaps[i] + idx->offset + byte;
+    if (used) {
+      __atomic_fetch_or(copy, bits, __ATOMIC_RELAXED);
+    } else {
+      __atomic_fetch_and(copy, (unsigned char)~bits, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/*
+ * Sets or clears one bit on disk and in the index. Returns 1 if this call
+ * changed the bit, and 0 if it already had that state, which for a claim
+ * means another thread got there first.
+ */
+static int set_bit_state(struct bitmap_index *idx, size_t bit, int used) {
+  unsigned char *byte = index_bitmap(idx) + bit / 8;
+  unsigned char mask = 1 << (bit % 8);
+  pthread_mutex_t *lock = word_lock(idx, bit / BITS_PER_WORD);
+
+  lock_word(lock);
+  unsigned char old = __atomic_load_n(byte, __ATOMIC_RELAXED);
+  do {
+    if (!(old & mask) == !used) {
+      unlock_word(lock);
+      return 0;
+    }
+  } while (!__atomic_compare_exchange_n(byte, &old, old ^ mask, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+  if (idx->mirrored) {
+    mirror_bits(idx, bit / 8, mask, used);
+  }
+  unlock_word(lock);
+
+  if (used) {
+    __atomic_sub_fetch(&idx->free, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&idx->free, 1, __ATOMIC_RELAXED);
+  }
+  update_summary(idx, bit / BITS_PER_WORD);
+  return 1;
+}
+
+/*
+ * Apply a change in the free counts to the superblock of every disk that
+ * records it.
+ */
+static void store_block_change(int d, long delta) {
+  for (int i = 0; i < wfs_ctx.num_disks; i++) {
+    if (bitmaps_mirrored() || i == d) {
+      struct wfs_sb *disk_sb = wfs_ctx.disk_mmaps[i];
+      __atomic_add_fetch(&disk_sb->free_blocks, delta, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void store_inode_change(long delta) {
+  for (int i = 0; i < wfs_ctx.num_disks; i++) {
+    struct wfs_sb *disk_sb = wfs_ctx.disk_mmaps[i];
+    __atomic_add_fetch(&disk_sb->free_inodes, delta, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Splits the stripe rows into one group per online CPU, as long as every
+ * group keeps at least BLOCK_GROUP_MIN_ROWS. Groups start on a bitmap word
+ * so no two of them share one.
+ */
+static int init_block_groups(void) {
+  size_t rows = sb.num_data_blocks;
+  size_t num_disks = wfs_ctx.num_disks;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t count = rows / BLOCK_GROUP_MIN_ROWS;
+
+  if (cpus > 0 && count > (size_t)cpus) {
+    count = cpus;
+  }
+  if (count == 0) {
+    count = 1;
+  }
+  size_t group_rows = (rows + count - 1) / count;
+  group_rows = (group_rows + BITS_PER_WORD - 1) / BITS_PER_WORD * BITS_PER_WORD;
+  count = (rows + group_rows - 1) / group_rows;
+
+  free_space.block_groups = calloc(count, sizeof(struct block_group));
+  if (!free_space.block_groups) {
+    return -ENOMEM;
+  }
+  for (size_t g = 0; g < count; g++) {
+    struct block_group *group = &free_space.block_groups[g];
+    size_t end_row = (g + 1) * group_rows;
+
+    group->start = g * group_rows * num_disks;
+    group->end = (end_row < rows ? end_row : rows) * num_disks;
+    group->next = group->start;
+  }
+  free_space.num_block_groups = count;
+  free_space.homes_given = 0;
+  return 0;
+}
+
+int init_free_space(void) {
+  for (int i = 0; i < BITMAP_LOCK_STRIPES; i++) {
+    pthread_mutex_init(&bitmap_locks[i], NULL);
+  }
+
+  free_space.num_disks = bitmaps_mirrored() ? 1 : wfs_ctx.num_disks;
+  memset(reservations, 0, sizeof(reservations));
+
+  free_space.disks = calloc(free_space.num_disks, sizeof(struct bitmap_index));
+  free_space.num_groups =
+      (sb.num_inodes + INODE_GROUP_SIZE - 1) / INODE_GROUP_SIZE;
+  free_space.group_free = calloc(free_space.num_groups, sizeof(size_t));
+  if (!free_space.disks || !free_space.group_free ||
+      init_block_groups() != 0) {
+    ERROR_LOG("Memory allocation failed for free space index");
+    destroy_free_space();
+    return -ENOMEM;
+  }
+
+  for (int d = 0; d < free_space.num_disks; d++) {
+    if (init_index(&free_space.disks[d], d, DATA_BITMAP_OFFSET,
+                   sb.num_data_blocks, bitmaps_mirrored()) != 0) {
+      destroy_free_space();
+      return -ENOMEM;
+    }
+  }
+  if (init_index(&free_space.inodes, 0, INODE_BITMAP_OFFSET, sb.num_inodes,
+                 1) != 0) {
+    destroy_free_space();
+    return -ENOMEM;
+  }
+
+  for (size_t w = 0; w < free_space.inodes.num_words; w++) {
+    free_space.group_free[w * BITS_PER_WORD / INODE_GROUP_SIZE] +=
+        __builtin_popcountll(~load_bitmap_word(&free_space.inodes, w));
+  }
+
+  for (int d = 0; d < free_space.num_disks; d++) {
+    const struct wfs_sb *disk_sb = wfs_ctx.disk_mmaps[d];
+    free_space.disks[d].free = disk_sb->free_blocks;
+  }
+  free_space.inodes.free = sb.free_inodes;
+
+  DEBUG_LOG("Indexed %d data bitmap(s) in %zu block group(s) and %zu inode "
+            "group(s)",
+            free_space.num_disks, free_space.num_block_groups,
+            free_space.num_groups);
+  return 0;
+}
+
+void destroy_free_space(void) {
+  if (free_space.disks) {
+    for (int d = 0; d < free_space.num_disks; d++) {
+      free(free_space.disks[d].summary);
+    }
+  }
+  free(free_space.disks);
+  free(free_space.inodes.summary);
+  free(free_space.group_free);
+  free(free_space.block_groups);
+  free_space.disks = NULL;
+  free_space.inodes.summary = NULL;
+  free_space.group_free = NULL;
+  free_space.block_groups = NULL;
+  free_space.num_block_groups = 0;
+  for (int i = 0; i < BITMAP_LOCK_STRIPES; i++) {
+    pthread_mutex_destroy(&bitmap_locks[i]);
+  }
+}
+
+/*
+ * The calling thread's block group, handed out round-robin on first use.
+ */
+static struct block_group *get_home_group(void) {
+  if (home_group >= free_space.num_block_groups) {
+    home_group = __atomic_fetch_add(&free_space.homes_given, 1,
+                                    __ATOMIC_RELAXED) %
+                 free_space.num_block_groups;
+    DEBUG_LOG("Thread got block group %zu", home_group);
+  }
+  return &free_space.block_groups[home_group];
+}
+
+static int find_free_block_from(size_t from) {
+  int num_disks = wfs_ctx.num_disks;
+  long best = -1;
+
+  for (int d = 0; d < free_space.num_disks; d++) {
+    size_t row = from / num_disks;
+    if (bitmaps_mirrored() ? from % num_disks != 0
+                           : (size_t)d < from % num_disks) {
+      row++;
+    }
+
+    long r = find_clear_bit(&free_space.disks[d], row);
+    if (r >= 0 && (best < 0 || r * num_disks + d < best)) {
+      best = r * num_disks + d;
+    }
+  }
+  return best < 0 ? -ENOSPC : (int)best;
+}
+
+static const struct reservation *reserved_by_other(size_t block_index,
+                                                   int inode_num) {
+  for (int i = 0; i < RESERVATION_SLOTS; i++) {
+    const struct reservation *r = &reservations[i];
+    if (r->in_use && r->inode_num != inode_num && block_index >= r->start &&
+        block_index < r->end) {
+      return r;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * First free block at or after from that no other file has reserved.
+ */
+static int find_unreserved_block(size_t from, int inode_num) {
+  size_t total = (size_t)sb.num_data_blocks * wfs_ctx.num_disks;
+
+  while (from < total) {
+    int block = find_free_block_from(from);
+    if (block < 0) {
+      return block;
+    }
+
+    const struct reservation *r = reserved_by_other(block, inode_num);
+    if (!r) {
+      return block;
+    }
+    from = r->end;
+  }
+  return -ENOSPC;
+}
+
+/*
+ * Searches from goal, wraps around once, and finally ignores other files'
+ * windows rather than report the disks full.
+ */
+static int find_block_near(size_t goal, int inode_num) {
+  int block = find_unreserved_block(goal, inode_num);
+  if (block < 0 && goal > 0) {
+    block = find_unreserved_block(0, inode_num);
+  }
+  if (block < 0) {
+    block = find_free_block_from(0);
+  }
+  return block;
+}
+
+static void open_reservation(int inode_num, size_t block_index,
+                             size_t rows) {
+  struct reservation *r = &reservations[inode_num % RESERVATION_SLOTS];
+  size_t row_start = block_index - block_index % wfs_ctx.num_disks;
+  size_t end = row_start + rows * wfs_ctx.num_disks;
+
+  for (int i = 0; i < RESERVATION_SLOTS; i++) {
+    const struct reservation *other = &reservations[i];
+    if (other != r && other->in_use && other->start > block_index &&
+        other->start < end) {
+      end = other->start;
+    }
+  }
+
+  r->in_use = 1;
+  r->inode_num = inode_num;
+  r->start = block_index;
+  r->end = end;
+  r->rows = rows;
+  DEBUG_LOG("Reserved blocks [%zu, %zu) for inode %d", r->start, r->end,
+            inode_num);
+}
+
+/*
+ * Picks the block a file's next allocation starts from: goal, the block
+ * physically following the file's previous one, when it is available, and
+ * otherwise the next free block of the file's window. A new file starts on
+ * a fresh stripe row of the thread's home group so its first blocks span
+ * every disk. Leaving the window asks, through rows, for a new one where
+ * the search landed. Called with reservations_lock held shared.
+ */
+static int find_file_block(int inode_num, int goal, size_t *rows) {
+  const struct reservation *r = &reservations[inode_num % RESERVATION_SLOTS];
+  int owned = r->in_use && r->inode_num == inode_num;
+  size_t num_disks = wfs_ctx.num_disks;
+  size_t from;
+
+  *rows = 0;
+  if (goal >= 0) {
+    from = goal;
+  } else if (owned) {
+    from = r->start;
+  } else {
+    size_t next = __atomic_load_n(&get_home_group()->next, __ATOMIC_RELAXED);
+    from = (next + num_disks - 1) / num_disks * num_disks;
+  }
+
+  int block = find_block_near(from, inode_num);
+  if (block < 0 ||
+      (owned && (size_t)block >= r->start && (size_t)block < r->end)) {
+    return block;
+  }
+
+  *rows = RESERVATION_MIN_ROWS;
+  if (owned && (size_t)block == r->end) {
+    *rows = r->rows < RESERVATION_MAX_ROWS ? r->rows * 2 : r->rows;
+  }
+  return block;
+}
+
+void drop_reservation(int inode_num) {
+  struct reservation *r = &reservations[inode_num % RESERVATION_SLOTS];
+
+  pthread_rwlock_wrlock(&reservations_lock);
+  if (r->in_use && r->inode_num == inode_num) {
+    DEBUG_LOG("Dropped reservation of inode %d", inode_num);
+    r->in_use = 0;
+  }
+  pthread_rwlock_unlock(&reservations_lock);
+}
+
+int is_data_block_free(size_t block_index) {
+  int disk_index;
+  int row = get_raid_disk(block_index, &disk_index);
+
+  if (row < 0 || row >= sb.num_data_blocks) {
+    return 0;
+  }
+  const unsigned char *bitmap = index_bitmap(&free_space.disks[disk_index]);
+  return !(__atomic_load_n(&bitmap[row / 8], __ATOMIC_RELAXED) &
+           (1 << (row % 8)));
+}
+
+static int set_block_state(size_t block_index, int used) {
+  int disk_index;
+  int row = get_raid_disk(block_index, &disk_index);
+
+  if (!set_bit_state(&free_space.disks[disk_index], row, used)) {
+    return 0;
+  }
+  store_block_change(disk_index, used ? -1 : 1);
+  return 1;
+}
+
+/*
+ * Returns 0 if another thread claimed the block first.
+ */
+static int claim_data_block(size_t block_index) {
+  if (!set_block_state(block_index, 1)) {
+    return 0;
+  }
+  __atomic_store_n(&get_home_group()->next, block_index + get_raid_stride(),
+                   __ATOMIC_RELAXED);
+  DEBUG_LOG("Claimed data block %zu", block_index);
+  return 1;
+}
+
+/*
+ * Next-fit allocation for blocks that belong to no particular file
+ * position, such as directory and mapping blocks.
+ */
+int claim_free_block(void) {
+  size_t from = __atomic_load_n(&get_home_group()->next, __ATOMIC_RELAXED);
+  int block;
+
+  pthread_rwlock_rdlock(&reservations_lock);
+  do {
+    block = find_block_near(from, -1);
+    from = block;
+  } while (block >= 0 && !claim_data_block(block));
+  pthread_rwlock_unlock(&reservations_lock);
+  return block;
+}
+
+/*
+ * Claims up to want physically consecutive blocks for a file, starting
+ * where find_file_block() points, and stops at the first block that is
+ * used or in another file's window. Returns the first block and the run
+ * length through got.
+ */
+int claim_file_blocks(int inode_num, int goal, size_t want, size_t *got) {
+  int stride = get_raid_stride();
+  size_t total = (size_t)sb.num_data_blocks * wfs_ctx.num_disks;
+  size_t rows;
+  int start;
+
+  pthread_rwlock_rdlock(&reservations_lock);
+  do {
+    start = find_file_block(inode_num, goal, &rows);
+    goal = start;
+  } while (start >= 0 && !claim_data_block(start));
+
+  if (start >= 0) {
+    *got = 1;
+    for (size_t b = start + stride; b < total && *got < want &&
+                                    !reserved_by_other(b, inode_num) &&
+                                    claim_data_block(b);
+         b += stride) {
+      (*got)++;
+    }
+  }
+  pthread_rwlock_unlock(&reservations_lock);
+
+  if (start >= 0 && rows > 0) {
+    pthread_rwlock_wrlock(&reservations_lock);
+    open_reservation(inode_num, start, rows);
+    pthread_rwlock_unlock(&reservations_lock);
+  }
+  return start;
+}
+
+void release_data_block(size_t block_index) {
+  set_block_state(block_index, 0);
+  DEBUG_LOG("Released data block %zu", block_index);
+}
+
+/*
+ * Frees every block whose bit is set in mask, a bitmap laid out like the
+ * disk's own, one byte at a time.
+ */
+void release_data_block_mask(int disk_index, const char *mask) {
+  struct bitmap_index *idx = &free_space.disks[disk_index];
+  unsigned char *bitmap = index_bitmap(idx);
+  size_t bitmap_size = (idx->num_bits + 7) / 8;
+  long released = 0;
+
+  for (size_t k = 0; k < bitmap_size; k++) {
+    unsigned char bits = mask[k];
+    if (!bits) {
+      continue;
+    }
+
+    pthread_mutex_t *lock = word_lock(idx, k / 8);
+    lock_word(lock);
+    bits &= __atomic_fetch_and(&bitmap[k], (unsigned char)~bits,
+                               __ATOMIC_SEQ_CST);
+    if (bits && idx->mirrored) {
+      mirror_bits(idx, k, bits, 0);
+    }
+    unlock_word(lock);
+    if (!bits) {
+      continue;
+    }
+
+    __atomic_add_fetch(&idx->free, __builtin_popcount(bits),
+                       __ATOMIC_RELAXED);
+    released += __builtin_popcount(bits);
+    update_summary(idx, k / 8);
+  }
+
+  store_block_change(disk_index, released);
+  DEBUG_LOG("Released %ld masked data blocks on disk %d", released,
+            disk_index);
+}
+
+/*
+ * Orlov-style group choice. Files stay in their parent's group so a tree is
+ * read back from nearby inodes. Top-level directories go to the emptiest
+ * group. Deeper directories stay with their parent while its group holds
+ * at least an average share of free inodes, and otherwise move on to the
+ * next group that does, so the groups fill evenly. The counts are read
+ * without a lock and may be slightly behind, which only shifts placement.
+ */
+static size_t pick_inode_group(int parent, int is_dir) {
+  size_t parent_group = parent / INODE_GROUP_SIZE;
+  size_t average =
+      __atomic_load_n(&free_space.inodes.free, __ATOMIC_RELAXED) /
+      free_space.num_groups;
+
+  if (!is_dir || free_space.num_groups == 1) {
+    return parent_group;
+  }
+
+  if (parent == 0) {
+    size_t best = 0, best_free = 0;
+    for (size_t g = 0; g < free_space.num_groups; g++) {
+      size_t group_free =
+          __atomic_load_n(&free_space.group_free[g], __ATOMIC_RELAXED);
+      if (g == 0 || group_free > best_free) {
+        best = g;
+        best_free = group_free;
+      }
+    }
+    return best;
+  }
+
+  for (size_t i = 0; i < free_space.num_groups; i++) {
+    size_t g = (parent_group + i) % free_space.num_groups;
+    size_t group_free =
+        __atomic_load_n(&free_space.group_free[g], __ATOMIC_RELAXED);
+    if (group_free > 0 && group_free >= average) {
+      return g;
+    }
+  }
+  return parent_group;
+}
+
+int claim_free_inode(int parent, int is_dir) {
+  size_t group = pick_inode_group(parent, is_dir);
+  size_t goal =
+      group == parent / INODE_GROUP_SIZE ? parent : group * INODE_GROUP_SIZE;
+  long inode_num;
+
+  do {
+    inode_num = find_clear_bit(&free_space.inodes, goal);
+    if (inode_num < 0) {
+      inode_num = find_clear_bit(&free_space.inodes, 0);
+    }
+    if (inode_num < 0) {
+      return -ENOSPC;
+    }
+    goal = inode_num;
+  } while (!set_bit_state(&free_space.inodes, inode_num, 1));
+
+  __atomic_sub_fetch(&free_space.group_free[inode_num / INODE_GROUP_SIZE], 1,
+                     __ATOMIC_RELAXED);
+  store_inode_change(-1);
+  DEBUG_LOG("Claimed inode %ld for parent %d", inode_num, parent);
+  return inode_num;
+}
+
+void release_inode(int inode_num) {
+  if (set_bit_state(&free_space.inodes, inode_num, 0)) {
+    __atomic_add_fetch(&free_space.group_free[inode_num / INODE_GROUP_SIZE], 1,
+                       __ATOMIC_RELAXED);
+    store_inode_change(1);
+  }
+  DEBUG_LOG("Released inode %d", inode_num);
+}
+
+/*
+ * Reports the free counts without touching any bitmap. Under RAID 0 the
+ * disks' counts add up; mirrors hold the same blocks, so disk 0 speaks for
+ * all of them.
+ */
+void get_free_counts(size_t *free_blocks, size_t *free_inodes) {
+  *free_blocks = 0;
+  for (int d = 0; d < free_space.num_disks; d++) {
+    *free_blocks +=
+        __atomic_load_n(&free_space.disks[d].free, __ATOMIC_RELAXED);
+  }
+  *free_inodes = __atomic_load_n(&free_space.inodes.free, __ATOMIC_RELAXED);
+}
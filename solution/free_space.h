@@ -0,0 +1,17 @@
+#ifndef FREE_SPACE_H
+#define FREE_SPACE_H
+
+#include <stddef.h>
+
+int init_free_space(void);
+void destroy_free_space(void);
+int claim_free_block(void);
+int claim_file_blocks(int inode_num, int goal, size_t want, size_t *got);
+void drop_reservation(int inode_num);
+int is_data_block_free(size_t block_index);
+void release_data_block(size_t block_index);
+void release_data_block_mask(int disk_index, const char *mask);
+int claim_free_inode(int parent, int is_dir);
+void release_inode(int inode_num);
+void get_free_counts(size_t *free_blocks, size_t *free_inodes);
+#endif
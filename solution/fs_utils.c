@@ -1,3 +1,4 @@
+#include "crc32c.h"
 #include "globals.h"
 #include "wfs.h"
 #include <fcntl.h>
@@ -9,15 +10,26 @@
 #include <time.h>
 #include <unistd.h>
 
-#define ALIGN_TO_BLOCK(offset)                                                 \
-  (((offset) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)
+#define ALIGN_TO_BLOCK(offset, block_size)                                     \
+  (((offset) + (block_size) - 1) / (block_size) * (block_size))
 
 static inline size_t calculate_bitmap_size(size_t count) {
   DEBUG_LOG("Calculating bitmap size for count: %zu", count);
   return (count + 7) / 8;
 }
 
-size_t calculate_required_size(size_t inode_count, size_t data_block_count) {
+// One CRC32C per data block row, kept between the inode table and the data.
+static inline size_t calculate_checksum_table_size(size_t data_block_count,
+                                                   uint32_t features) {
+  if (!(features & WFS_FEATURE_CHECKSUMS)) {
+    return 0;
+  }
+  return data_block_count * sizeof(uint32_t);
+}
+
+size_t calculate_required_size(size_t inode_count, size_t data_block_count,
+                               size_t block_size, size_t inode_size,
+                               uint32_t features) {
   DEBUG_LOG(
       "Calculating required size with inode_count: %zu, data_block_count: %zu",
       inode_count, data_block_count);
@@ -25,16 +37,22 @@ size_t calculate_required_size(size_t inode_count, size_t data_block_count) {
   size_t sb_size = sizeof(struct wfs_sb);
   size_t i_bitmap_size = calculate_bitmap_size(inode_count);
   size_t d_bitmap_size = calculate_bitmap_size(data_block_count);
-  size_t inode_table_size = inode_count * BLOCK_SIZE;
-  size_t data_block_size = data_block_count * BLOCK_SIZE;
+  size_t inode_table_size = inode_count * inode_size;
+  size_t csum_table_size =
+      calculate_checksum_table_size(data_block_count, features);
+  size_t data_block_size = data_block_count * block_size;
 
   DEBUG_LOG(
       "Superblock size: %zu, inode bitmap size: %zu, data bitmap size: %zu",
       sb_size, i_bitmap_size, d_bitmap_size);
 
   size_t current_offset = sb_size + i_bitmap_size + d_bitmap_size;
-  current_offset = ALIGN_TO_BLOCK(current_offset) + inode_table_size;
-  current_offset = ALIGN_TO_BLOCK(current_offset) + data_block_size;
+  current_offset =
+      ALIGN_TO_BLOCK(current_offset, block_size) + inode_table_size;
+  current_offset =
+      ALIGN_TO_BLOCK(current_offset, block_size) + csum_table_size;
+  current_offset =
+      ALIGN_TO_BLOCK(current_offset, block_size) + data_block_size;
 
   DEBUG_LOG("Total required size: %zu", current_offset);
   return current_offset;
@@ -49,28 +67,44 @@ static inline uint64_t generate_disk_id(int disk_index) {
 
 struct wfs_sb write_superblock(int fd, size_t inode_count,
                                size_t data_block_count, int raid_mode,
-                               int disk_index, int total_disks) {
+                               int disk_index, int total_disks,
+                               uint32_t features, size_t block_size,
+                               size_t inode_size) {
   DEBUG_LOG("Writing superblock with inode_count: %zu, data_block_count: %zu, "
             "raid_mode: %d",
             inode_count, data_block_count, raid_mode);
 
   size_t i_bitmap_size = calculate_bitmap_size(inode_count);
   size_t d_bitmap_size = calculate_bitmap_size(data_block_count);
-  size_t inode_table_size = inode_count * BLOCK_SIZE;
+  size_t inode_table_size = inode_count * inode_size;
+  off_t i_blocks_ptr = ALIGN_TO_BLOCK(
+      sizeof(struct wfs_sb) + i_bitmap_size + d_bitmap_size, block_size);
+  // The inode table starts at the aligned i_blocks_ptr, not the bitmaps' end.
+  off_t inode_table_end = i_blocks_ptr + inode_table_size;
+  off_t csum_ptr = ALIGN_TO_BLOCK(inode_table_end, block_size);
+  size_t csum_table_size =
+      calculate_checksum_table_size(data_block_count, features);
 
   struct wfs_sb sb = {
       .num_inodes = inode_count,
       .num_data_blocks = data_block_count,
       .i_bitmap_ptr = sizeof(struct wfs_sb),
       .d_bitmap_ptr = sizeof(struct wfs_sb) + i_bitmap_size,
-      .i_blocks_ptr =
-          ALIGN_TO_BLOCK(sizeof(struct wfs_sb) + i_bitmap_size + d_bitmap_size),
-      .d_blocks_ptr = ALIGN_TO_BLOCK(sizeof(struct wfs_sb) + i_bitmap_size +
-                                     d_bitmap_size + inode_table_size),
+      .i_blocks_ptr = i_blocks_ptr,
+      .d_blocks_ptr = ALIGN_TO_BLOCK(csum_ptr + csum_table_size, block_size),
       .raid_mode = raid_mode,
       .disk_index = disk_index,
       .total_disks = total_disks,
       .disk_id = generate_disk_id(disk_index),
+      .magic = WFS_MAGIC,
+      .version = WFS_VERSION,
+      .features = features,
+      .block_size = block_size,
+      .inode_size = inode_size,
+      // Everything but the root inode starts out free.
+      .free_inodes = inode_count - 1,
+      .free_blocks = data_block_count,
+      .csum_ptr = csum_table_size ? csum_ptr : 0,
   };
 
   DEBUG_LOG("Superblock layout: inode_bitmap_ptr=%ld, data_bitmap_ptr=%ld, "
@@ -124,11 +158,47 @@ void write_bitmaps(int fd, size_t inode_count, size_t data_block_count,
   free(bitmap);
 }
 
+/*
+ * Records the checksum of every data block as it stands, so that blocks
+ * never written since mkfs verify as well.
+ */
+void write_checksum_table(int fd, struct wfs_sb *sb) {
+  if (!(sb->features & WFS_FEATURE_CHECKSUMS)) {
+    return;
+  }
+
+  DEBUG_LOG("Writing checksum table at offset: %ld", sb->csum_ptr);
+  char *block = malloc(sb->block_size);
+  uint32_t *table = malloc(sb->num_data_blocks * sizeof(uint32_t));
+  if (!block || !table) {
+    ERROR_LOG("Memory allocation for checksum table failed");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t row = 0; row < sb->num_data_blocks; row++) {
+    off_t offset = sb->d_blocks_ptr + row * sb->block_size;
+    ssize_t bytes_read = pread(fd, block, sb->block_size, offset);
+    if (bytes_read != (ssize_t)sb->block_size) {
+      ERROR_LOG("Failed to read data block %zu", row);
+      exit(EXIT_FAILURE);
+    }
+    table[row] = crc32c(0, block, sb->block_size);
+  }
+
+  size_t table_size = sb->num_data_blocks * sizeof(uint32_t);
+  if (pwrite(fd, table, table_size, sb->csum_ptr) != (ssize_t)table_size) {
+    ERROR_LOG("Failed to write checksum table");
+    exit(EXIT_FAILURE);
+  }
+  free(table);
+  free(block);
+}
+
 void write_inode_to_file(int fd, struct wfs_inode *inode, size_t inode_index,
                          struct wfs_sb *sb) {
   DEBUG_LOG("Writing inode %zu to file", inode_index);
 
-  off_t inode_offset = sb->i_blocks_ptr + inode_index * BLOCK_SIZE;
+  off_t inode_offset = sb->i_blocks_ptr + inode_index * sb->inode_size;
   DEBUG_LOG("Inode offset: %ld", inode_offset);
 
   lseek(fd, inode_offset, SEEK_SET);
@@ -160,7 +230,9 @@ void write_root_inode(int fd, struct wfs_sb *sb) {
 
 int initialize_disk(const char *disk_file, size_t inode_count,
                     size_t data_block_count, size_t required_size,
-                    int raid_mode, int disk_index, int total_disks) {
+                    int raid_mode, int disk_index, int total_disks,
+                    uint32_t features, size_t block_size,
+                    size_t inode_size) {
   DEBUG_LOG("Initializing disk: %s", disk_file);
 
   int fd = open(disk_file, O_RDWR | O_CREAT, 0644);
@@ -179,16 +251,80 @@ int initialize_disk(const char *disk_file, size_t inode_count,
   }
   DEBUG_LOG("Disk size validation successful");
 
-  struct wfs_sb sb = write_superblock(fd, inode_count, data_block_count,
-                                      raid_mode, disk_index, total_disks);
+  struct wfs_sb sb =
+      write_superblock(fd, inode_count, data_block_count, raid_mode,
+                       disk_index, total_disks, features, block_size,
+                       inode_size);
   write_bitmaps(fd, inode_count, data_block_count, &sb);
   write_root_inode(fd, &sb);
+  write_checksum_table(fd, &sb);
 
   close(fd);
   DEBUG_LOG("Disk %s initialized successfully", disk_file);
   return 0;
 }
 
+int parse_feature(const char *name, uint32_t *features) {
+  static const struct {
+    const char *name;
+    uint32_t flag;
+  } known_features[] = {
+      {"multi_indirect", WFS_FEATURE_MULTI_INDIRECT},
+      {"extent", WFS_FEATURE_EXTENTS},
+      {"inline_data", WFS_FEATURE_INLINE_DATA},
+      {"dir_index", WFS_FEATURE_DIR_INDEX},
+      {"checksum", WFS_FEATURE_CHECKSUMS},
+  };
+
+  for (size_t i = 0; i < sizeof(known_features) / sizeof(known_features[0]);
+       i++) {
+    if (strcmp(name, known_features[i].name) == 0) {
+      *features |= known_features[i].flag;
+      DEBUG_LOG("Enabled feature %s", name);
+      return 0;
+    }
+  }
+
+  ERROR_LOG("Unknown feature: %s", name);
+  return -1;
+}
+
+int parse_block_size(const char *arg, size_t *block_size) {
+  char *end;
+  unsigned long value = strtoul(arg, &end, 10);
+
+  if (*end != '\0' || value < MIN_BLOCK_SIZE || value > MAX_BLOCK_SIZE ||
+      (value & (value - 1)) != 0) {
+    ERROR_LOG("Invalid block size: %s (power of two from %d to %d)", arg,
+              MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+    return -1;
+  }
+
+  *block_size = value;
+  DEBUG_LOG("Using block size %zu", *block_size);
+  return 0;
+}
+
+/*
+ * Inode slots are a power of two no larger than a block, so they pack
+ * evenly into the inode table, e.g. -I 256 puts 16 inodes in a 4 KiB block.
+ */
+int parse_inode_size(const char *arg, size_t block_size, size_t *inode_size) {
+  char *end;
+  unsigned long value = strtoul(arg, &end, 10);
+
+  if (*end != '\0' || value < sizeof(struct wfs_inode) || value > block_size ||
+      (value & (value - 1)) != 0) {
+    ERROR_LOG("Invalid inode size: %s (power of two from %zu to %zu)", arg,
+              sizeof(struct wfs_inode), block_size);
+    return -1;
+  }
+
+  *inode_size = value;
+  DEBUG_LOG("Using inode size %zu", *inode_size);
+  return 0;
+}
+
 int split_path(const char *path, char *parent_path, char *dir_name) {
   DEBUG_LOG("Splitting path: %s", path);
 
@@ -4,11 +4,18 @@
 #include "wfs.h"
 #include <stddef.h>
 
-size_t calculate_required_size(size_t inode_count, size_t data_block_count);
+size_t calculate_required_size(size_t inode_count, size_t data_block_count,
+                               size_t block_size, size_t inode_size,
+                               uint32_t features);
 
 int initialize_disk(const char *disk_file, size_t inode_count,
                     size_t data_block_count, size_t required_size,
-                    int raid_mode, int disk_index, int total_disks);
+                    int raid_mode, int disk_index, int total_disks,
+                    uint32_t features, size_t block_size,
+                    size_t inode_size);
+int parse_feature(const char *name, uint32_t *features);
+int parse_block_size(const char *arg, size_t *block_size);
+int parse_inode_size(const char *arg, size_t block_size, size_t *inode_size);
 int split_path(const char *path, char *parent_path, char *dir_name);
 
 #endif // FS_UTILS_H
@@ -63,6 +63,7 @@ void populate_stat_from_inode(const struct wfs_inode *inode,
   stbuf->st_mode = inode->mode;
   stbuf->st_nlink = inode->nlinks;
   stbuf->st_size = inode->size;
+  stbuf->st_blksize = BLOCK_SIZE;
   stbuf->st_atime = inode->atim;
   stbuf->st_mtime = inode->mtim;
   stbuf->st_ctime = inode->ctim;
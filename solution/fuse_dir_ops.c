@@ -2,151 +2,182 @@
 #define FUSE_USE_VERSION 30
 
 #include "data_block.h"
+#include "dcache.h"
 #include "fs_utils.h"
 #include "fuse_common.h"
 #include "globals.h"
 #include "inode.h"
+#include "inode_lock.h"
+#include "node_refs.h"
 #include "wfs.h"
 #include <errno.h>
 #include <fuse.h>
 #include <linux/limits.h>
 #include <unistd.h>
 
-int wfs_mkdir(const char *path, mode_t mode) {
-  DEBUG_LOG("Entering wfs_mkdir: path = %s", path);
-
-  char parent_path[PATH_MAX];
-  char dirname[MAX_NAME];
-  split_path(path, parent_path, dirname);
-  DEBUG_LOG("Path split into: parent = %s, dirname = %s", parent_path, dirname);
-
-  int parent_inode_num = get_inode_index(parent_path);
-  if (parent_inode_num == -ENOENT) {
-    ERROR_LOG("Parent directory not found: %s", parent_path);
-    return -ENOENT;
-  }
-
+static int make_dir_in(int parent_inode_num, const char *name, mode_t mode,
+                       const char *path) {
   struct wfs_inode parent_inode;
   if (read_and_validate_parent_inode(&parent_inode, parent_inode_num) != 0) {
-    ERROR_LOG("Parent is not a valid directory: %s", parent_path);
+    ERROR_LOG("Parent is not a valid directory: inode %d", parent_inode_num);
     return -ENOTDIR;
   }
 
-  if (check_duplicate_dentry(&parent_inode, dirname) == 0) {
-    DEBUG_LOG("Directory already exists: %s", path);
+  if (check_duplicate_dentry(&parent_inode, name) == 0) {
+    DEBUG_LOG("Directory already exists: %s", name);
     return -EEXIST;
   }
 
-  int inode_num = allocate_and_init_inode(mode, S_IFDIR);
+  int inode_num = allocate_and_init_inode(mode, S_IFDIR, parent_inode_num);
   if (inode_num < 0) {
-    ERROR_LOG("Failed to allocate inode for directory: %s", path);
+    ERROR_LOG("Failed to allocate inode for directory: %s", name);
     return inode_num;
   }
 
-  if (add_dentry_to_parent(&parent_inode, parent_inode_num, dirname,
+  if (add_dentry_to_parent(&parent_inode, parent_inode_num, name,
                            inode_num) < 0) {
-    ERROR_LOG("Failed to add directory entry: %s to parent: %s", dirname,
-              parent_path);
+    ERROR_LOG("Failed to add directory entry: %s to parent: %d", name,
+              parent_inode_num);
     return -EIO;
   }
+  dcache_invalidate(parent_inode_num, name, path);
 
-  DEBUG_LOG("Directory created successfully: %s", path);
-  return 0;
+  DEBUG_LOG("Directory created: %s in inode %d -> %d", name, parent_inode_num,
+            inode_num);
+  return inode_num;
 }
 
-int wfs_rmdir(const char *path) {
-  DEBUG_LOG("Entering wfs_rmdir: path = %s\n", path);
+/*
+ * Creates directory name in parent_inode_num and returns its inode number.
+ * path is the new directory's path when the caller has one, so its cached
+ * resolution can be dropped.
+ */
+int wfs_mkdir_at(int parent_inode_num, const char *name, mode_t mode,
+                 const char *path) {
+  inode_write_lock(parent_inode_num);
+  int res = make_dir_in(parent_inode_num, name, mode, path);
+  inode_unlock(parent_inode_num);
+  return res;
+}
+
+int wfs_mkdir(const char *path, mode_t mode) {
+  DEBUG_LOG("Entering wfs_mkdir: path = %s", path);
 
   char parent_path[PATH_MAX];
-  char dir_name[MAX_NAME];
+  char dirname[MAX_NAME];
+  split_path(path, parent_path, dirname);
+  DEBUG_LOG("Path split into: parent = %s, dirname = %s", parent_path, dirname);
 
-  if (split_path(path, parent_path, dir_name) < 0) {
-    DEBUG_LOG("Failed to split path: %s\n", path);
-    return -EINVAL;
+  int parent_inode_num = get_inode_index(parent_path);
+  if (parent_inode_num < 0) {
+    ERROR_LOG("Parent directory not found: %s", parent_path);
+    return parent_inode_num;
   }
 
-  DEBUG_LOG("Parent path: %s, Directory name: %s\n", parent_path, dir_name);
-
-  int parent_inode_num = get_inode_index(parent_path);
-  if (parent_inode_num == -ENOENT) {
-    DEBUG_LOG("Parent directory not found: %s\n", parent_path);
-    return -ENOENT;
+  int res = wfs_mkdir_at(parent_inode_num, dirname, mode, path);
+  if (res < 0) {
+    return res;
   }
 
+  DEBUG_LOG("Directory created successfully: %s", path);
+  return 0;
+}
+
+static int remove_dir_from(int parent_inode_num, const char *name,
+                           const char *path) {
   struct wfs_inode parent_inode;
   read_inode(&parent_inode, parent_inode_num);
 
   if (!S_ISDIR(parent_inode.mode)) {
-    DEBUG_LOG("Parent is not a directory: %s\n", parent_path);
+    DEBUG_LOG("Parent is not a directory: inode %d\n", parent_inode_num);
     return -ENOTDIR;
   }
 
-  int inode_num = find_dentry_in_inode(parent_inode_num, dir_name);
-  if (inode_num == -ENOENT) {
-    DEBUG_LOG("Child not found in parent directory: %s\n", dir_name);
-    return -ENOENT;
+  int inode_num = find_dentry_in_inode(parent_inode_num, name);
+  if (inode_num < 0) {
+    DEBUG_LOG("Child not found in parent directory: %s\n", name);
+    return inode_num;
   }
 
+  // Keeps entries from being added to the directory while it goes.
+  inode_write_lock(inode_num);
   struct wfs_inode inode;
   read_inode(&inode, inode_num);
 
+  int res = 0;
   if (!S_ISDIR(inode.mode)) {
-    DEBUG_LOG("Path is not a directory: %s\n", path);
-    return -ENOTDIR;
+    DEBUG_LOG("Not a directory: %s\n", name);
+    res = -ENOTDIR;
+  } else if (!is_directory_empty(&inode)) {
+    DEBUG_LOG("Directory is not empty: %s\n", name);
+    res = -ENOTEMPTY;
+  } else {
+    if (!keep_unlinked_inode(inode_num)) {
+      free_inode(inode_num);
+    }
+    dcache_forget_dir(inode_num, path);
   }
-
-  if (!is_directory_empty(&inode)) {
-    DEBUG_LOG("Directory is not empty: %s\n", path);
-    return -ENOTEMPTY;
+  inode_unlock(inode_num);
+  if (res < 0) {
+    return res;
   }
 
-  free_inode(inode_num);
-
-  if (remove_dentry_in_inode(&parent_inode, inode_num) < 0) {
-    DEBUG_LOG("Failed to remove directory entry for %s\n", path);
+  if (remove_dentry_in_inode(&parent_inode, name, inode_num) < 0) {
+    DEBUG_LOG("Failed to remove directory entry for %s\n", name);
     return -EIO;
   }
+  dcache_invalidate(parent_inode_num, name, path);
 
   write_inode(&parent_inode, parent_inode_num);
-
-  DEBUG_LOG("Directory successfully removed: %s\n", path);
   return 0;
 }
 
-static int read_and_fill_directory_entries(const struct wfs_inode *dir_inode,
-                                           void *buf, fuse_fill_dir_t filler) {
-  for (int i = 0; i < N_BLOCKS && dir_inode->blocks[i] != -1; i++) {
-    int block_index = dir_inode->blocks[i];
-    int disk_index;
-    block_index = get_raid_disk(block_index, &disk_index);
-
-    if (disk_index < 0) {
-      DEBUG_LOG("Error: Unable to get disk index for block %ld",
-                dir_inode->blocks[i]);
-      return -EIO;
-    }
+/*
+ * Removes the empty directory name from parent_inode_num. path is as for
+ * wfs_mkdir_at().
+ */
+int wfs_rmdir_at(int parent_inode_num, const char *name, const char *path) {
+  inode_write_lock(parent_inode_num);
+  int res = remove_dir_from(parent_inode_num, name, path);
+  inode_unlock(parent_inode_num);
+  return res;
+}
 
-    size_t block_offset = DATA_BLOCK_OFFSET(block_index);
-    DEBUG_LOG("Reading directory block: %d (offset = %zu)", block_index,
-              block_offset);
+int wfs_rmdir(const char *path) {
+  DEBUG_LOG("Entering wfs_rmdir: path = %s\n", path);
 
-    struct wfs_dentry *dentry =
-        (struct wfs_dentry *)((char *)wfs_ctx.disk_mmaps[disk_index] +
-                              block_offset);
+  char parent_path[PATH_MAX];
+  char dir_name[MAX_NAME];
 
-    for (size_t entry_idx = 0;
-         entry_idx < BLOCK_SIZE / sizeof(struct wfs_dentry); entry_idx++) {
-      if (dentry[entry_idx].num == -1) {
-        DEBUG_LOG("Skipping empty directory entry at index %zu", entry_idx);
-        continue;
-      }
+  if (split_path(path, parent_path, dir_name) < 0) {
+    DEBUG_LOG("Failed to split path: %s\n", path);
+    return -EINVAL;
+  }
 
-      DEBUG_LOG("Adding entry: name = %s, inode = %d", dentry[entry_idx].name,
-                dentry[entry_idx].num);
-      filler(buf, dentry[entry_idx].name, NULL, 0);
-    }
+  DEBUG_LOG("Parent path: %s, Directory name: %s\n", parent_path, dir_name);
+
+  int parent_inode_num = get_inode_index(parent_path);
+  if (parent_inode_num < 0) {
+    DEBUG_LOG("Parent directory not found: %s\n", parent_path);
+    return parent_inode_num;
   }
 
+  int res = wfs_rmdir_at(parent_inode_num, dir_name, path);
+  if (res == 0) {
+    DEBUG_LOG("Directory successfully removed: %s\n", path);
+  }
+  return res;
+}
+
+struct fill_context {
+  void *buf;
+  fuse_fill_dir_t filler;
+};
+
+static int fill_entry(const struct wfs_dentry *entry, void *arg) {
+  struct fill_context *context = arg;
+  DEBUG_LOG("Adding entry: name = %s, inode = %d", entry->name, entry->num);
+  context->filler(context->buf, entry->name, NULL, 0);
   return 0;
 }
 
@@ -165,10 +196,12 @@ int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   DEBUG_LOG("Found inode for %s: %d\n", path, inode_num);
 
   struct wfs_inode dir_inode;
+  inode_read_lock(inode_num);
   read_inode(&dir_inode, inode_num);
 
   if (!S_ISDIR(dir_inode.mode)) {
     DEBUG_LOG("Path is not a directory: %s\n", path);
+    inode_unlock(inode_num);
     return -ENOTDIR;
   }
 
@@ -176,7 +209,10 @@ int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             dir_inode.mode, dir_inode.size);
 
   DEBUG_LOG("Reading directory entries for path: %s", path);
-  if (read_and_fill_directory_entries(&dir_inode, buf, filler) != 0) {
+  struct fill_context context = {buf, filler};
+  int res = for_each_dentry(&dir_inode, fill_entry, &context);
+  inode_unlock(inode_num);
+  if (res != 0) {
     return -EIO;
   }
 
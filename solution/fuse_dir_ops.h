@@ -6,7 +6,10 @@
 #include <stddef.h>
 #include <sys/stat.h>
 
+int wfs_mkdir_at(int parent_inode_num, const char *name, mode_t mode,
+                 const char *path);
 int wfs_mkdir(const char *path, mode_t mode);
+int wfs_rmdir_at(int parent_inode_num, const char *name, const char *path);
 int wfs_rmdir(const char *path);
 int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                 off_t offset, struct fuse_file_info *fi);
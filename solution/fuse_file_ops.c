@@ -1,43 +1,165 @@
 #define FUSE_USE_VERSION 30
 
+#include "block_checksum.h"
+#include "block_map.h"
 #include "data_block.h"
+#include "dcache.h"
+#include "extent.h"
+#include "free_space.h"
 #include "fs_utils.h"
+#include "fuse_common.h"
 #include "globals.h"
 #include "inode.h"
+#include "inode_cache.h"
+#include "inode_lock.h"
+#include "node_refs.h"
+#include "raid.h"
+#include "read_balance.h"
+#include "replication.h"
 #include "wfs.h"
 #include <errno.h>
 #include <fuse.h>
+#include <linux/falloc.h>
 #include <linux/limits.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-int wfs_write(const char *path, const char *buf, size_t size, off_t offset,
-              struct fuse_file_info *fi) {
-  DEBUG_LOG("Entering wfs_write: path = %s, size = %zu, offset = %lld\n", path,
-            size, (long long)offset);
+/*
+ * Resolves every block touched by [offset, offset + size) in one pass, so the
+ * indirect block is consulted once per request rather than once per block.
+ * The caller frees *blocks.
+ */
+static int map_request_blocks(const struct wfs_inode *inode, size_t size,
+                              off_t offset, int **blocks) {
+  size_t first_block = offset / BLOCK_SIZE;
+  size_t num_blocks =
+      (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE - first_block;
+
+  *blocks = malloc(num_blocks * sizeof(int));
+  if (!*blocks) {
+    ERROR_LOG("Failed to allocate block map for %zu blocks\n", num_blocks);
+    return -ENOMEM;
+  }
 
-  int N_DIRECT = N_BLOCKS - 1;
+  int res = resolve_block_range(inode, first_block, num_blocks, *blocks);
+  if (res < 0) {
+    free(*blocks);
+    *blocks = NULL;
+    return res;
+  }
+
+  return num_blocks;
+}
+
+static off_t max_file_size(const struct wfs_inode *inode) {
+  size_t max_blocks =
+      inode_uses_extents(inode) ? UINT32_MAX : max_file_blocks();
+  return (off_t)max_blocks * BLOCK_SIZE;
+}
+
+/*
+ * Copies the next run_size bytes of src straight into the primary disk's
+ * mapping, then mirrors the run. Only used for whole, physically adjacent
+ * blocks, so nothing has to be read back first.
+ */
+static int write_block_run(struct fuse_bufvec *src, int disk_index,
+                           size_t run_offset, size_t run_size) {
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(run_size);
+  dst.buf[0].mem = (char *)wfs_ctx.disk_mmaps[disk_index] + run_offset;
+
+  ssize_t res = fuse_buf_copy(&dst, src, 0);
+  if (res != (ssize_t)run_size) {
+    ERROR_LOG("Short copy into block run at offset %zu: %zd of %zu\n",
+              run_offset, res, run_size);
+    return res < 0 ? res : -EIO;
+  }
+
+  store_block_checksums(disk_index, run_offset, run_size);
+  if (sb.raid_mode == RAID_1 || sb.raid_mode == RAID_1v) {
+    replicate(dst.buf[0].mem, run_offset, run_size, disk_index);
+  }
+
+  DEBUG_LOG("Wrote block run of %zu bytes at offset %zu on disk %d\n",
+            run_size, run_offset, disk_index);
+  return 0;
+}
+
+static int write_inline_file(struct wfs_inode *inode, int inode_num,
+                             struct fuse_bufvec *src, off_t offset,
+                             size_t size) {
+  char *buffer = malloc(size);
+  if (!buffer) {
+    return -ENOMEM;
+  }
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+  dst.buf[0].mem = buffer;
+
+  if (fuse_buf_copy(&dst, src, 0) != (ssize_t)size) {
+    ERROR_LOG("Short copy into inline data of inode %d\n", inode_num);
+    free(buffer);
+    return -EIO;
+  }
+
+  write_inline_data(inode_num, buffer, offset, size);
+  free(buffer);
+  update_inode_size(inode, inode_num, offset + size);
+  return size;
+}
+
+static int write_inode_data(struct wfs_inode *inode, int inode_num,
+                            struct fuse_bufvec *src, off_t offset) {
+  size_t size = fuse_buf_size(src);
   size_t bytes_written = 0;
   size_t block_offset, to_write;
-  char block_buffer[BLOCK_SIZE];
+  char *block_buffer;
+  off_t old_blocks[N_BLOCKS];
+  int run_disk = -1;
+  size_t run_offset = 0, run_size = 0;
+  int *blocks, *old_map;
+  int read_res = 0;
+  int res;
 
-  int inode_num = get_inode_index(path);
-  if (inode_num == -ENOENT) {
-    DEBUG_LOG("File not found: %s\n", path);
-    return -ENOENT;
+  if (size == 0) {
+    return 0;
   }
 
-  struct wfs_inode inode;
-  read_inode(&inode, inode_num);
+  if (inode_has_inline_data(inode)) {
+    if (offset + size <= inline_data_capacity()) {
+      return write_inline_file(inode, inode_num, src, offset, size);
+    }
+    if ((res = unpack_inline_data(inode)) < 0) {
+      return res;
+    }
+  }
 
-  if (!S_ISREG(inode.mode)) {
-    DEBUG_LOG("Path is not a regular file: %s\n", path);
-    return -EISDIR;
+  if (offset + (off_t)size > max_file_size(inode)) {
+    return -EFBIG;
+  }
+
+  memcpy(old_blocks, inode->blocks, sizeof(old_blocks));
+
+  int num_blocks = map_request_blocks(inode, size, offset, &blocks);
+  if (num_blocks < 0) {
+    return num_blocks;
+  }
+
+  // Blocks that were holes until now hold stale bytes, so a partial write
+  // into one must start from zeros rather than read it back.
+  old_map = malloc(num_blocks * sizeof(int));
+  block_buffer = malloc(BLOCK_SIZE);
+  if (!old_map || !block_buffer) {
+    free(blocks);
+    free(old_map);
+    free(block_buffer);
+    return -ENOMEM;
   }
+  memcpy(old_map, blocks, num_blocks * sizeof(int));
 
-  DEBUG_LOG("Inode info: size = %zu, blocks = %ld\n", inode.size,
-            inode.blocks[0]);
+  int alloc_res =
+      allocate_block_range(inode, offset / BLOCK_SIZE, num_blocks, blocks);
 
   while (bytes_written < size) {
     size_t block_index = (offset + bytes_written) / BLOCK_SIZE;
@@ -46,185 +168,869 @@ int wfs_write(const char *path, const char *buf, size_t size, off_t offset,
     DEBUG_LOG("block_index = %ld, block_offset = %ld\n", block_index,
               block_offset);
 
-    int data_block_num;
-    if (block_index < N_DIRECT) {
-      data_block_num = allocate_direct_block(&inode, block_index);
-    } else {
-      data_block_num =
-          allocate_indirect_block(&inode, block_index, block_buffer);
-      if (data_block_num == -1) {
-        data_block_num = allocate_free_data_block();
-        if (data_block_num < 0) {
-          DEBUG_LOG("Failed to allocate data block for indirect index %zu\n",
-                    block_index - N_DIRECT);
-          return -EIO;
-        }
-
-        int *indirect_blocks = (int *)block_buffer;
-        size_t indirect_index = block_index - N_DIRECT;
-        indirect_blocks[indirect_index] = data_block_num;
-        write_data_block(block_buffer, inode.blocks[N_DIRECT]);
-      }
+    int data_block_num = blocks[block_index - offset / BLOCK_SIZE];
+    int fresh = old_map[block_index - offset / BLOCK_SIZE] == -1;
+    if (data_block_num < 0) {
+      DEBUG_LOG("Ran out of blocks at index %zu: %d\n", block_index,
+                alloc_res);
+      break;
     }
 
-    read_data_block(block_buffer, data_block_num);
-
     to_write = (size - bytes_written < BLOCK_SIZE - block_offset)
                    ? size - bytes_written
                    : BLOCK_SIZE - block_offset;
 
     DEBUG_LOG("to_write: %ld\n", to_write);
 
-    memcpy(block_buffer + block_offset, buf + bytes_written, to_write);
-    write_data_block(block_buffer, data_block_num);
+    if (to_write == BLOCK_SIZE) {
+      int disk_index;
+      size_t location = get_data_block_location(data_block_num, &disk_index);
+
+      if (run_size > 0 &&
+          (disk_index != run_disk || location != run_offset + run_size)) {
+        if ((res = write_block_run(src, run_disk, run_offset, run_size)) < 0) {
+          free(blocks);
+          free(old_map);
+          free(block_buffer);
+          return res;
+        }
+        run_size = 0;
+      }
+      if (run_size == 0) {
+        run_disk = disk_index;
+        run_offset = location;
+      }
+      run_size += BLOCK_SIZE;
+    } else {
+      if (run_size > 0) {
+        if ((res = write_block_run(src, run_disk, run_offset, run_size)) < 0) {
+          free(blocks);
+          free(old_map);
+          free(block_buffer);
+          return res;
+        }
+        run_size = 0;
+      }
+
+      // A block whose stored copy fails its checksum is not rewritten:
+      // that would give the corrupt bytes a fresh, valid checksum.
+      if (fresh) {
+        memset(block_buffer, 0, BLOCK_SIZE);
+      } else if ((read_res = read_data_block(block_buffer, data_block_num)) <
+                 0) {
+        ERROR_LOG("Cannot update unreadable block %d\n", data_block_num);
+        break;
+      }
+
+      struct fuse_bufvec dst = FUSE_BUFVEC_INIT(to_write);
+      dst.buf[0].mem = block_buffer + block_offset;
+      if (fuse_buf_copy(&dst, src, 0) != (ssize_t)to_write) {
+        ERROR_LOG("Short copy into block %d\n", data_block_num);
+        free(blocks);
+        free(old_map);
+        free(block_buffer);
+        return -EIO;
+      }
+
+      write_data_block(block_buffer, data_block_num);
+    }
     DEBUG_LOG("Data written to block number: %d\n", data_block_num);
 
     bytes_written += to_write;
   }
 
-  if (offset + bytes_written > inode.size) {
-    inode.size = offset + bytes_written;
-    write_inode(&inode, inode_num);
+  free(blocks);
+  free(old_map);
+  free(block_buffer);
+
+  if (run_size > 0) {
+    if ((res = write_block_run(src, run_disk, run_offset, run_size)) < 0) {
+      return res;
+    }
+  }
+
+  if (bytes_written > 0 && offset + bytes_written > inode->size) {
+    inode->size = offset + bytes_written;
+    write_inode(inode, inode_num);
+  } else if (memcmp(old_blocks, inode->blocks, sizeof(old_blocks)) != 0) {
+    write_inode(inode, inode_num);
   }
 
-  DEBUG_LOG("Write complete: %zu bytes written to %s\n", bytes_written, path);
+  if (bytes_written == 0 && read_res < 0) {
+    return read_res;
+  }
+  if (bytes_written == 0 && alloc_res < 0) {
+    return alloc_res;
+  }
   return bytes_written;
 }
 
-int wfs_read(const char *path, char *buf, size_t size, off_t offset,
-             struct fuse_file_info *fi) {
-  DEBUG_LOG("Entering wfs_read: path = %s, size = %zu, offset = %lld\n", path,
+static int load_regular_inode(int inode_num, struct wfs_inode *inode) {
+  // The file may have been unlinked while we waited for its lock.
+  if (!inode_is_allocated(inode_num)) {
+    DEBUG_LOG("Inode %d was freed before we locked it\n", inode_num);
+    return -ENOENT;
+  }
+  read_inode(inode, inode_num);
+
+  if (!S_ISREG(inode->mode)) {
+    DEBUG_LOG("Inode %d is not a regular file\n", inode_num);
+    return -EISDIR;
+  }
+
+  DEBUG_LOG("Inode info: size = %zu, blocks = %ld\n", inode->size,
+            inode->blocks[0]);
+  return inode_num;
+}
+
+int wfs_write_ino(int inode_num, struct fuse_bufvec *buf, off_t offset) {
+  struct wfs_inode inode;
+  inode_write_lock(inode_num);
+  begin_replica_batch();
+  int res = load_regular_inode(inode_num, &inode);
+  if (res >= 0) {
+    res = write_inode_data(&inode, inode_num, buf, offset);
+  }
+  end_replica_batch();
+  inode_unlock(inode_num);
+  return res;
+}
+
+int wfs_write(const char *path, const char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi) {
+  DEBUG_LOG("Entering wfs_write: path = %s, size = %zu, offset = %lld\n", path,
             size, (long long)offset);
 
-  int N_DIRECT = N_BLOCKS - 1;
-  size_t bytes_read = 0;
-  size_t block_offset, to_read;
-  char block_buffer[BLOCK_SIZE];
+  int inode_num = find_inode_for_path(path);
+  if (inode_num < 0) {
+    return inode_num;
+  }
 
-  int inode_num = get_inode_index(path);
-  if (inode_num == -ENOENT) {
-    DEBUG_LOG("File not found: %s\n", path);
-    return -ENOENT;
+  struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+  src.buf[0].mem = (void *)buf;
+
+  int bytes_written = wfs_write_ino(inode_num, &src, offset);
+
+  DEBUG_LOG("Write complete: %d bytes written to %s\n", bytes_written, path);
+  return bytes_written;
+}
+
+int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                  struct fuse_file_info *fi) {
+  DEBUG_LOG("Entering wfs_write_buf: path = %s, size = %zu, offset = %lld\n",
+            path, fuse_buf_size(buf), (long long)offset);
+
+  int inode_num = find_inode_for_path(path);
+  if (inode_num < 0) {
+    return inode_num;
   }
 
-  struct wfs_inode inode;
-  read_inode(&inode, inode_num);
+  int bytes_written = wfs_write_ino(inode_num, buf, offset);
 
-  if (!S_ISREG(inode.mode)) {
-    DEBUG_LOG("Path is not a regular file: %s\n", path);
-    return -EISDIR;
+  DEBUG_LOG("Write complete: %d bytes written to %s\n", bytes_written, path);
+  return bytes_written;
+}
+
+static size_t clamp_read_size(const struct wfs_inode *inode, size_t size,
+                              off_t offset) {
+  if (offset >= inode->size) {
+    return 0;
   }
+  if (size > inode->size - offset) {
+    return inode->size - offset;
+  }
+  return size;
+}
 
-  DEBUG_LOG("Inode info: size = %zu, blocks = %ld\n", inode.size,
-            inode.blocks[0]);
+static int read_inode_data(struct wfs_inode *inode, char *buf, size_t size,
+                           off_t offset) {
+  size_t bytes_read = 0;
+  size_t block_offset, to_read;
+  char *block_buffer = NULL;
+  int *blocks;
 
-  if (offset >= inode.size) {
-    DEBUG_LOG("Offset is beyond the file size: %s\n", path);
+  if (size == 0) {
     return 0;
   }
 
-  while (bytes_read < size && offset + bytes_read < inode.size) {
+  if (inode_has_inline_data(inode)) {
+    memcpy(buf, (char *)map_inline_data(inode->num) + offset, size);
+    return size;
+  }
+
+  int res = map_request_blocks(inode, size, offset, &blocks);
+  if (res < 0) {
+    return res;
+  }
+
+  while (bytes_read < size) {
     size_t block_index = (offset + bytes_read) / BLOCK_SIZE;
     block_offset = (offset + bytes_read) % BLOCK_SIZE;
 
     DEBUG_LOG("block_index = %ld, block_offset = %ld\n", block_index,
               block_offset);
 
-    int data_block_num;
+    int data_block_num = blocks[block_index - offset / BLOCK_SIZE];
 
-    if (block_index < N_DIRECT) {
-      data_block_num = inode.blocks[block_index];
-    } else {
-      size_t indirect_index = block_index - N_DIRECT;
-      data_block_num =
-          read_from_indirect_block(&inode, indirect_index, block_buffer);
-    }
+    to_read = (size - bytes_read < BLOCK_SIZE - block_offset)
+                  ? size - bytes_read
+                  : BLOCK_SIZE - block_offset;
+
+    DEBUG_LOG("to_read: %ld\n", to_read);
 
     if (data_block_num == -1) {
-      DEBUG_LOG("No data block allocated at index %zu\n", block_index);
-      return -EIO;
+      DEBUG_LOG("Block index %zu is a hole\n", block_index);
+      memset(buf + bytes_read, 0, to_read);
+      bytes_read += to_read;
+      continue;
+    }
+
+    // Whole blocks land in buf directly; only partial ones need a copy.
+    char *dst = buf + bytes_read;
+    if (to_read < BLOCK_SIZE) {
+      if (!block_buffer && !(block_buffer = malloc(BLOCK_SIZE))) {
+        free(blocks);
+        return -ENOMEM;
+      }
+      dst = block_buffer;
     }
 
     DEBUG_LOG("Reading data block number: %d\n", data_block_num);
-    read_data_block(block_buffer, data_block_num);
+    res = read_data_block(dst, data_block_num);
+    if (res < 0) {
+      free(blocks);
+      free(block_buffer);
+      return res;
+    }
 
-    DEBUG_LOG("Block %d contents before read:\n", data_block_num);
-    for (int i = 0; i < BLOCK_SIZE; i++) {
-      DEBUG_LOG("%02x ", (unsigned char)block_buffer[i]);
+    if (dst == block_buffer) {
+      memcpy(buf + bytes_read, block_buffer + block_offset, to_read);
     }
-    DEBUG_LOG("\n");
+    bytes_read += to_read;
+  }
 
-    to_read = (inode.size - (offset + bytes_read) < BLOCK_SIZE - block_offset)
-                  ? inode.size - (offset + bytes_read)
-                  : BLOCK_SIZE - block_offset;
+  free(blocks);
+  free(block_buffer);
+  return bytes_read;
+}
 
-    DEBUG_LOG("to_read: %ld\n", to_read);
+int wfs_read_ino(int inode_num, char *buf, size_t size, off_t offset) {
+  struct wfs_inode inode;
+  inode_read_lock(inode_num);
+  int res = load_regular_inode(inode_num, &inode);
+  if (res >= 0) {
+    res = read_inode_data(&inode, buf, clamp_read_size(&inode, size, offset),
+                          offset);
+  }
+  inode_unlock(inode_num);
+  return res;
+}
+
+int wfs_read(const char *path, char *buf, size_t size, off_t offset,
+             struct fuse_file_info *fi) {
+  DEBUG_LOG("Entering wfs_read: path = %s, size = %zu, offset = %lld\n", path,
+            size, (long long)offset);
+
+  int inode_num = find_inode_for_path(path);
+  if (inode_num < 0) {
+    return inode_num;
+  }
+
+  int bytes_read = wfs_read_ino(inode_num, buf, size, offset);
+
+  DEBUG_LOG("Read complete: %d bytes read from %s\n", bytes_read, path);
+  return bytes_read;
+}
+
+/*
+ * Describes the requested range as file-descriptor buffers over the disk
+ * images, so FUSE can copy (or splice) straight from the pages backing
+ * disk_mmaps. Physically adjacent blocks on the same disk share one entry,
+ * and holes are served from zero-filled memory. Under RAID-1 the request
+ * goes to the mirror the read policy picks; under RAID-1v each block is
+ * voted on first and served from a disk holding the winning copy. With
+ * block checksums each block is verified instead, and a block that fails
+ * is served from another disk, or fails the read with -EIO.
+ *
+ * The buffers point at the file's current blocks, so the caller holds the
+ * inode's read lock until FUSE has copied out of them.
+ */
+int wfs_map_read_buf_ino(int inode_num, struct fuse_bufvec **bufp,
+                         size_t size, off_t offset) {
+  struct wfs_inode inode;
+  int res = load_regular_inode(inode_num, &inode);
+  if (res < 0) {
+    return res;
+  }
+
+  size = clamp_read_size(&inode, size, offset);
+  size_t max_runs = (offset % BLOCK_SIZE + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  struct fuse_bufvec *bufvec =
+      malloc(sizeof(struct fuse_bufvec) + max_runs * sizeof(struct fuse_buf));
+  if (!bufvec) {
+    ERROR_LOG("Failed to allocate buffer vector for inode %d\n", inode_num);
+    return -ENOMEM;
+  }
+  *bufvec = FUSE_BUFVEC_INIT(size);
+
+  if (size == 0) {
+    *bufp = bufvec;
+    return 0;
+  }
+
+  if (inode_has_inline_data(&inode)) {
+    bufvec->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufvec->buf[0].fd = wfs_ctx.disk_fds[0];
+    bufvec->buf[0].pos = INODE_INLINE_OFFSET(inode_num) + offset;
+    *bufp = bufvec;
+    return 0;
+  }
+
+  int *blocks;
+  res = map_request_blocks(&inode, size, offset, &blocks);
+  if (res < 0) {
+    free(bufvec);
+    return res;
+  }
+
+  struct fuse_buf *run = NULL;
+  size_t bytes_mapped = 0;
+  int read_disk = -1;
+  bufvec->count = 0;
+
+  while (bytes_mapped < size) {
+    size_t block_index = (offset + bytes_mapped) / BLOCK_SIZE;
+    size_t block_offset = (offset + bytes_mapped) % BLOCK_SIZE;
 
-    memcpy(buf + bytes_read, block_buffer + block_offset, to_read);
+    int data_block_num = blocks[block_index - offset / BLOCK_SIZE];
+    size_t to_map = (size - bytes_mapped < BLOCK_SIZE - block_offset)
+                        ? size - bytes_mapped
+                        : BLOCK_SIZE - block_offset;
+
+    // Holes become memory runs (fd -1), zero-filled once their size is known.
+    int fd = -1;
+    off_t pos = 0;
+    if (data_block_num != -1) {
+      int disk_index;
+      off_t block_pos = get_data_block_location(data_block_num, &disk_index);
+      if (sb.raid_mode == RAID_1) {
+        // One mirror serves the whole request, so runs stay merged.
+        if (read_disk < 0) {
+          read_disk =
+              begin_disk_read(block_pos + block_offset, size - bytes_mapped);
+        }
+        disk_index = read_disk;
+      }
+      disk_index = find_read_disk(block_pos, disk_index);
+      if (disk_index < 0) {
+        ERROR_LOG("Block %d of inode %d is corrupt on every disk\n",
+                  data_block_num, inode_num);
+        res = disk_index;
+        break;
+      }
+      pos = block_pos + block_offset;
+      fd = wfs_ctx.disk_fds[disk_index];
+    }
 
-    DEBUG_LOG("Buffer after reading data:\n");
-    for (size_t i = 0; i < to_read; i++) {
-      DEBUG_LOG("%02x ", (unsigned char)buf[bytes_read + i]);
+    if (run && run->fd == fd &&
+        (fd == -1 || run->pos + (off_t)run->size == pos)) {
+      run->size += to_map;
+    } else {
+      run = &bufvec->buf[bufvec->count++];
+      run->size = to_map;
+      run->flags = fd == -1 ? 0 : FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      run->mem = NULL;
+      run->fd = fd;
+      run->pos = pos;
     }
-    DEBUG_LOG("\n");
 
-    bytes_read += to_read;
+    bytes_mapped += to_map;
+  }
+  free(blocks);
+  if (read_disk >= 0) {
+    end_disk_read(read_disk);
+  }
+  if (res < 0) {
+    free(bufvec);
+    return res;
   }
 
-  DEBUG_LOG("Read complete: %zu bytes read from %s\n", bytes_read, path);
-  return bytes_read;
+  for (size_t i = 0; i < bufvec->count; i++) {
+    if (bufvec->buf[i].fd != -1) {
+      continue;
+    }
+    bufvec->buf[i].mem = calloc(1, bufvec->buf[i].size);
+    if (!bufvec->buf[i].mem) {
+      for (size_t j = 0; j < i; j++) {
+        free(bufvec->buf[j].mem);
+      }
+      free(bufvec);
+      return -ENOMEM;
+    }
+  }
+
+  DEBUG_LOG("Mapped %zu bytes of inode %d into %zu buffer(s)\n", bytes_mapped,
+            inode_num, bufvec->count);
+  *bufp = bufvec;
+  return 0;
 }
 
-int wfs_unlink(const char *path) {
-  DEBUG_LOG("Entering wfs_unlink: path = %s\n", path);
+// Set when FUSE serves requests from several threads.
+static int stage_reads;
 
-  char parent_path[PATH_MAX];
-  char file_name[MAX_NAME];
+void set_read_staging(int enabled) { stage_reads = enabled; }
 
-  if (split_path(path, parent_path, file_name) < 0) {
-    DEBUG_LOG("Failed to split path: %s\n", path);
+/*
+ * Copies the range into a single memory buffer under the inode lock. The
+ * high-level API copies out of read_buf's buffers only after we return, by
+ * which time another thread may have freed or rewritten the blocks an fd
+ * buffer points at.
+ */
+static int stage_read_buf(int inode_num, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset) {
+  struct fuse_bufvec *bufvec = malloc(sizeof(struct fuse_bufvec));
+  char *mem = malloc(size ? size : 1);
+  if (!bufvec || !mem) {
+    ERROR_LOG("Failed to allocate read buffer for inode %d\n", inode_num);
+    free(bufvec);
+    free(mem);
+    return -ENOMEM;
+  }
+
+  int res = wfs_read_ino(inode_num, mem, size, offset);
+  if (res < 0) {
+    free(bufvec);
+    free(mem);
+    return res;
+  }
+  *bufvec = FUSE_BUFVEC_INIT(res);
+  bufvec->buf[0].mem = mem;
+  *bufp = bufvec;
+  return 0;
+}
+
+int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                 off_t offset, struct fuse_file_info *fi) {
+  DEBUG_LOG("Entering wfs_read_buf: path = %s, size = %zu, offset = %lld\n",
+            path, size, (long long)offset);
+
+  int inode_num = find_inode_for_path(path);
+  if (inode_num < 0) {
+    return inode_num;
+  }
+  if (stage_reads) {
+    return stage_read_buf(inode_num, bufp, size, offset);
+  }
+
+  // Single-threaded, nothing runs between our return and FUSE's copy.
+  inode_read_lock(inode_num);
+  int res = wfs_map_read_buf_ino(inode_num, bufp, size, offset);
+  inode_unlock(inode_num);
+  return res;
+}
+
+// Source for clearing whole blocks and inline bytes.
+static const char zero_block[MAX_BLOCK_SIZE];
+
+static int zero_block_bytes(int block_num, size_t start, size_t len) {
+  if (len == BLOCK_SIZE) {
+    write_data_block(zero_block, block_num);
+    return 0;
+  }
+
+  char *block_buffer = malloc(BLOCK_SIZE);
+  if (!block_buffer) {
+    return -ENOMEM;
+  }
+  // As in write_inode_data, a corrupt block is left alone.
+  int res = read_data_block(block_buffer, block_num);
+  if (res == 0) {
+    memset(block_buffer + start, 0, len);
+    write_data_block(block_buffer, block_num);
+  }
+  free(block_buffer);
+  return res;
+}
+
+/*
+ * Zeroes bytes [from, to) wherever they are backed by a block; holes read
+ * as zeros already.
+ */
+static int zero_file_bytes(const struct wfs_inode *inode, off_t from,
+                           off_t to) {
+  int *blocks;
+  int res = 0;
+
+  if (from >= to) {
+    return 0;
+  }
+
+  int num_blocks = map_request_blocks(inode, to - from, from, &blocks);
+  if (num_blocks < 0) {
+    return num_blocks;
+  }
+
+  for (int i = 0; res == 0 && i < num_blocks; i++) {
+    off_t block_start = (from / BLOCK_SIZE + i) * BLOCK_SIZE;
+    off_t start = from > block_start ? from : block_start;
+    off_t end = to < block_start + (off_t)BLOCK_SIZE
+                    ? to
+                    : block_start + (off_t)BLOCK_SIZE;
+
+    if (blocks[i] != -1) {
+      res = zero_block_bytes(blocks[i], start - block_start, end - start);
+    }
+  }
+
+  free(blocks);
+  return res;
+}
+
+static int punch_hole(struct wfs_inode *inode, int inode_num, off_t offset,
+                      off_t end) {
+  size_t first_whole = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  size_t last_whole = end / BLOCK_SIZE;
+  int res;
+
+  if (first_whole >= last_whole) {
+    return zero_file_bytes(inode, offset, end);
+  }
+
+  if ((res = zero_file_bytes(inode, offset, first_whole * BLOCK_SIZE)) < 0 ||
+      (res = zero_file_bytes(inode, last_whole * BLOCK_SIZE, end)) < 0) {
+    return res;
+  }
+
+  res = free_block_range(inode, first_whole, last_whole);
+  write_inode(inode, inode_num);
+  return res;
+}
+
+/*
+ * Allocates every hole in [offset, end), zero-filling the new blocks so no
+ * stale data becomes visible. With zero_range, bytes of blocks that were
+ * already allocated are cleared as well.
+ */
+static int preallocate_range(struct wfs_inode *inode, int inode_num,
+                             off_t offset, off_t end, int zero_range) {
+  int *blocks, *old_map;
+
+  int num_blocks = map_request_blocks(inode, end - offset, offset, &blocks);
+  if (num_blocks < 0) {
+    return num_blocks;
+  }
+
+  old_map = malloc(num_blocks * sizeof(int));
+  if (!old_map) {
+    free(blocks);
+    return -ENOMEM;
+  }
+  memcpy(old_map, blocks, num_blocks * sizeof(int));
+
+  int res =
+      allocate_block_range(inode, offset / BLOCK_SIZE, num_blocks, blocks);
+
+  for (int i = 0; i < num_blocks; i++) {
+    off_t block_start = (offset / BLOCK_SIZE + i) * BLOCK_SIZE;
+    off_t start = offset > block_start ? offset : block_start;
+    off_t stop = end < block_start + (off_t)BLOCK_SIZE
+                     ? end
+                     : block_start + (off_t)BLOCK_SIZE;
+
+    if (blocks[i] == -1) {
+      continue;
+    }
+    if (old_map[i] == -1) {
+      zero_block_bytes(blocks[i], 0, BLOCK_SIZE);
+    } else if (zero_range) {
+      int zero_res =
+          zero_block_bytes(blocks[i], start - block_start, stop - start);
+      if (res == 0) {
+        res = zero_res;
+      }
+    }
+  }
+
+  free(blocks);
+  free(old_map);
+  write_inode(inode, inode_num);
+  return res;
+}
+
+static int fallocate_inode(int inode_num, int mode, off_t offset,
+                           off_t length) {
+  if (offset < 0 || length <= 0) {
     return -EINVAL;
   }
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+               FALLOC_FL_ZERO_RANGE)) {
+    DEBUG_LOG("Unsupported fallocate mode %#x\n", mode);
+    return -EOPNOTSUPP;
+  }
+  if ((mode & FALLOC_FL_PUNCH_HOLE) &&
+      (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE))) {
+    return -EOPNOTSUPP;
+  }
 
-  DEBUG_LOG("Parent path: %s, File name: %s\n", parent_path, file_name);
+  struct wfs_inode inode;
+  int res = load_regular_inode(inode_num, &inode);
+  if (res < 0) {
+    return res;
+  }
+  res = 0;
 
-  int parent_inode_num = get_inode_index(parent_path);
-  if (parent_inode_num == -ENOENT) {
-    DEBUG_LOG("Parent directory not found: %s\n", parent_path);
-    return -ENOENT;
+  off_t end = offset + length;
+  int clears = mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE);
+
+  if (inode_has_inline_data(&inode)) {
+    off_t capacity = inline_data_capacity();
+
+    if ((mode & FALLOC_FL_PUNCH_HOLE) || end <= capacity) {
+      if (clears && offset < capacity) {
+        size_t len = (end < capacity ? end : capacity) - offset;
+        write_inline_data(inode_num, zero_block, offset, len);
+      }
+    } else {
+      res = unpack_inline_data(&inode);
+    }
+  }
+
+  if (res == 0 && !inode_has_inline_data(&inode)) {
+    if (!(mode & FALLOC_FL_PUNCH_HOLE) && end > max_file_size(&inode)) {
+      return -EFBIG;
+    }
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+      res = punch_hole(&inode, inode_num, offset, end);
+    } else {
+      res = preallocate_range(&inode, inode_num, offset, end,
+                              mode & FALLOC_FL_ZERO_RANGE);
+    }
   }
 
+  if (res == 0 && !(mode & FALLOC_FL_KEEP_SIZE)) {
+    update_inode_size(&inode, inode_num, end);
+  }
+
+  return res;
+}
+
+int wfs_fallocate_ino(int inode_num, int mode, off_t offset, off_t length) {
+  inode_write_lock(inode_num);
+  begin_replica_batch();
+  int res = fallocate_inode(inode_num, mode, offset, length);
+  end_replica_batch();
+  inode_unlock(inode_num);
+  return res;
+}
+
+int wfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                  struct fuse_file_info *fi) {
+  DEBUG_LOG("Entering wfs_fallocate: path = %s, mode = %#x, offset = %lld, "
+            "length = %lld\n",
+            path, mode, (long long)offset, (long long)length);
+
+  int inode_num = find_inode_for_path(path);
+  if (inode_num < 0) {
+    return inode_num;
+  }
+
+  int res = wfs_fallocate_ino(inode_num, mode, offset, length);
+  DEBUG_LOG("fallocate on %s returned %d\n", path, res);
+  return res;
+}
+
+/*
+ * Sets the size of a regular file. Growing only moves the size, leaving a
+ * hole. Shrinking zeroes the tail of the new last block, so growing again
+ * later reads zeros, and frees every block past it, including blocks
+ * preallocated beyond the old size.
+ */
+static int truncate_inode(struct wfs_inode *inode, int inode_num,
+                          off_t size) {
+  int res;
+
+  if (size < 0) {
+    return -EINVAL;
+  }
+
+  if (inode_has_inline_data(inode)) {
+    off_t capacity = inline_data_capacity();
+
+    if (size <= capacity) {
+      if (size < (off_t)inode->size) {
+        write_inline_data(inode_num, zero_block, size, inode->size - size);
+      }
+      inode->size = size;
+      write_inode(inode, inode_num);
+      return 0;
+    }
+    if ((res = unpack_inline_data(inode)) < 0) {
+      return res;
+    }
+  }
+
+  if (size > max_file_size(inode)) {
+    return -EFBIG;
+  }
+
+  if (size < (off_t)inode->size) {
+    size_t keep_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    drop_reservation(inode_num);
+    if ((res = zero_file_bytes(inode, size, keep_blocks * BLOCK_SIZE)) < 0 ||
+        (res = free_block_range(inode, keep_blocks, SIZE_MAX)) < 0) {
+      return res;
+    }
+  }
+
+  inode->size = size;
+  write_inode(inode, inode_num);
+  return 0;
+}
+
+int wfs_truncate_ino(int inode_num, off_t size) {
+  struct wfs_inode inode;
+  inode_write_lock(inode_num);
+  begin_replica_batch();
+  int res = load_regular_inode(inode_num, &inode);
+  if (res >= 0) {
+    res = truncate_inode(&inode, inode_num, size);
+  }
+  end_replica_batch();
+  inode_unlock(inode_num);
+  return res;
+}
+
+int wfs_truncate(const char *path, off_t size) {
+  DEBUG_LOG("Entering wfs_truncate: path = %s, size = %lld\n", path,
+            (long long)size);
+
+  int inode_num = find_inode_for_path(path);
+  if (inode_num < 0) {
+    return inode_num;
+  }
+
+  int res = wfs_truncate_ino(inode_num, size);
+  DEBUG_LOG("truncate on %s returned %d\n", path, res);
+  return res;
+}
+
+int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  return wfs_truncate(path, size);
+}
+
+int wfs_open(const char *path, struct fuse_file_info *fi) {
+  DEBUG_LOG("Entering wfs_open: path = %s\n", path);
+
+  int inode_num = find_inode_for_path(path);
+  if (inode_num < 0) {
+    return inode_num;
+  }
+
+  // Keeps the inode cached, and its updates unwritten, until release.
+  inode_cache_hold(inode_num);
+  fi->fh = inode_num;
+  return 0;
+}
+
+int wfs_release(const char *path, struct fuse_file_info *fi) {
+  DEBUG_LOG("Entering wfs_release: path = %s, inode = %llu\n", path,
+            (unsigned long long)fi->fh);
+  inode_cache_release(fi->fh);
+  return 0;
+}
+
+int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  DEBUG_LOG("Entering wfs_fsync: path = %s\n", path);
+  (void)datasync;
+  (void)fi;
+
+  int inode_num = find_inode_for_path(path);
+  if (inode_num < 0) {
+    return inode_num;
+  }
+
+  inode_cache_flush(inode_num);
+  return 0;
+}
+
+static int unlink_from(int parent_inode_num, const char *name,
+                       const char *path) {
   struct wfs_inode parent_inode;
   read_inode(&parent_inode, parent_inode_num);
 
   if (!S_ISDIR(parent_inode.mode)) {
-    DEBUG_LOG("Parent is not a directory: %s\n", parent_path);
+    DEBUG_LOG("Parent is not a directory: inode %d\n", parent_inode_num);
     return -ENOTDIR;
   }
 
-  int inode_num = find_dentry_in_inode(parent_inode_num, file_name);
-  if (inode_num == -ENOENT) {
-    DEBUG_LOG("File not found in parent directory: %s\n", file_name);
-    return -ENOENT;
+  int inode_num = find_dentry_in_inode(parent_inode_num, name);
+  if (inode_num < 0) {
+    DEBUG_LOG("File not found in parent directory: %s\n", name);
+    return inode_num;
   }
 
+  // Waits out readers and writers of the file before its blocks go.
+  inode_write_lock(inode_num);
   struct wfs_inode file_inode;
   read_inode(&file_inode, inode_num);
 
   if (!S_ISREG(file_inode.mode)) {
-    DEBUG_LOG("Path is not a regular file: %s\n", path);
+    DEBUG_LOG("Not a regular file: %s\n", name);
+    inode_unlock(inode_num);
     return -EISDIR;
   }
 
-  free_inode(inode_num);
+  // Under the low-level API the kernel may still hold it; see node_refs.c.
+  if (!keep_unlinked_inode(inode_num)) {
+    free_inode(inode_num);
+  }
+  inode_unlock(inode_num);
 
-  if (remove_dentry_in_inode(&parent_inode, inode_num) < 0) {
-    DEBUG_LOG("Failed to remove file entry for %s\n", path);
+  if (remove_dentry_in_inode(&parent_inode, name, inode_num) < 0) {
+    DEBUG_LOG("Failed to remove file entry for %s\n", name);
     return -EIO;
   }
+  dcache_invalidate(parent_inode_num, name, path);
 
   write_inode(&parent_inode, parent_inode_num);
-
-  DEBUG_LOG("File successfully removed: %s\n", path);
   return 0;
 }
+
+/*
+ * Removes regular file name from parent_inode_num. path is the file's path
+ * when the caller has one, so its cached resolution can be dropped.
+ */
+int wfs_unlink_at(int parent_inode_num, const char *name, const char *path) {
+  inode_write_lock(parent_inode_num);
+  int res = unlink_from(parent_inode_num, name, path);
+  inode_unlock(parent_inode_num);
+  return res;
+}
+
+int wfs_unlink(const char *path) {
+  DEBUG_LOG("Entering wfs_unlink: path = %s\n", path);
+
+  char parent_path[PATH_MAX];
+  char file_name[MAX_NAME];
+
+  if (split_path(path, parent_path, file_name) < 0) {
+    DEBUG_LOG("Failed to split path: %s\n", path);
+    return -EINVAL;
+  }
+
+  DEBUG_LOG("Parent path: %s, File name: %s\n", parent_path, file_name);
+
+  int parent_inode_num = get_inode_index(parent_path);
+  if (parent_inode_num < 0) {
+    DEBUG_LOG("Parent directory not found: %s\n", parent_path);
+    return parent_inode_num;
+  }
+
+  int res = wfs_unlink_at(parent_inode_num, file_name, path);
+  if (res == 0) {
+    DEBUG_LOG("File successfully removed: %s\n", path);
+  }
+  return res;
+}
@@ -6,9 +6,28 @@
 #include <stddef.h>
 #include <sys/stat.h>
 
+int wfs_write_ino(int inode_num, struct fuse_bufvec *buf, off_t offset);
 int wfs_write(const char *path, const char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi);
+int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                  struct fuse_file_info *fi);
+int wfs_read_ino(int inode_num, char *buf, size_t size, off_t offset);
 int wfs_read(const char *path, char *buf, size_t size, off_t offset,
              struct fuse_file_info *fi);
+int wfs_map_read_buf_ino(int inode_num, struct fuse_bufvec **bufp,
+                         size_t size, off_t offset);
+void set_read_staging(int enabled);
+int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                 off_t offset, struct fuse_file_info *fi);
+int wfs_fallocate_ino(int inode_num, int mode, off_t offset, off_t length);
+int wfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                  struct fuse_file_info *fi);
+int wfs_truncate_ino(int inode_num, off_t size);
+int wfs_truncate(const char *path, off_t size);
+int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi);
+int wfs_open(const char *path, struct fuse_file_info *fi);
+int wfs_release(const char *path, struct fuse_file_info *fi);
+int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int wfs_unlink_at(int parent_inode_num, const char *name, const char *path);
 int wfs_unlink(const char *path);
 #endif
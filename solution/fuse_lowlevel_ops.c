@@ -0,0 +1,551 @@
+#define FUSE_USE_VERSION 30
+
+#include "fuse_lowlevel_ops.h"
+#include "fuse_dir_ops.h"
+#include "fuse_file_ops.h"
+#include "fuse_meta_ops.h"
+#include "globals.h"
+#include "inode.h"
+#include "inode_cache.h"
+#include "inode_lock.h"
+#include "node_refs.h"
+#include "wfs.h"
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+
+/*
+ * Backend for the low-level FUSE API. The kernel names files by node ID
+ * instead of by path, so no request walks the tree: lookup resolves one
+ * name in one directory and everything else starts from the inode it
+ * returned. The work itself is done by the same wfs_*_ino/_at functions
+ * the path-based operations use.
+ *
+ * FUSE reserves node ID 1 for the root, which is inode 0 here, so node IDs
+ * are inode numbers plus one. node_refs.c counts the lookups and opens the
+ * kernel holds, so an unlinked inode is not freed, and its number reused,
+ * until the kernel has forgotten it.
+ */
+#define TO_NODE_ID(inode_num) ((fuse_ino_t)(inode_num) + 1)
+#define TO_INODE_NUM(ino) ((int)((ino) - 1))
+
+// Every change goes through this process and the kernel drops what each
+// reply invalidates, so names and attributes can be cached for a while.
+#define ENTRY_TIMEOUT 60.0
+#define ATTR_TIMEOUT 60.0
+
+struct dir_listing {
+  char *buf;
+  size_t size;
+  size_t capacity;
+  fuse_req_t req;
+};
+
+/*
+ * Replies ESTALE to a request for a node ID that names no inode. The
+ * kernel should never send one, as we keep every inode it holds.
+ */
+static int check_node(fuse_req_t req, fuse_ino_t ino) {
+  if (inode_is_allocated(TO_INODE_NUM(ino))) {
+    return 0;
+  }
+  DEBUG_LOG("Request for stale node %lu", (unsigned long)ino);
+  fuse_reply_err(req, ESTALE);
+  return -1;
+}
+
+static int check_name(const char *name) {
+  return strlen(name) >= MAX_NAME ? -ENAMETOOLONG : 0;
+}
+
+static int fill_attr(int inode_num, struct stat *stbuf) {
+  int res = wfs_getattr_ino(inode_num, stbuf);
+  stbuf->st_ino = TO_NODE_ID(inode_num);
+  return res;
+}
+
+static void reply_entry(fuse_req_t req, int inode_num) {
+  struct fuse_entry_param entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.entry_timeout = ENTRY_TIMEOUT;
+  entry.attr_timeout = ATTR_TIMEOUT;
+
+  int res = inode_num;
+  if (res >= 0) {
+    res = fill_attr(inode_num, &entry.attr);
+    entry.ino = TO_NODE_ID(inode_num);
+    entry.generation = node_generation(inode_num);
+  } else if (res == -ENOENT) {
+    // A zero node ID is a negative entry: the kernel caches the miss.
+    res = 0;
+  }
+
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  /*
+   * The kernel holds the directory's lock across lookup and create, and
+   * unlink needs it too, so the inode cannot be unlinked before this count.
+   */
+  if (entry.ino != 0) {
+    node_ref_lookup(inode_num);
+  }
+  if (fuse_reply_entry(req, &entry) != 0 && entry.ino != 0) {
+    node_ref_forget(inode_num, 1);
+  }
+}
+
+static void reply_status(fuse_req_t req, int res) {
+  fuse_reply_err(req, res < 0 ? -res : 0);
+}
+
+static void wfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  (void)userdata;
+  wfs_init(conn);
+}
+
+static void wfs_ll_destroy(void *userdata) {
+  destroy_node_refs();
+  wfs_destroy(userdata);
+}
+
+static void wfs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                          const char *name) {
+  DEBUG_LOG("Entering wfs_ll_lookup: parent = %lu, name = %s",
+            (unsigned long)parent, name);
+
+  if (check_node(req, parent) < 0) {
+    return;
+  }
+  int res = check_name(name);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+
+  struct wfs_inode parent_inode;
+  int inode_num = -ENOTDIR;
+  inode_read_lock(TO_INODE_NUM(parent));
+  read_inode(&parent_inode, TO_INODE_NUM(parent));
+  if (S_ISDIR(parent_inode.mode)) {
+    inode_num = find_dentry_in_inode(TO_INODE_NUM(parent), name);
+  }
+  inode_unlock(TO_INODE_NUM(parent));
+
+  if (inode_num == -ENOTDIR) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  reply_entry(req, inode_num);
+}
+
+static void wfs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                          unsigned long nlookup) {
+  node_ref_forget(TO_INODE_NUM(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void wfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi) {
+  (void)fi;
+  if (check_node(req, ino) < 0) {
+    return;
+  }
+  struct stat stbuf;
+  int res = fill_attr(TO_INODE_NUM(ino), &stbuf);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
+}
+
+static void wfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                           int to_set, struct fuse_file_info *fi) {
+  (void)fi;
+  if (check_node(req, ino) < 0) {
+    return;
+  }
+  int inode_num = TO_INODE_NUM(ino);
+  DEBUG_LOG("Entering wfs_ll_setattr: inode = %d, to_set = %#x", inode_num,
+            to_set);
+
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    int res = wfs_truncate_ino(inode_num, attr->st_size);
+    if (res < 0) {
+      fuse_reply_err(req, -res);
+      return;
+    }
+  }
+
+  if (to_set & ~FUSE_SET_ATTR_SIZE) {
+    struct wfs_inode inode;
+    time_t now = time(NULL);
+
+    inode_write_lock(inode_num);
+    read_inode(&inode, inode_num);
+    if (to_set & FUSE_SET_ATTR_MODE) {
+      inode.mode = (inode.mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+    }
+    if (to_set & FUSE_SET_ATTR_UID) {
+      inode.uid = attr->st_uid;
+    }
+    if (to_set & FUSE_SET_ATTR_GID) {
+      inode.gid = attr->st_gid;
+    }
+    if (to_set & FUSE_SET_ATTR_ATIME) {
+      inode.atim = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? now : attr->st_atime;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME) {
+      inode.mtim = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? now : attr->st_mtime;
+    }
+    inode.ctim = now;
+    write_inode(&inode, inode_num);
+    inode_unlock(inode_num);
+  }
+
+  wfs_ll_getattr(req, ino, NULL);
+}
+
+static void wfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode, dev_t rdev) {
+  (void)rdev;
+  if (check_node(req, parent) < 0) {
+    return;
+  }
+  int res = check_name(name);
+  if (res == 0) {
+    res = wfs_mknod_at(TO_INODE_NUM(parent), name, mode, NULL);
+  }
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    reply_entry(req, res);
+  }
+}
+
+static void wfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode) {
+  if (check_node(req, parent) < 0) {
+    return;
+  }
+  int res = check_name(name);
+  if (res == 0) {
+    res = wfs_mkdir_at(TO_INODE_NUM(parent), name, mode, NULL);
+  }
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    reply_entry(req, res);
+  }
+}
+
+static void wfs_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                          const char *name) {
+  if (check_node(req, parent) < 0) {
+    return;
+  }
+  reply_status(req, wfs_unlink_at(TO_INODE_NUM(parent), name, NULL));
+}
+
+static void wfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  if (check_node(req, parent) < 0) {
+    return;
+  }
+  reply_status(req, wfs_rmdir_at(TO_INODE_NUM(parent), name, NULL));
+}
+
+static void wfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi) {
+  if (check_node(req, ino) < 0) {
+    return;
+  }
+  // Keeps the inode cached, and its updates unwritten, until release.
+  inode_cache_hold(TO_INODE_NUM(ino));
+  node_ref_open(TO_INODE_NUM(ino));
+  fi->fh = TO_INODE_NUM(ino);
+  fuse_reply_open(req, fi);
+}
+
+static void wfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi) {
+  (void)ino;
+  inode_cache_release(fi->fh);
+  node_ref_release(fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+static void wfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                         struct fuse_file_info *fi) {
+  (void)datasync;
+  (void)fi;
+  if (check_node(req, ino) < 0) {
+    return;
+  }
+  inode_cache_flush(TO_INODE_NUM(ino));
+  fuse_reply_err(req, 0);
+}
+
+static void free_bufvec(struct fuse_bufvec *bufvec) {
+  for (size_t i = 0; i < bufvec->count; i++) {
+    if (!(bufvec->buf[i].flags & FUSE_BUF_IS_FD)) {
+      free(bufvec->buf[i].mem);
+    }
+  }
+  free(bufvec);
+}
+
+static void wfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, struct fuse_file_info *fi) {
+  (void)fi;
+  if (check_node(req, ino) < 0) {
+    return;
+  }
+  int inode_num = TO_INODE_NUM(ino);
+  struct fuse_bufvec *bufvec;
+
+  // Held until the reply has copied out of the blocks the buffers point at.
+  inode_read_lock(inode_num);
+  int res = wfs_map_read_buf_ino(inode_num, &bufvec, size, off);
+  if (res < 0) {
+    inode_unlock(inode_num);
+    fuse_reply_err(req, -res);
+    return;
+  }
+  fuse_reply_data(req, bufvec, FUSE_BUF_SPLICE_MOVE);
+  inode_unlock(inode_num);
+  free_bufvec(bufvec);
+}
+
+static void reply_write(fuse_req_t req, int res) {
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_write(req, res);
+  }
+}
+
+static void wfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                         size_t size, off_t off, struct fuse_file_info *fi) {
+  (void)fi;
+  if (check_node(req, ino) < 0) {
+    return;
+  }
+  struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+  src.buf[0].mem = (void *)buf;
+  reply_write(req, wfs_write_ino(TO_INODE_NUM(ino), &src, off));
+}
+
+static void wfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_bufvec *bufv, off_t off,
+                             struct fuse_file_info *fi) {
+  (void)fi;
+  if (check_node(req, ino) < 0) {
+    return;
+  }
+  reply_write(req, wfs_write_ino(TO_INODE_NUM(ino), bufv, off));
+}
+
+static int add_listing_entry(struct dir_listing *listing, const char *name,
+                             int inode_num, mode_t mode) {
+  struct stat stbuf;
+  memset(&stbuf, 0, sizeof(stbuf));
+  stbuf.st_ino = TO_NODE_ID(inode_num);
+  stbuf.st_mode = mode & S_IFMT;
+
+  size_t len = fuse_add_direntry(listing->req, NULL, 0, name, NULL, 0);
+  if (listing->size + len > listing->capacity) {
+    size_t capacity = listing->capacity ? listing->capacity * 2 : BLOCK_SIZE;
+    while (capacity < listing->size + len) {
+      capacity *= 2;
+    }
+    char *buf = realloc(listing->buf, capacity);
+    if (!buf) {
+      return -ENOMEM;
+    }
+    listing->buf = buf;
+    listing->capacity = capacity;
+  }
+
+  fuse_add_direntry(listing->req, listing->buf + listing->size, len, name,
+                    &stbuf, listing->size + len);
+  listing->size += len;
+  return 0;
+}
+
+static int list_dentry(const struct wfs_dentry *entry, void *arg) {
+  char name[MAX_NAME + 1];
+  memcpy(name, entry->name, MAX_NAME);
+  name[MAX_NAME] = '\0';
+
+  // The file type saves the kernel a lookup for tools that only need it.
+  struct wfs_inode inode;
+  read_inode(&inode, entry->num);
+  return add_listing_entry(arg, name, entry->num, inode.mode);
+}
+
+/*
+ * The whole directory is listed once at opendir and readdir serves slices
+ * of that listing, so each entry's offset stays valid however the reads
+ * are split. The parent of a directory is not recorded, so ".." carries
+ * the directory's own node ID; the kernel resolves ".." itself.
+ */
+static void wfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi) {
+  if (check_node(req, ino) < 0) {
+    return;
+  }
+  int inode_num = TO_INODE_NUM(ino);
+  DEBUG_LOG("Entering wfs_ll_opendir: inode = %d", inode_num);
+
+  struct dir_listing *listing = calloc(1, sizeof(*listing));
+  if (!listing) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  listing->req = req;
+
+  struct wfs_inode dir_inode;
+  int res = -ENOTDIR;
+  inode_read_lock(inode_num);
+  read_inode(&dir_inode, inode_num);
+  if (S_ISDIR(dir_inode.mode)) {
+    res = add_listing_entry(listing, ".", inode_num, S_IFDIR);
+  }
+  if (res == 0) {
+    res = add_listing_entry(listing, "..", inode_num, S_IFDIR);
+  }
+  if (res == 0) {
+    res = for_each_dentry(&dir_inode, list_dentry, listing);
+  }
+  inode_unlock(inode_num);
+
+  if (res != 0) {
+    free(listing->buf);
+    free(listing);
+    fuse_reply_err(req, res < 0 ? -res : EIO);
+    return;
+  }
+
+  DEBUG_LOG("Listed directory %d into %zu bytes", inode_num, listing->size);
+  fi->fh = (uintptr_t)listing;
+  fuse_reply_open(req, fi);
+}
+
+static void wfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t off, struct fuse_file_info *fi) {
+  (void)ino;
+  const struct dir_listing *listing =
+      (const struct dir_listing *)(uintptr_t)fi->fh;
+
+  if ((size_t)off >= listing->size) {
+    fuse_reply_buf(req, NULL, 0);
+    return;
+  }
+  size_t len = listing->size - off < size ? listing->size - off : size;
+  fuse_reply_buf(req, listing->buf + off, len);
+}
+
+static void wfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_file_info *fi) {
+  (void)ino;
+  struct dir_listing *listing = (struct dir_listing *)(uintptr_t)fi->fh;
+  free(listing->buf);
+  free(listing);
+  fuse_reply_err(req, 0);
+}
+
+static void wfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  (void)ino;
+  struct statvfs stbuf;
+  wfs_statfs("/", &stbuf);
+  fuse_reply_statfs(req, &stbuf);
+}
+
+static void wfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                             off_t offset, off_t length,
+                             struct fuse_file_info *fi) {
+  (void)fi;
+  if (check_node(req, ino) < 0) {
+    return;
+  }
+  reply_status(req,
+               wfs_fallocate_ino(TO_INODE_NUM(ino), mode, offset, length));
+}
+
+static const struct fuse_lowlevel_ops ll_ops = {
+    .init = wfs_ll_init,
+    .destroy = wfs_ll_destroy,
+    .lookup = wfs_ll_lookup,
+    .forget = wfs_ll_forget,
+    .getattr = wfs_ll_getattr,
+    .setattr = wfs_ll_setattr,
+    .mknod = wfs_ll_mknod,
+    .mkdir = wfs_ll_mkdir,
+    .unlink = wfs_ll_unlink,
+    .rmdir = wfs_ll_rmdir,
+    .open = wfs_ll_open,
+    .read = wfs_ll_read,
+    .write = wfs_ll_write,
+    .release = wfs_ll_release,
+    .fsync = wfs_ll_fsync,
+    .opendir = wfs_ll_opendir,
+    .readdir = wfs_ll_readdir,
+    .releasedir = wfs_ll_releasedir,
+    .statfs = wfs_ll_statfs,
+    .write_buf = wfs_ll_write_buf,
+    .fallocate = wfs_ll_fallocate,
+};
+
+/*
+ * Mounts and serves the filesystem through the low-level API. Takes the
+ * same FUSE arguments as fuse_main().
+ */
+int wfs_lowlevel_main(int argc, char *argv[]) {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char *mount_point = NULL;
+  int multithreaded, foreground;
+  int err = -1;
+
+  if (fuse_parse_cmdline(&args, &mount_point, &multithreaded, &foreground) ==
+      -1) {
+    ERROR_LOG("Failed to parse FUSE arguments.");
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+  if (init_node_refs(sb.num_inodes) != 0) {
+    free(mount_point);
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+
+  struct fuse_chan *chan = fuse_mount(mount_point, &args);
+  if (chan) {
+    struct fuse_session *session =
+        fuse_lowlevel_new(&args, &ll_ops, sizeof(ll_ops), NULL);
+    if (session) {
+      if (fuse_set_signal_handlers(session) != -1) {
+        fuse_session_add_chan(session, chan);
+        fuse_daemonize(foreground);
+        err = multithreaded ? fuse_session_loop_mt(session)
+                            : fuse_session_loop(session);
+        fuse_remove_signal_handlers(session);
+        fuse_session_remove_chan(chan);
+      }
+      fuse_session_destroy(session);
+    }
+    fuse_unmount(mount_point, chan);
+  } else {
+    ERROR_LOG("Failed to mount %s.", mount_point);
+  }
+
+  free(mount_point);
+  fuse_opt_free_args(&args);
+  return err ? 1 : 0;
+}
@@ -0,0 +1,5 @@
+#ifndef FS_LOWLEVEL_OPS_H
+#define FS_LOWLEVEL_OPS_H
+
+int wfs_lowlevel_main(int argc, char *argv[]);
+#endif
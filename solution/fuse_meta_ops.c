@@ -1,16 +1,69 @@
 #define FUSE_USE_VERSION 30
 
 #include "data_block.h"
+#include "dcache.h"
+#include "free_space.h"
 #include "fs_utils.h"
 #include "fuse_common.h"
 #include "globals.h"
 #include "inode.h"
+#include "inode_cache.h"
+#include "inode_lock.h"
+#include "read_balance.h"
+#include "replication.h"
 #include "wfs.h"
 #include <errno.h>
 #include <fuse.h>
 #include <linux/limits.h>
+#include <string.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 
+static int make_file_in(int parent_inode_num, const char *name, mode_t mode,
+                        const char *path) {
+  struct wfs_inode parent_inode;
+  if (read_and_validate_parent_inode(&parent_inode, parent_inode_num) != 0) {
+    ERROR_LOG("Parent is not a valid directory: inode %d", parent_inode_num);
+    return -ENOTDIR;
+  }
+
+  if (check_duplicate_dentry(&parent_inode, name) == 0) {
+    DEBUG_LOG("File or directory already exists: %s", name);
+    return -EEXIST;
+  }
+
+  int inode_num = allocate_and_init_inode(mode, S_IFREG, parent_inode_num);
+  if (inode_num < 0) {
+    ERROR_LOG("Failed to allocate inode for file: %s", name);
+    return inode_num;
+  }
+
+  if (add_file_to_parent(&parent_inode, parent_inode_num, name, inode_num) !=
+      0) {
+    ERROR_LOG("Failed to add file entry: %s to parent: %d", name,
+              parent_inode_num);
+    return -EIO;
+  }
+  dcache_invalidate(parent_inode_num, name, path);
+
+  DEBUG_LOG("File created: %s in inode %d -> %d", name, parent_inode_num,
+            inode_num);
+  return inode_num;
+}
+
+/*
+ * Creates regular file name in parent_inode_num and returns its inode
+ * number. path is the new file's path when the caller has one, so its
+ * cached resolution can be dropped.
+ */
+int wfs_mknod_at(int parent_inode_num, const char *name, mode_t mode,
+                 const char *path) {
+  inode_write_lock(parent_inode_num);
+  int res = make_file_in(parent_inode_num, name, mode, path);
+  inode_unlock(parent_inode_num);
+  return res;
+}
+
 int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
   DEBUG_LOG("Entering wfs_mknod: path = %s", path);
 
@@ -20,36 +73,28 @@ int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
   DEBUG_LOG("Path split: parent = %s, filename = %s", parent_path, filename);
 
   int parent_inode_num = get_inode_index(parent_path);
-  if (parent_inode_num == -ENOENT) {
+  if (parent_inode_num < 0) {
     ERROR_LOG("Parent directory not found: %s", parent_path);
-    return -ENOENT;
-  }
-
-  struct wfs_inode parent_inode;
-  if (read_and_validate_parent_inode(&parent_inode, parent_inode_num) != 0) {
-    ERROR_LOG("Parent is not a valid directory: %s", parent_path);
-    return -ENOTDIR;
+    return parent_inode_num;
   }
 
-  if (check_duplicate_dentry(&parent_inode, filename) == 0) {
-    DEBUG_LOG("File or directory already exists: %s", path);
-    return -EEXIST;
+  int res = wfs_mknod_at(parent_inode_num, filename, mode, path);
+  if (res < 0) {
+    return res;
   }
 
-  int inode_num = allocate_and_init_inode(mode, S_IFREG);
-  if (inode_num < 0) {
-    ERROR_LOG("Failed to allocate inode for file: %s", path);
-    return inode_num;
-  }
+  DEBUG_LOG("File created successfully: %s", path);
+  return 0;
+}
 
-  if (add_file_to_parent(&parent_inode, parent_inode_num, filename,
-                         inode_num) != 0) {
-    ERROR_LOG("Failed to add file entry: %s to parent: %s", filename,
-              parent_path);
+int wfs_getattr_ino(int inode_num, struct stat *stbuf) {
+  // Only copies the inode out, so it does not wait for the inode lock.
+  struct wfs_inode inode;
+  if (load_inode(inode_num, &inode) != 0) {
     return -EIO;
   }
 
-  DEBUG_LOG("File created successfully: %s", path);
+  populate_stat_from_inode(&inode, stbuf);
   return 0;
 }
 
@@ -61,13 +106,72 @@ int wfs_getattr(const char *path, struct stat *stbuf) {
     return inode_num;
   }
 
-  struct wfs_inode inode;
-  if (load_inode(inode_num, &inode) != 0) {
-    return -EIO;
+  int res = wfs_getattr_ino(inode_num, stbuf);
+  if (res == 0) {
+    DEBUG_LOG("Attributes populated successfully for %s", path);
   }
+  return res;
+}
 
-  populate_stat_from_inode(&inode, stbuf);
-  DEBUG_LOG("Attributes populated successfully for %s", path);
+int wfs_statfs(const char *path, struct statvfs *stbuf) {
+  DEBUG_LOG("Entering wfs_statfs: path = %s", path);
+
+  size_t free_blocks, free_inodes;
+  get_free_counts(&free_blocks, &free_inodes);
+
+  memset(stbuf, 0, sizeof(*stbuf));
+  stbuf->f_bsize = BLOCK_SIZE;
+  stbuf->f_frsize = BLOCK_SIZE;
+  stbuf->f_blocks = sb.raid_mode == RAID_0
+                        ? sb.num_data_blocks * wfs_ctx.num_disks
+                        : sb.num_data_blocks;
+  stbuf->f_bfree = free_blocks;
+  stbuf->f_bavail = free_blocks;
+  stbuf->f_files = sb.num_inodes;
+  stbuf->f_ffree = free_inodes;
+  stbuf->f_favail = free_inodes;
+  stbuf->f_namemax = MAX_NAME - 1;
 
+  DEBUG_LOG("statfs: %zu of %lu blocks and %zu of %zu inodes free",
+            free_blocks, (unsigned long)stbuf->f_blocks, free_inodes,
+            sb.num_inodes);
   return 0;
 }
+
+void *wfs_init(struct fuse_conn_info *conn) {
+  DEBUG_LOG("Entering wfs_init: capable = 0x%x", conn->capable);
+
+  // wfs_read_buf hands out disk-image descriptors and wfs_write_buf copies
+  // whole blocks straight into the mappings; let FUSE splice both ways.
+  if (conn->capable & FUSE_CAP_SPLICE_READ) {
+    conn->want |= FUSE_CAP_SPLICE_READ;
+  }
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  }
+  if (conn->capable & FUSE_CAP_SPLICE_MOVE) {
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+  }
+
+  if (start_replication() != 0) {
+    ERROR_LOG("Replicating on the calling thread instead");
+  }
+  if (start_read_balance() != 0) {
+    ERROR_LOG("Reading RAID-1 data from the primary disk only");
+  }
+  if (start_inode_flusher() != 0) {
+    ERROR_LOG("Writing back inodes from the write path instead");
+  }
+
+  DEBUG_LOG("FUSE connection initialized: want = 0x%x", conn->want);
+  return NULL;
+}
+
+void wfs_destroy(void *private_data) {
+  DEBUG_LOG("Entering wfs_destroy: writing back cached inodes");
+  (void)private_data;
+  stop_inode_flusher();
+  inode_cache_flush_all();
+  stop_replication();
+  stop_read_balance();
+}
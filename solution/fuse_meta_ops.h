@@ -5,7 +5,14 @@
 #include <fuse.h>
 #include <stddef.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 
+int wfs_getattr_ino(int inode_num, struct stat *stbuf);
 int wfs_getattr(const char *path, struct stat *stbuf);
+int wfs_mknod_at(int parent_inode_num, const char *name, mode_t mode,
+                 const char *path);
 int wfs_mknod(const char *path, mode_t mode, dev_t dev);
+int wfs_statfs(const char *path, struct statvfs *stbuf);
+void *wfs_init(struct fuse_conn_info *conn);
+void wfs_destroy(void *private_data);
 #endif
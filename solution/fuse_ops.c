@@ -10,7 +10,18 @@ struct fuse_operations ops = {
     .mkdir = wfs_mkdir,
     .mknod = wfs_mknod,
     .write = wfs_write,
+    .write_buf = wfs_write_buf,
     .read = wfs_read,
+    .read_buf = wfs_read_buf,
     .rmdir = wfs_rmdir,
     .unlink = wfs_unlink,
+    .fallocate = wfs_fallocate,
+    .truncate = wfs_truncate,
+    .ftruncate = wfs_ftruncate,
+    .statfs = wfs_statfs,
+    .open = wfs_open,
+    .release = wfs_release,
+    .fsync = wfs_fsync,
+    .init = wfs_init,
+    .destroy = wfs_destroy,
 };
@@ -17,6 +17,8 @@
     DEBUG_LOG("  Inode Blocks Pointer: %ld\n", (sb).i_blocks_ptr);             \
     DEBUG_LOG("  Inode Bitmap Pointer: %ld\n", (sb).i_bitmap_ptr);             \
     DEBUG_LOG("  Data Bitmap Pointer: %ld\n", (sb).d_bitmap_ptr);              \
+    DEBUG_LOG("  Block Size: %u\n", (sb).block_size);                          \
+    DEBUG_LOG("  Inode Size: %u\n", (sb).inode_size);                          \
   } while (0)
 
 #define PRINT_BITMAP(title, bitmap)                                            \
@@ -30,11 +32,22 @@
     DEBUG_LOG("\n");                                                           \
   } while (0)
 
+// Size of every data block and inode slot, as recorded on disk by mkfs.
+#define BLOCK_SIZE ((size_t)sb.block_size)
+#define INODE_SIZE ((size_t)sb.inode_size)
+
+// Logical blocks of a file mapped straight from wfs_inode.blocks.
+#define DIRECT_BLOCKS                                                          \
+  ((size_t)((sb.features & WFS_FEATURE_MULTI_INDIRECT) ? DIND_BLOCK            \
+                                                       : IND_BLOCK))
+
 #define DENTRY_OFFSET(block, index)                                            \
   (sb.d_blocks_ptr + (block) * BLOCK_SIZE + (index) * sizeof(struct wfs_dentry))
 #define DATA_BLOCK_OFFSET(index) (sb.d_blocks_ptr + (index) * BLOCK_SIZE)
 #define DATA_BITMAP_OFFSET sb.d_bitmap_ptr
-#define INODE_OFFSET(index) (sb.i_blocks_ptr + (index) * BLOCK_SIZE)
+#define INODE_OFFSET(index) (sb.i_blocks_ptr + (index) * INODE_SIZE)
+#define INODE_INLINE_OFFSET(index)                                             \
+  (INODE_OFFSET(index) + sizeof(struct wfs_inode))
 #define INODE_BITMAP_OFFSET sb.i_bitmap_ptr
 
 extern int debug;
@@ -57,6 +70,7 @@ extern int debug;
 
 struct wfs_ctx {
   void **disk_mmaps;
+  int *disk_fds;
   int num_disks;
   size_t *disk_sizes;
 };
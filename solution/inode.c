@@ -1,5 +1,13 @@
 #include "data_block.h"
+#include "dcache.h"
+#include "dir_filter.h"
+#include "dir_index.h"
+#include "extent.h"
+#include "free_space.h"
 #include "globals.h"
+#include "inode.h"
+#include "inode_cache.h"
+#include "inode_lock.h"
 #include "raid.h"
 #include "wfs.h"
 #include <errno.h>
@@ -11,6 +19,9 @@
 #include <unistd.h>
 
 void read_inode(struct wfs_inode *inode, size_t inode_index) {
+  if (inode_cache_lookup(inode, inode_index)) {
+    return;
+  }
 
   int disk_index = 0;
 
@@ -19,9 +30,22 @@ void read_inode(struct wfs_inode *inode, size_t inode_index) {
 
   memcpy(inode, inode_offset, sizeof(struct wfs_inode));
   DEBUG_LOG("Read inode at index %zu from disk %d", inode_index, disk_index);
+  inode_cache_store(inode, inode_index, 0);
+  // Another thread may have cached a newer copy while this one was read.
+  inode_cache_lookup(inode, inode_index);
 }
 
+/*
+ * Updates the cached inode; it reaches the disks on write-back. See
+ * inode_cache.c.
+ */
 void write_inode(const struct wfs_inode *inode, size_t inode_index) {
+  if (!inode_cache_store(inode, inode_index, 1)) {
+    write_inode_to_disk(inode, inode_index);
+  }
+}
+
+void write_inode_to_disk(const struct wfs_inode *inode, size_t inode_index) {
 
   int disk_index = 0;
 
@@ -34,6 +58,117 @@ void write_inode(const struct wfs_inode *inode, size_t inode_index) {
   replicate(inode, offset, sizeof(struct wfs_inode), disk_index);
 }
 
+/*
+ * Bytes of the inode slot left over after struct wfs_inode. With the
+ * inline_data feature, small files and directories keep their contents
+ * there instead of in data blocks.
+ */
+size_t inline_data_capacity(void) {
+  if (!(sb.features & WFS_FEATURE_INLINE_DATA)) {
+    return 0;
+  }
+  return INODE_SIZE - sizeof(struct wfs_inode);
+}
+
+int inode_has_inline_data(const struct wfs_inode *inode) {
+  return (inode->flags & WFS_INODE_INLINE) != 0;
+}
+
+void *map_inline_data(size_t inode_index) {
+  return (char *)wfs_ctx.disk_mmaps[0] + INODE_INLINE_OFFSET(inode_index);
+}
+
+void write_inline_data(size_t inode_index, const void *data, size_t offset,
+                       size_t size) {
+  off_t inline_offset = INODE_INLINE_OFFSET(inode_index) + offset;
+
+  memcpy((char *)wfs_ctx.disk_mmaps[0] + inline_offset, data, size);
+  replicate(data, inline_offset, size, 0);
+  DEBUG_LOG("Wrote %zu inline bytes at offset %zu of inode %zu", size, offset,
+            inode_index);
+}
+
+/*
+ * Moves inline contents out to data block 0 once they no longer fit in the
+ * inode slot. Directories always get the block, since they are unpacked to
+ * make room for another entry.
+ */
+int unpack_inline_data(struct wfs_inode *inode) {
+  size_t used = S_ISDIR(inode->mode) ? inline_data_capacity() /
+                                           sizeof(struct wfs_dentry) *
+                                           sizeof(struct wfs_dentry)
+                                     : (size_t)inode->size;
+  off_t old_blocks[N_BLOCKS];
+  uint32_t old_flags = inode->flags;
+  int block_num = -1;
+
+  char *block_buffer = malloc(BLOCK_SIZE);
+  if (!block_buffer) {
+    return -ENOMEM;
+  }
+  memcpy(old_blocks, inode->blocks, sizeof(old_blocks));
+  memset(block_buffer, S_ISDIR(inode->mode) ? -1 : 0, BLOCK_SIZE);
+  memcpy(block_buffer, map_inline_data(inode->num), used);
+
+  inode->flags &= ~WFS_INODE_INLINE;
+  if (S_ISREG(inode->mode) && (sb.features & WFS_FEATURE_EXTENTS)) {
+    init_extent_root(inode);
+  }
+
+  if (S_ISDIR(inode->mode) || inode->size > 0) {
+    int res = allocate_block_range(inode, 0, 1, &block_num);
+    if (res < 0) {
+      memcpy(inode->blocks, old_blocks, sizeof(old_blocks));
+      inode->flags = old_flags;
+      free(block_buffer);
+      return res;
+    }
+    write_data_block(block_buffer, block_num);
+  }
+  free(block_buffer);
+
+  write_inode(inode, inode->num);
+  DEBUG_LOG("Moved inline contents of inode %d to block %d", inode->num,
+            block_num);
+  return 0;
+}
+
+/*
+ * Returns the entries of directory slot i in place, or NULL when the slot
+ * holds no dentry block. An inline directory has a single slot.
+ */
+const struct wfs_dentry *map_dentry_slot(const struct wfs_inode *dir, int i,
+                                         size_t *num_entries) {
+  if (inode_has_inline_data(dir)) {
+    if (i != 0) {
+      return NULL;
+    }
+    *num_entries = inline_data_capacity() / sizeof(struct wfs_dentry);
+    return map_inline_data(dir->num);
+  }
+
+  if (dir->blocks[i] == -1) {
+    return NULL;
+  }
+
+  int disk_index;
+  size_t block_index = get_raid_disk(dir->blocks[i], &disk_index);
+  *num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
+  return (struct wfs_dentry *)((char *)wfs_ctx.disk_mmaps[disk_index] +
+                               DATA_BLOCK_OFFSET(block_index));
+}
+
+void write_dentry_slot(const struct wfs_inode *dir, int i,
+                       const struct wfs_dentry *entries) {
+  if (inode_has_inline_data(dir)) {
+    size_t num_entries = inline_data_capacity() / sizeof(struct wfs_dentry);
+    write_inline_data(dir->num, entries, 0,
+                      num_entries * sizeof(struct wfs_dentry));
+  } else {
+    write_data_block(entries, dir->blocks[i]);
+  }
+}
+
 void read_inode_bitmap(char *inode_bitmap) {
 
   int disk_index =
@@ -61,56 +196,89 @@ void write_inode_bitmap(const char *inode_bitmap) {
   replicate(inode_bitmap, INODE_BITMAP_OFFSET, inode_bitmap_size, disk_index);
 }
 
-void clear_inode_bitmap(int inode_num) {
-  ERROR_LOG("Clearing inode bitmap for inode number: %d\n", inode_num);
-
-  char bitmap_block[BLOCK_SIZE];
-  read_inode_bitmap(bitmap_block);
-
-  PRINT_BITMAP("Bitmap before clearing:\n", bitmap_block);
-
-  CLEAR_BIT(bitmap_block, inode_num);
-
-  PRINT_BITMAP("Bitmap after clearing:\n", bitmap_block);
-
-  write_inode_bitmap(bitmap_block);
+/*
+ * Reports whether inode_num is in use. Callers that found the inode
+ * before taking its lock use this to notice it was freed meanwhile.
+ */
+int inode_is_allocated(int inode_num) {
+  if (inode_num < 0 || (size_t)inode_num >= sb.num_inodes) {
+    return 0;
+  }
+  const unsigned char *inode_bitmap =
+      (unsigned char *)wfs_ctx.disk_mmaps[0] + INODE_BITMAP_OFFSET;
+  unsigned char byte =
+      __atomic_load_n(&inode_bitmap[inode_num / 8], __ATOMIC_SEQ_CST);
+  return (byte >> (inode_num % 8)) & 1;
+}
 
-  ERROR_LOG("Inode bitmap cleared for inode number: %d\n", inode_num);
+void clear_inode_bitmap(int inode_num) {
+  release_inode(inode_num);
+  DEBUG_LOG("Inode bitmap cleared for inode number: %d\n", inode_num);
 }
 
 int free_inode(int inode_num) {
   struct wfs_inode inode;
   read_inode(&inode, inode_num);
+  drop_reservation(inode_num);
+  dir_filter_forget(inode_num);
+  inode_cache_forget(inode_num);
+
+  if (inode_has_inline_data(&inode)) {
+    clear_inode_bitmap(inode_num);
+    DEBUG_LOG("Inode %d successfully freed\n", inode_num);
+    return 0;
+  }
 
-  free_direct_data_blocks(&inode);
-  free_indirect_data_block(&inode);
+  int res = 0;
+  begin_free_batch();
+  if (inode_uses_extents(&inode)) {
+    res = free_extent_tree(&inode);
+  } else if (dir_is_hashed(&inode)) {
+    res = dir_index_free(&inode);
+  } else {
+    free_direct_data_blocks(&inode);
+    if (S_ISDIR(inode.mode)) {
+      // Directories use the indirect slots as more dentry blocks.
+      for (size_t i = DIRECT_BLOCKS; i < N_BLOCKS; i++) {
+        if (inode.blocks[i] != -1) {
+          free_data_block(inode.blocks[i]);
+          inode.blocks[i] = -1;
+        }
+      }
+    } else {
+      res = free_indirect_data_block(&inode);
+    }
+  }
+  end_free_batch();
+  if (res < 0) {
+    ERROR_LOG("Failed to free the blocks of inode %d", inode_num);
+    return res;
+  }
   clear_inode_bitmap(inode_num);
 
   DEBUG_LOG("Inode %d successfully freed\n", inode_num);
   return 0;
 }
 
-int allocate_free_inode() {
-  size_t inode_bitmap_size = (sb.num_inodes + 7) / 8;
-  char inode_bitmap[inode_bitmap_size];
-
-  read_inode_bitmap(inode_bitmap);
-
-  for (int i = 0; i < sb.num_inodes; i++) {
-    if (!IS_BIT_SET(inode_bitmap, i)) {
-      SET_BIT(inode_bitmap, i);
-      write_inode_bitmap(inode_bitmap);
-      DEBUG_LOG("Allocated inode %d", i);
-      return i;
-    }
+/*
+ * Allocates an inode close to its parent directory's; see
+ * claim_free_inode() for the placement policy.
+ */
+int allocate_free_inode(int parent_inode_num, int is_dir) {
+  int inode_num = claim_free_inode(parent_inode_num, is_dir);
+  if (inode_num < 0) {
+    DEBUG_LOG("No free inodes available");
+    return -ENOSPC;
   }
 
-  DEBUG_LOG("No free inodes available");
-  return -ENOSPC;
+  DEBUG_LOG("Allocated inode %d", inode_num);
+  return inode_num;
 }
 
-int allocate_and_init_inode(mode_t mode, mode_t type_flag) {
-  int inode_num = allocate_free_inode();
+int allocate_and_init_inode(mode_t mode, mode_t type_flag,
+                            int parent_inode_num) {
+  int inode_num =
+      allocate_free_inode(parent_inode_num, type_flag == S_IFDIR);
   if (inode_num < 0) {
     return inode_num;
   }
@@ -130,78 +298,112 @@ int allocate_and_init_inode(mode_t mode, mode_t type_flag) {
   for (int i = 0; i < N_BLOCKS; i++) {
     new_inode.blocks[i] = -1;
   }
+  if (inline_data_capacity() > 0 &&
+      (type_flag == S_IFREG || type_flag == S_IFDIR)) {
+    char *contents = malloc(inline_data_capacity());
+    if (!contents) {
+      clear_inode_bitmap(inode_num);
+      return -ENOMEM;
+    }
+
+    new_inode.flags |= WFS_INODE_INLINE;
+    memset(contents, type_flag == S_IFDIR ? -1 : 0, inline_data_capacity());
+    write_inline_data(inode_num, contents, 0, inline_data_capacity());
+    free(contents);
+  } else if (type_flag == S_IFREG && (sb.features & WFS_FEATURE_EXTENTS)) {
+    init_extent_root(&new_inode);
+  }
 
   write_inode(&new_inode, inode_num);
   DEBUG_LOG("Initialized inode %d with mode %o", inode_num, new_inode.mode);
   return inode_num;
 }
 
-int remove_dentry_in_inode(struct wfs_inode *parent_inode,
+int remove_dentry_in_inode(struct wfs_inode *parent_inode, const char *name,
                            int target_inode_num) {
-  char block_buffer[BLOCK_SIZE];
+  if (dir_is_hashed(parent_inode)) {
+    return dir_index_remove(parent_inode, name, target_inode_num) < 0 ? -1 : 0;
+  }
+
   for (int i = 0; i < N_BLOCKS; i++) {
-    if (parent_inode->blocks[i] == -1)
+    size_t num_entries;
+    const struct wfs_dentry *slot =
+        map_dentry_slot(parent_inode, i, &num_entries);
+    if (!slot)
       continue;
 
-    read_data_block(block_buffer, parent_inode->blocks[i]);
-    struct wfs_dentry *entries = (struct wfs_dentry *)block_buffer;
-
-    for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
-      if (entries[j].num == target_inode_num) {
-        entries[j].num = -1;
-        memset(entries[j].name, 0, sizeof(entries[j].name));
+    for (int j = 0; j < num_entries; j++) {
+      if (slot[j].num != target_inode_num) {
+        continue;
+      }
 
-        write_data_block(block_buffer, parent_inode->blocks[i]);
-        return 0;
+      // Only the slot holding the entry is copied out and written back.
+      size_t slot_size = num_entries * sizeof(struct wfs_dentry);
+      struct wfs_dentry *entries = malloc(slot_size);
+      if (!entries) {
+        return -ENOMEM;
       }
+      memcpy(entries, slot, slot_size);
+      entries[j].num = -1;
+      memset(entries[j].name, 0, sizeof(entries[j].name));
+
+      write_dentry_slot(parent_inode, i, entries);
+      free(entries);
+      dir_note_free_slot(parent_inode->num, i);
+      return 0;
     }
   }
 
   return -1;
 }
 
-int is_directory_empty(struct wfs_inode *inode) {
-  char block_buffer[BLOCK_SIZE];
-  for (int i = 0; i < N_BLOCKS; i++) {
-    if (inode->blocks[i] == -1)
-      continue;
-
-    read_data_block(block_buffer, inode->blocks[i]);
-    struct wfs_dentry *entries = (struct wfs_dentry *)block_buffer;
+/*
+ * Calls fn on every live dentry of dir, in storage order, stopping early
+ * when fn returns non-zero. Returns the last value fn returned, or a
+ * negative errno if the directory could not be read.
+ */
+int for_each_dentry(const struct wfs_inode *dir,
+                    int (*fn)(const struct wfs_dentry *, void *), void *arg) {
+  if (dir_is_hashed(dir)) {
+    return dir_index_for_each(dir, fn, arg);
+  }
 
-    for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
-      if (entries[j].num != -1 && strcmp(entries[j].name, ".") != 0 &&
-          strcmp(entries[j].name, "..") != 0) {
-        return 0;
+  for (int i = 0; i < N_BLOCKS; i++) {
+    size_t num_entries;
+    const struct wfs_dentry *entries = map_dentry_slot(dir, i, &num_entries);
+    for (size_t j = 0; entries && j < num_entries; j++) {
+      if (entries[j].num == -1) {
+        continue;
+      }
+      int res = fn(&entries[j], arg);
+      if (res != 0) {
+        return res;
       }
     }
   }
-  return 1;
+  return 0;
 }
 
-int find_dentry_in_inode(int parent_inode_num, const char *name) {
-  DEBUG_LOG("Finding dentry in inode %d with name %s", parent_inode_num, name);
+static int is_real_dentry(const struct wfs_dentry *entry, void *arg) {
+  (void)arg;
+  return strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0;
+}
 
-  struct wfs_inode parent_inode;
-  read_inode(&parent_inode, parent_inode_num);
+int is_directory_empty(struct wfs_inode *inode) {
+  return for_each_dentry(inode, is_real_dentry, NULL) == 0;
+}
 
+static int scan_dentries(const struct wfs_inode *dir, const char *name) {
   for (int i = 0; i < N_BLOCKS; i++) {
-    if (parent_inode.blocks[i] == -1) {
+    size_t num_entries;
+    const struct wfs_dentry *entries = map_dentry_slot(dir, i, &num_entries);
+    if (!entries) {
       continue;
     }
 
-    size_t block_index = parent_inode.blocks[i];
-
-    int disk_index;
-    block_index = get_raid_disk(block_index, &disk_index);
-
-    size_t num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
     for (size_t j = 0; j < num_entries; j++) {
       struct wfs_dentry entry;
-      off_t offset = DENTRY_OFFSET(block_index, j);
-
-      memcpy(&entry, (char *)wfs_ctx.disk_mmaps[disk_index] + offset,
-             sizeof(struct wfs_dentry));
+      memcpy(&entry, &entries[j], sizeof(struct wfs_dentry));
       if (entry.num == -1) {
         continue;
       }
@@ -213,33 +415,94 @@ int find_dentry_in_inode(int parent_inode_num, const char *name) {
     }
   }
 
-  DEBUG_LOG("Dentry not found: name = %s", name);
   return -ENOENT;
 }
 
+/*
+ * Looks name up in a directory, through the dentry cache. *cacheable is
+ * cleared when the parent is not a directory: the "dentries" found in a
+ * file's data change whenever the file is written, so that answer is
+ * neither cached here nor by whoever resolved the path. Errors other than
+ * -ENOENT are not cached either.
+ */
+static int lookup_dentry(int parent_inode_num, const char *name,
+                         int *cacheable) {
+  int inode_num;
+  if (dcache_lookup(parent_inode_num, name, &inode_num)) {
+    DEBUG_LOG("Dentry cache hit: %s in inode %d -> %d", name, parent_inode_num,
+              inode_num);
+    return inode_num;
+  }
+
+  DEBUG_LOG("Finding dentry in inode %d with name %s", parent_inode_num, name);
+
+  struct wfs_inode parent_inode;
+  read_inode(&parent_inode, parent_inode_num);
+  if (S_ISDIR(parent_inode.mode) && !dir_may_contain(&parent_inode, name)) {
+    inode_num = -ENOENT;
+  } else if (dir_is_hashed(&parent_inode)) {
+    inode_num = dir_index_lookup(&parent_inode, name);
+  } else {
+    inode_num = scan_dentries(&parent_inode, name);
+  }
+
+  if (S_ISDIR(parent_inode.mode) &&
+      (inode_num >= 0 || inode_num == -ENOENT)) {
+    dcache_insert(parent_inode_num, name, inode_num);
+  } else {
+    *cacheable = 0;
+  }
+
+  if (inode_num < 0) {
+    DEBUG_LOG("Dentry not found: name = %s", name);
+  }
+  return inode_num;
+}
+
+int find_dentry_in_inode(int parent_inode_num, const char *name) {
+  int cacheable = 1;
+  return lookup_dentry(parent_inode_num, name, &cacheable);
+}
+
 int get_inode_index(const char *path) {
   if (strcmp(path, "/") == 0) {
     return 0;
   }
 
+  int result;
+  if (path_cache_lookup(path, &result)) {
+    DEBUG_LOG("Path cache hit: %s -> %d", path, result);
+    return result;
+  }
+
+  unsigned long generation = path_cache_generation();
   char *path_copy = strdup(path);
-  char *component = strtok(path_copy, "/");
+  char *saveptr;
+  char *component = strtok_r(path_copy, "/", &saveptr);
   int parent_inode_num = 0;
-  int result = 0;
+  int cacheable = 1;
 
   while (component != NULL) {
-    result = find_dentry_in_inode(parent_inode_num, component);
+    inode_read_lock(parent_inode_num);
+    result = lookup_dentry(parent_inode_num, component, &cacheable);
+    inode_unlock(parent_inode_num);
     if (result < 0) {
       free(path_copy);
       DEBUG_LOG("Failed to resolve component %s in path %s", component, path);
+      if (cacheable) {
+        path_cache_insert(path, result, generation);
+      }
       return result;
     }
 
     parent_inode_num = result;
-    component = strtok(NULL, "/");
+    component = strtok_r(NULL, "/", &saveptr);
   }
 
   free(path_copy);
+  if (cacheable) {
+    path_cache_insert(path, parent_inode_num, generation);
+  }
   DEBUG_LOG("Resolved path %s to inode %d", path, parent_inode_num);
   return parent_inode_num;
 }
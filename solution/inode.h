@@ -7,15 +7,30 @@
 
 void read_inode(struct wfs_inode *inode, size_t inode_index);
 void write_inode(const struct wfs_inode *inode, size_t inode_index);
+void write_inode_to_disk(const struct wfs_inode *inode, size_t inode_index);
 void read_inode_bitmap(char *inode_bitmap);
 void write_inode_bitmap(const char *inode_bitmap);
-int allocate_free_inode();
+int allocate_free_inode(int parent_inode_num, int is_dir);
 int find_dentry_in_inode(int parent_inode_num, const char *name);
 int get_inode_index(const char *path);
-int allocate_and_init_inode(mode_t mode, mode_t type_flag);
+int allocate_and_init_inode(mode_t mode, mode_t type_flag,
+                            int parent_inode_num);
 int free_inode(int inode_num);
 int is_directory_empty(struct wfs_inode *inode);
-int remove_dentry_in_inode(struct wfs_inode *parent_inode,
+int for_each_dentry(const struct wfs_inode *dir,
+                    int (*fn)(const struct wfs_dentry *, void *), void *arg);
+int remove_dentry_in_inode(struct wfs_inode *parent_inode, const char *name,
                            int target_inode_num);
 void clear_inode_bitmap(int inode_num);
+int inode_is_allocated(int inode_num);
+size_t inline_data_capacity(void);
+int inode_has_inline_data(const struct wfs_inode *inode);
+void *map_inline_data(size_t inode_index);
+void write_inline_data(size_t inode_index, const void *data, size_t offset,
+                       size_t size);
+int unpack_inline_data(struct wfs_inode *inode);
+const struct wfs_dentry *map_dentry_slot(const struct wfs_inode *dir, int i,
+                                         size_t *num_entries);
+void write_dentry_slot(const struct wfs_inode *dir, int i,
+                       const struct wfs_dentry *entries);
 #endif
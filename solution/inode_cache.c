@@ -0,0 +1,273 @@
+#include "inode_cache.h"
+#include "globals.h"
+#include "inode.h"
+#include "wfs.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#define INODE_CACHE_SLOTS 1024
+// Dirty inodes are written back at the latest this long after first dirtied.
+#define INODE_WRITEBACK_SECONDS 5
+
+/*
+ * Write-back cache of inodes. write_inode() only updates the cached copy;
+ * the inode reaches disk 0 and its replicas when the file is synced or
+ * released, when its slot is needed for another inode, or at unmount.
+ * Open files hold a reference that keeps their inode from being evicted.
+ *
+ * A flusher thread writes every dirty inode back once the oldest of them
+ * has waited INODE_WRITEBACK_SECONDS, so an idle mount does not hold
+ * changes in memory. If it cannot be started, the write path checks the
+ * deadline instead.
+ *
+ * Slots are direct-mapped by inode number. An inode whose slot is held by
+ * another, referenced inode bypasses the cache.
+ *
+ * inode_cache.lock guards the slots, the dirty counters and the flusher
+ * state. It is held across write-back but never across read_inode(),
+ * which re-enters the cache.
+ */
+struct cached_inode {
+  int in_use;
+  int dirty;
+  int refs;
+  size_t inode_num;
+  struct wfs_inode inode;
+};
+
+static struct {
+  struct cached_inode slots[INODE_CACHE_SLOTS];
+  size_t num_dirty;
+  time_t oldest_dirty;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; /* signalled when the first inode turns dirty */
+  pthread_t flusher;
+  int flusher_running;
+  int stop;
+} inode_cache = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                 .wake = PTHREAD_COND_INITIALIZER};
+
+static struct cached_inode *cache_slot(size_t inode_num) {
+  return &inode_cache.slots[inode_num % INODE_CACHE_SLOTS];
+}
+
+static struct cached_inode *find_cached(size_t inode_num) {
+  struct cached_inode *entry = cache_slot(inode_num);
+  if (!entry->in_use || entry->inode_num != inode_num) {
+    return NULL;
+  }
+  return entry;
+}
+
+static void write_back(struct cached_inode *entry) {
+  if (!entry->dirty) {
+    return;
+  }
+  write_inode_to_disk(&entry->inode, entry->inode_num);
+  entry->dirty = 0;
+  inode_cache.num_dirty--;
+  DEBUG_LOG("Wrote back inode %zu", entry->inode_num);
+}
+
+/*
+ * Returns the slot for inode_num, evicting whatever unreferenced inode
+ * holds it, or NULL when a referenced inode does.
+ */
+static struct cached_inode *claim_slot(size_t inode_num) {
+  struct cached_inode *entry = cache_slot(inode_num);
+  if (entry->in_use && entry->inode_num != inode_num) {
+    if (entry->refs > 0) {
+      return NULL;
+    }
+    write_back(entry);
+    entry->in_use = 0;
+  }
+  return entry;
+}
+
+static void flush_all_locked(void) {
+  for (size_t i = 0; i < INODE_CACHE_SLOTS && inode_cache.num_dirty > 0;
+       i++) {
+    if (inode_cache.slots[i].in_use) {
+      write_back(&inode_cache.slots[i]);
+    }
+  }
+}
+
+static void flush_if_due_locked(void) {
+  if (inode_cache.num_dirty > 0 &&
+      time(NULL) - inode_cache.oldest_dirty >= INODE_WRITEBACK_SECONDS) {
+    flush_all_locked();
+  }
+}
+
+static void *flusher_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&inode_cache.lock);
+  while (!inode_cache.stop) {
+    if (inode_cache.num_dirty == 0) {
+      pthread_cond_wait(&inode_cache.wake, &inode_cache.lock);
+      continue;
+    }
+
+    struct timespec deadline = {
+        .tv_sec = inode_cache.oldest_dirty + INODE_WRITEBACK_SECONDS,
+    };
+    if (pthread_cond_timedwait(&inode_cache.wake, &inode_cache.lock,
+                               &deadline) == ETIMEDOUT) {
+      flush_if_due_locked();
+    }
+  }
+  pthread_mutex_unlock(&inode_cache.lock);
+  return NULL;
+}
+
+/*
+ * Starts the flusher. Called from the FUSE init callback, after FUSE has
+ * daemonized, since threads do not survive the fork.
+ */
+int start_inode_flusher(void) {
+  pthread_mutex_lock(&inode_cache.lock);
+  int res = 0;
+  if (!inode_cache.flusher_running) {
+    inode_cache.stop = 0;
+    res = pthread_create(&inode_cache.flusher, NULL, flusher_main, NULL);
+    inode_cache.flusher_running = res == 0;
+  }
+  pthread_mutex_unlock(&inode_cache.lock);
+
+  if (res != 0) {
+    ERROR_LOG("Failed to start the inode flusher");
+    return -res;
+  }
+  DEBUG_LOG("Started the inode flusher");
+  return 0;
+}
+
+void stop_inode_flusher(void) {
+  pthread_mutex_lock(&inode_cache.lock);
+  int running = inode_cache.flusher_running;
+  inode_cache.flusher_running = 0;
+  inode_cache.stop = 1;
+  pthread_cond_signal(&inode_cache.wake);
+  pthread_mutex_unlock(&inode_cache.lock);
+
+  if (running) {
+    pthread_join(inode_cache.flusher, NULL);
+    DEBUG_LOG("Stopped the inode flusher");
+  }
+}
+
+int inode_cache_lookup(struct wfs_inode *inode, size_t inode_num) {
+  pthread_mutex_lock(&inode_cache.lock);
+  const struct cached_inode *entry = find_cached(inode_num);
+  if (entry) {
+    memcpy(inode, &entry->inode, sizeof(struct wfs_inode));
+  }
+  pthread_mutex_unlock(&inode_cache.lock);
+  return entry != NULL;
+}
+
+int inode_cache_store(const struct wfs_inode *inode, size_t inode_num,
+                      int dirty) {
+  pthread_mutex_lock(&inode_cache.lock);
+  struct cached_inode *entry = claim_slot(inode_num);
+  if (!entry) {
+    pthread_mutex_unlock(&inode_cache.lock);
+    return 0;
+  }
+
+  if (!entry->in_use) {
+    entry->in_use = 1;
+    entry->dirty = 0;
+    entry->refs = 0;
+    entry->inode_num = inode_num;
+  } else if (!dirty) {
+    // A clean copy was read from disk without the lock, so a copy cached
+    // in the meantime is at least as new and must not be overwritten.
+    pthread_mutex_unlock(&inode_cache.lock);
+    return 1;
+  }
+  memcpy(&entry->inode, inode, sizeof(struct wfs_inode));
+
+  if (dirty && !entry->dirty) {
+    if (inode_cache.num_dirty++ == 0) {
+      inode_cache.oldest_dirty = time(NULL);
+      pthread_cond_signal(&inode_cache.wake);
+    }
+    entry->dirty = 1;
+  }
+
+  if (!inode_cache.flusher_running) {
+    flush_if_due_locked();
+  }
+  pthread_mutex_unlock(&inode_cache.lock);
+  return 1;
+}
+
+void inode_cache_hold(size_t inode_num) {
+  pthread_mutex_lock(&inode_cache.lock);
+  struct cached_inode *entry = find_cached(inode_num);
+  if (!entry) {
+    pthread_mutex_unlock(&inode_cache.lock);
+    struct wfs_inode inode;
+    read_inode(&inode, inode_num);
+    pthread_mutex_lock(&inode_cache.lock);
+    entry = find_cached(inode_num);
+  }
+  if (entry) {
+    entry->refs++;
+  }
+  pthread_mutex_unlock(&inode_cache.lock);
+}
+
+void inode_cache_release(size_t inode_num) {
+  pthread_mutex_lock(&inode_cache.lock);
+  struct cached_inode *entry = find_cached(inode_num);
+  if (entry) {
+    write_back(entry);
+    if (entry->refs > 0) {
+      entry->refs--;
+    }
+  }
+  pthread_mutex_unlock(&inode_cache.lock);
+}
+
+void inode_cache_flush(size_t inode_num) {
+  pthread_mutex_lock(&inode_cache.lock);
+  struct cached_inode *entry = find_cached(inode_num);
+  if (entry) {
+    write_back(entry);
+  }
+  pthread_mutex_unlock(&inode_cache.lock);
+}
+
+void inode_cache_flush_all(void) {
+  pthread_mutex_lock(&inode_cache.lock);
+  flush_all_locked();
+  pthread_mutex_unlock(&inode_cache.lock);
+}
+
+/*
+ * Called when an inode is freed. Its last state is still written back so
+ * the image never holds a stale copy, then the slot is released.
+ */
+void inode_cache_forget(size_t inode_num) {
+  pthread_mutex_lock(&inode_cache.lock);
+  struct cached_inode *entry = find_cached(inode_num);
+  if (entry) {
+    write_back(entry);
+    entry->in_use = 0;
+  }
+  pthread_mutex_unlock(&inode_cache.lock);
+}
+
+void destroy_inode_cache(void) {
+  pthread_mutex_lock(&inode_cache.lock);
+  flush_all_locked();
+  memset(inode_cache.slots, 0, sizeof(inode_cache.slots));
+  inode_cache.num_dirty = 0;
+  pthread_mutex_unlock(&inode_cache.lock);
+}
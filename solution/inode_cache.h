@@ -0,0 +1,18 @@
+#ifndef INODE_CACHE_H
+#define INODE_CACHE_H
+
+#include "wfs.h"
+#include <stddef.h>
+
+int inode_cache_lookup(struct wfs_inode *inode, size_t inode_num);
+int inode_cache_store(const struct wfs_inode *inode, size_t inode_num,
+                      int dirty);
+void inode_cache_hold(size_t inode_num);
+void inode_cache_release(size_t inode_num);
+void inode_cache_flush(size_t inode_num);
+void inode_cache_flush_all(void);
+void inode_cache_forget(size_t inode_num);
+int start_inode_flusher(void);
+void stop_inode_flusher(void);
+void destroy_inode_cache(void);
+#endif
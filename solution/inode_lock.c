@@ -0,0 +1,55 @@
+#include "inode_lock.h"
+#include "globals.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * One reader/writer lock per inode, taken by the operation entry points
+ * only. Reading a file's data or a directory's entries shares the lock;
+ * changing them, or the inode itself, holds it exclusively.
+ *
+ * Ordering: a directory is locked before an inode inside it, and nothing
+ * holds a child while waiting for its parent, so the locks are always
+ * acquired top-down. Path resolution holds one directory at a time.
+ * Inodes with no such relation would be locked in ascending number order.
+ * The caches and allocators below have mutexes of their own, which are
+ * always innermost and never held while waiting for an inode lock.
+ */
+static pthread_rwlock_t *inode_locks;
+static size_t num_inode_locks;
+
+int init_inode_locks(size_t num_inodes) {
+  inode_locks = malloc(num_inodes * sizeof(pthread_rwlock_t));
+  if (!inode_locks) {
+    ERROR_LOG("Memory allocation failed for inode locks");
+    return -ENOMEM;
+  }
+
+  for (size_t i = 0; i < num_inodes; i++) {
+    pthread_rwlock_init(&inode_locks[i], NULL);
+  }
+  num_inode_locks = num_inodes;
+  return 0;
+}
+
+void destroy_inode_locks(void) {
+  for (size_t i = 0; i < num_inode_locks; i++) {
+    pthread_rwlock_destroy(&inode_locks[i]);
+  }
+  free(inode_locks);
+  inode_locks = NULL;
+  num_inode_locks = 0;
+}
+
+void inode_read_lock(int inode_num) {
+  pthread_rwlock_rdlock(&inode_locks[inode_num]);
+}
+
+void inode_write_lock(int inode_num) {
+  pthread_rwlock_wrlock(&inode_locks[inode_num]);
+}
+
+void inode_unlock(int inode_num) {
+  pthread_rwlock_unlock(&inode_locks[inode_num]);
+}
@@ -0,0 +1,11 @@
+#ifndef INODE_LOCK_H
+#define INODE_LOCK_H
+
+#include <stddef.h>
+
+int init_inode_locks(size_t num_inodes);
+void destroy_inode_locks(void);
+void inode_read_lock(int inode_num);
+void inode_write_lock(int inode_num);
+void inode_unlock(int inode_num);
+#endif
@@ -9,6 +9,10 @@
 
 int main(int argc, char *argv[]) {
   int raid_mode = -1, inode_count = 0, data_block_count = 0;
+  uint32_t features = 0;
+  size_t block_size = DEFAULT_BLOCK_SIZE;
+  const char *inode_size_arg = NULL;
+  size_t inode_size;
   char **disk_files = NULL;
   int disk_count = 0;
 
@@ -46,6 +50,36 @@ int main(int argc, char *argv[]) {
         free(disk_files);
         return 1;
       }
+    } else if (strcmp(argv[i], "-f") == 0) {
+      if (i + 1 < argc) {
+        if (parse_feature(argv[++i], &features) != 0) {
+          free(disk_files);
+          return 1;
+        }
+      } else {
+        ERROR_LOG("Missing argument for -f (feature)\n");
+        free(disk_files);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-B") == 0) {
+      if (i + 1 < argc) {
+        if (parse_block_size(argv[++i], &block_size) != 0) {
+          free(disk_files);
+          return 1;
+        }
+      } else {
+        ERROR_LOG("Missing argument for -B (block size)\n");
+        free(disk_files);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-I") == 0) {
+      if (i + 1 < argc) {
+        inode_size_arg = argv[++i];
+      } else {
+        ERROR_LOG("Missing argument for -I (inode size)\n");
+        free(disk_files);
+        return 1;
+      }
     } else if (strcmp(argv[i], "-i") == 0) {
       if (i + 1 < argc) {
         inode_count = atoi(argv[++i]);
@@ -79,14 +113,25 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  // Checked after the loop since it depends on the block size (-B).
+  inode_size = block_size;
+  if (inode_size_arg &&
+      parse_inode_size(inode_size_arg, block_size, &inode_size) != 0) {
+    free(disk_files);
+    return 1;
+  }
+
   data_block_count = (data_block_count + 31) & ~31;
   inode_count = (inode_count + 31) & ~31;
 
-  size_t required_size = calculate_required_size(inode_count, data_block_count);
+  size_t required_size =
+      calculate_required_size(inode_count, data_block_count, block_size,
+                              inode_size, features);
 
   for (int i = 0; i < disk_count; i++) {
     if (initialize_disk(disk_files[i], inode_count, data_block_count,
-                        required_size, raid_mode, i, disk_count) != 0) {
+                        required_size, raid_mode, i, disk_count,
+                        features, block_size, inode_size) != 0) {
       ERROR_LOG("Failed to initialize disk: %s\n", disk_files[i]);
       return -1;
     }
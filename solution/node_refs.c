@@ -0,0 +1,172 @@
+#include "node_refs.h"
+#include "globals.h"
+#include "inode.h"
+#include "inode_lock.h"
+#include "wfs.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * Counts the references the kernel holds to each inode under the
+ * low-level API: one per entry reply, dropped by forget, and one per open,
+ * dropped by release. An inode unlinked while it still has references
+ * stays allocated as an orphan, with no name and no links, and is freed
+ * when the last of them goes. Until then its number cannot be reused, so
+ * a node ID the kernel holds never names another file.
+ *
+ * Each inode number also gets a new generation whenever it is freed. Node
+ * IDs only live as long as the mount, so the generations are not stored.
+ *
+ * Path-based mounts never call init_node_refs() and free inodes at unlink
+ * as before. node_refs.lock is innermost, like the cache locks, and is
+ * never held while waiting for an inode lock.
+ */
+struct node_ref {
+  unsigned long lookups;
+  unsigned long opens;
+  int orphan;
+  unsigned long generation;
+};
+
+static struct {
+  struct node_ref *nodes;
+  size_t num_nodes;
+  pthread_mutex_t lock;
+} node_refs = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+int init_node_refs(size_t num_inodes) {
+  node_refs.nodes = calloc(num_inodes, sizeof(struct node_ref));
+  if (!node_refs.nodes) {
+    ERROR_LOG("Memory allocation failed for node references");
+    return -ENOMEM;
+  }
+  node_refs.num_nodes = num_inodes;
+  return 0;
+}
+
+static struct node_ref *find_node(int inode_num) {
+  if (!node_refs.nodes || inode_num < 0 ||
+      (size_t)inode_num >= node_refs.num_nodes) {
+    return NULL;
+  }
+  return &node_refs.nodes[inode_num];
+}
+
+static void free_orphan(int inode_num) {
+  inode_write_lock(inode_num);
+  free_inode(inode_num);
+  inode_unlock(inode_num);
+  DEBUG_LOG("Freed orphan inode %d", inode_num);
+}
+
+// Returns 1 when node is an orphan nothing references any more.
+static int take_orphan(struct node_ref *node) {
+  if (!node->orphan || node->lookups > 0 || node->opens > 0) {
+    return 0;
+  }
+  node->orphan = 0;
+  node->generation++;
+  return 1;
+}
+
+/*
+ * Frees the orphans the kernel never forgot. Their node IDs die with the
+ * mount, so this runs at unmount.
+ */
+void destroy_node_refs(void) {
+  for (size_t i = 0; i < node_refs.num_nodes; i++) {
+    if (node_refs.nodes[i].orphan) {
+      node_refs.nodes[i].orphan = 0;
+      free_orphan(i);
+    }
+  }
+  free(node_refs.nodes);
+  node_refs.nodes = NULL;
+  node_refs.num_nodes = 0;
+}
+
+void node_ref_lookup(int inode_num) {
+  pthread_mutex_lock(&node_refs.lock);
+  struct node_ref *node = find_node(inode_num);
+  if (node) {
+    node->lookups++;
+  }
+  pthread_mutex_unlock(&node_refs.lock);
+}
+
+void node_ref_forget(int inode_num, unsigned long nlookup) {
+  pthread_mutex_lock(&node_refs.lock);
+  struct node_ref *node = find_node(inode_num);
+  int orphan_gone = 0;
+  if (node) {
+    node->lookups -= nlookup < node->lookups ? nlookup : node->lookups;
+    orphan_gone = take_orphan(node);
+  }
+  pthread_mutex_unlock(&node_refs.lock);
+
+  if (orphan_gone) {
+    free_orphan(inode_num);
+  }
+}
+
+void node_ref_open(int inode_num) {
+  pthread_mutex_lock(&node_refs.lock);
+  struct node_ref *node = find_node(inode_num);
+  if (node) {
+    node->opens++;
+  }
+  pthread_mutex_unlock(&node_refs.lock);
+}
+
+void node_ref_release(int inode_num) {
+  pthread_mutex_lock(&node_refs.lock);
+  struct node_ref *node = find_node(inode_num);
+  int orphan_gone = 0;
+  if (node) {
+    if (node->opens > 0) {
+      node->opens--;
+    }
+    orphan_gone = take_orphan(node);
+  }
+  pthread_mutex_unlock(&node_refs.lock);
+
+  if (orphan_gone) {
+    free_orphan(inode_num);
+  }
+}
+
+/*
+ * Called by unlink and rmdir with inode_num write-locked, before its name
+ * goes. Returns 1 when the kernel still references the inode, which is
+ * then kept as an orphan, or 0 when the caller should free it now.
+ */
+int keep_unlinked_inode(int inode_num) {
+  pthread_mutex_lock(&node_refs.lock);
+  struct node_ref *node = find_node(inode_num);
+  int keep = node && (node->lookups > 0 || node->opens > 0);
+  if (keep) {
+    node->orphan = 1;
+  } else if (node) {
+    node->generation++;
+  }
+  pthread_mutex_unlock(&node_refs.lock);
+
+  if (keep) {
+    struct wfs_inode inode;
+    read_inode(&inode, inode_num);
+    inode.nlinks = 0;
+    write_inode(&inode, inode_num);
+    DEBUG_LOG("Keeping unlinked inode %d until the kernel drops it",
+              inode_num);
+  }
+  return keep;
+}
+
+unsigned long node_generation(int inode_num) {
+  pthread_mutex_lock(&node_refs.lock);
+  const struct node_ref *node = find_node(inode_num);
+  unsigned long generation = node ? node->generation : 0;
+  pthread_mutex_unlock(&node_refs.lock);
+  return generation;
+}
@@ -0,0 +1,14 @@
+#ifndef NODE_REFS_H
+#define NODE_REFS_H
+
+#include <stddef.h>
+
+int init_node_refs(size_t num_inodes);
+void destroy_node_refs(void);
+void node_ref_lookup(int inode_num);
+void node_ref_forget(int inode_num, unsigned long nlookup);
+void node_ref_open(int inode_num);
+void node_ref_release(int inode_num);
+int keep_unlinked_inode(int inode_num);
+unsigned long node_generation(int inode_num);
+#endif
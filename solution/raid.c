@@ -1,6 +1,9 @@
 
 #include "raid.h"
+#include "block_checksum.h"
 #include "globals.h"
+#include "replication.h"
+#include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,78 +26,103 @@ int get_raid_disk(int block_index, int *disk_index) {
   return block_index / wfs_ctx.num_disks;
 }
 
-int get_majority_block(char *block, size_t block_offset) {
-  int num_disks = wfs_ctx.num_disks;
-  char **block_data = malloc(num_disks * sizeof(char *));
-  int *votes = calloc(num_disks, sizeof(int));
-
-  if (!block_data || !votes) {
-    ERROR_LOG("Memory allocation failed for majority block computation\n");
-    free(block_data);
-    free(votes);
-    return -1;
-  }
+/*
+ * Distance between the block numbers of two physically consecutive blocks:
+ * RAID-0 stripes neighbouring numbers across disks, while mirrored modes
+ * only ever hand out multiples of num_disks.
+ */
+int get_raid_stride(void) {
+  return sb.raid_mode == RAID_0 ? 1 : wfs_ctx.num_disks;
+}
 
-  for (int i = 0; i < num_disks; i++) {
-    block_data[i] = malloc(BLOCK_SIZE);
-    if (!block_data[i]) {
-      ERROR_LOG("Memory allocation failed for block data\n");
-      for (int j = 0; j < i; j++) {
-        free(block_data[j]);
+/*
+ * Returns the disk whose copy of [offset, offset + size) the most disks
+ * agree on. Copies are compared in place in the mappings, and the search
+ * stops as soon as a strict majority agrees, so three healthy disks cost
+ * one comparison. Without a majority the largest group of equal copies
+ * wins, the one with the lowest disk on a tie.
+ */
+int find_majority_disk(size_t offset, size_t size) {
+  // Queued copies would let stale mirrors outvote the primary.
+  flush_replica_batch();
+
+  int num_disks = wfs_ctx.num_disks;
+  int majority = num_disks / 2 + 1;
+  int best = 0, best_votes = 0;
+
+  // Copies equal to an earlier one were counted with it, so only later
+  // disks are compared, and a disk that cannot beat best is not tried.
+  for (int i = 0; i < num_disks && num_disks - i > best_votes; i++) {
+    const char *copy = (const char *)wfs_ctx.disk_mmaps[i] + offset;
+    int votes = 1;
+
+    for (int j = i + 1; j < num_disks && votes < majority; j++) {
+      const char *other = (const char *)wfs_ctx.disk_mmaps[j] + offset;
+      if (memcmp(copy, other, size) == 0) {
+        votes++;
       }
-      free(block_data);
-      free(votes);
-      return -1;
+    }
+    if (votes >= majority) {
+      return i;
+    }
+    if (votes > best_votes) {
+      best = i;
+      best_votes = votes;
     }
   }
 
-  for (int i = 0; i < num_disks; i++) {
-    memcpy(block_data[i], (char *)wfs_ctx.disk_mmaps[i] + block_offset,
-           BLOCK_SIZE);
-  }
+  DEBUG_LOG("No majority for %zu bytes at offset %zu; using disk %d with %d "
+            "votes\n",
+            size, offset, best, best_votes);
+  return best;
+}
 
-  for (int i = 0; i < num_disks; i++) {
-    for (int j = i + 1; j < num_disks; j++) {
-      if (memcmp(block_data[i], block_data[j], BLOCK_SIZE) == 0) {
-        votes[i]++;
-        votes[j]++;
-      }
+/*
+ * Returns the disk to read the data block at block_offset from, trying
+ * disk_index first. With block checksums that is the first disk whose copy
+ * matches its checksum, so a healthy block costs one copy; RAID-1v falls
+ * back to voting only when no copy matches. Returns -EIO when every copy
+ * is corrupt and there is nothing to vote on.
+ */
+int find_read_disk(size_t block_offset, int disk_index) {
+  if (has_block_checksums()) {
+    if (block_checksum_ok(disk_index, block_offset)) {
+      return disk_index;
     }
-  }
-
-  int majority_disk_index = -1;
-  int max_votes = -1;
-  for (int i = 0; i < num_disks; i++) {
-    if (votes[i] > max_votes) {
-      max_votes = votes[i];
-      majority_disk_index = i;
+    ERROR_LOG("Checksum mismatch at offset %zu on disk %d\n", block_offset,
+              disk_index);
+
+    if (sb.raid_mode == RAID_1 || sb.raid_mode == RAID_1v) {
+      // A queued copy would not match the checksum queued with it yet.
+      flush_replica_batch();
+      for (int i = 0; i < wfs_ctx.num_disks; i++) {
+        if (i != disk_index && block_checksum_ok(i, block_offset)) {
+          return i;
+        }
+      }
     }
-  }
-
-  if (majority_disk_index < 0) {
-    ERROR_LOG("Unable to find majority value for block at offset %zu\n",
-              block_offset);
-    for (int i = 0; i < num_disks; i++) {
-      free(block_data[i]);
+    if (sb.raid_mode != RAID_1v) {
+      return -EIO;
     }
-    free(block_data);
-    free(votes);
-    return -1;
   }
 
-  memcpy(block, block_data[majority_disk_index], BLOCK_SIZE);
-
-  for (int i = 0; i < num_disks; i++) {
-    free(block_data[i]);
+  if (sb.raid_mode == RAID_1v) {
+    return find_majority_disk(block_offset, BLOCK_SIZE);
   }
-  free(block_data);
-  free(votes);
-
-  return 0;
+  return disk_index;
 }
 
+/*
+ * Copies block, already written to primary_disk_index at block_offset, to
+ * every other disk. Inside a replica batch the copy is only queued; see
+ * replication.c.
+ */
 void replicate(const void *block, size_t block_offset, size_t block_size,
                int primary_disk_index) {
+  if (queue_replica(block_offset, block_size, primary_disk_index)) {
+    return;
+  }
+
   DEBUG_LOG("Replicating block of size %zu at offset %zu from disk %d.\n",
             block_size, block_offset, primary_disk_index);
 
@@ -118,12 +146,13 @@ void replicate(const void *block, size_t block_offset, size_t block_size,
   }
 }
 
-void initialize_raid(void **disk_mmaps, int num_disks, int raid_mode,
-                     size_t *disk_sizes) {
+void initialize_raid(void **disk_mmaps, int *disk_fds, int num_disks,
+                     int raid_mode, size_t *disk_sizes) {
   DEBUG_LOG("Initializing RAID with %d disks, mode %d.\n", num_disks,
             raid_mode);
 
   wfs_ctx.disk_mmaps = disk_mmaps;
+  wfs_ctx.disk_fds = disk_fds;
   wfs_ctx.num_disks = num_disks;
   wfs_ctx.disk_sizes = disk_sizes;
   sb.raid_mode = raid_mode;
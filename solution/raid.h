@@ -5,10 +5,12 @@
 #include <sys/stat.h>
 
 int get_raid_disk(int block_index, int *disk_index);
+int get_raid_stride(void);
 void replicate(const void *block, size_t block_offset, size_t block_size,
                int primary_disk_index);
-void initialize_raid(void **disk_mmaps, int num_disks, int raid_mode,
-                     size_t *disk_sizes);
+void initialize_raid(void **disk_mmaps, int *disk_fds, int num_disks,
+                     int raid_mode, size_t *disk_sizes);
 
-int get_majority_block(char *block, size_t block_offset);
+int find_majority_disk(size_t offset, size_t size);
+int find_read_disk(size_t block_offset, int disk_index);
 #endif
@@ -0,0 +1,167 @@
+#include "read_balance.h"
+#include "globals.h"
+#include "replication.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Picks the mirror that serves a RAID-1 data read. Every disk holds the
+ * same bytes at the same offset, so only the disk changes:
+ *
+ *   primary      always disk 0, as before.
+ *   round-robin  each read goes to the next disk in turn.
+ *   affinity     a read that starts where a disk's last read ended goes
+ *                back to that disk, so a sequential reader keeps hitting
+ *                one disk's readahead; any other read goes to the least
+ *                busy disk. This is the default.
+ *   least-busy   the disk with the fewest reads in flight.
+ *
+ * A read is in flight from begin_disk_read() until end_disk_read(). For
+ * fd-backed buffers that covers mapping the request, not the copy FUSE
+ * makes afterwards. RAID-0 and RAID-1v reads are not balanced: RAID-0 has
+ * a single copy of each block and RAID-1v reads every copy to vote.
+ */
+enum read_policy {
+  READ_PRIMARY,
+  READ_ROUND_ROBIN,
+  READ_AFFINITY,
+  READ_LEAST_BUSY,
+};
+
+static const char *const policy_names[] = {
+    [READ_PRIMARY] = "primary",
+    [READ_ROUND_ROBIN] = "round-robin",
+    [READ_AFFINITY] = "affinity",
+    [READ_LEAST_BUSY] = "least-busy",
+};
+
+struct disk_reads {
+  size_t head; /* offset just past the last read */
+  int inflight;
+  size_t reads;
+  size_t bytes;
+};
+
+static struct {
+  enum read_policy policy;
+  int report;
+  struct disk_reads *disks;
+  size_t next; /* round-robin cursor */
+} balance = {.policy = READ_AFFINITY};
+
+int set_read_policy(const char *name) {
+  for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+    if (strcmp(name, policy_names[i]) == 0) {
+      balance.policy = i;
+      return 0;
+    }
+  }
+  ERROR_LOG("Unknown read policy: %s", name);
+  return -1;
+}
+
+// Prints the per-disk read counters at unmount.
+void set_read_stats(int enabled) { balance.report = enabled; }
+
+/*
+ * Sets up the per-disk counters for a RAID-1 mount. Other modes, or a
+ * failed allocation, leave every read on the disk it maps to.
+ */
+int start_read_balance(void) {
+  if (sb.raid_mode != RAID_1) {
+    return 0;
+  }
+  balance.disks = calloc(wfs_ctx.num_disks, sizeof(struct disk_reads));
+  if (!balance.disks) {
+    ERROR_LOG("Failed to allocate read counters");
+    return -1;
+  }
+  DEBUG_LOG("Balancing reads across %d mirrors with the %s policy",
+            wfs_ctx.num_disks, policy_names[balance.policy]);
+  return 0;
+}
+
+void stop_read_balance(void) {
+  if (!balance.disks) {
+    return;
+  }
+  if (balance.report) {
+    fprintf(stderr, "wfs: read policy %s\n", policy_names[balance.policy]);
+    for (int i = 0; i < wfs_ctx.num_disks; i++) {
+      fprintf(stderr, "wfs: disk %d: %zu reads, %zu bytes\n", i,
+              balance.disks[i].reads, balance.disks[i].bytes);
+    }
+  }
+  free(balance.disks);
+  balance.disks = NULL;
+}
+
+/*
+ * Starts at a rotating disk, so that idle mirrors take turns rather than
+ * disk 0 winning every tie.
+ */
+static int least_busy_disk(void) {
+  int num_disks = wfs_ctx.num_disks;
+  int best = __atomic_fetch_add(&balance.next, 1, __ATOMIC_RELAXED) % num_disks;
+  int best_inflight =
+      __atomic_load_n(&balance.disks[best].inflight, __ATOMIC_RELAXED);
+
+  for (int k = 1; k < num_disks && best_inflight > 0; k++) {
+    int i = (best + k) % num_disks;
+    int inflight =
+        __atomic_load_n(&balance.disks[i].inflight, __ATOMIC_RELAXED);
+    if (inflight < best_inflight) {
+      best = i;
+      best_inflight = inflight;
+    }
+  }
+  return best;
+}
+
+static int pick_disk(size_t offset) {
+  switch (balance.policy) {
+  case READ_ROUND_ROBIN:
+    return __atomic_fetch_add(&balance.next, 1, __ATOMIC_RELAXED) %
+           wfs_ctx.num_disks;
+  case READ_AFFINITY:
+    for (int i = 0; i < wfs_ctx.num_disks; i++) {
+      if (__atomic_load_n(&balance.disks[i].head, __ATOMIC_RELAXED) ==
+          offset) {
+        return i;
+      }
+    }
+    return least_busy_disk();
+  case READ_LEAST_BUSY:
+    return least_busy_disk();
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Returns the disk to read [offset, offset + size) from, counting the read
+ * as in flight until end_disk_read().
+ */
+int begin_disk_read(size_t offset, size_t size) {
+  if (!balance.disks) {
+    return 0;
+  }
+
+  // Copies this thread has queued have not reached the mirrors yet.
+  int disk_index = replica_batch_pending() ? 0 : pick_disk(offset);
+  struct disk_reads *disk = &balance.disks[disk_index];
+
+  __atomic_add_fetch(&disk->inflight, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&disk->head, offset + size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&disk->reads, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&disk->bytes, size, __ATOMIC_RELAXED);
+  return disk_index;
+}
+
+void end_disk_read(int disk_index) {
+  if (balance.disks) {
+    __atomic_sub_fetch(&balance.disks[disk_index].inflight, 1,
+                       __ATOMIC_RELAXED);
+  }
+}
@@ -0,0 +1,12 @@
+#ifndef READ_BALANCE_H
+#define READ_BALANCE_H
+
+#include <stddef.h>
+
+int set_read_policy(const char *name);
+void set_read_stats(int enabled);
+int start_read_balance(void);
+void stop_read_balance(void);
+int begin_disk_read(size_t offset, size_t size);
+void end_disk_read(int disk_index);
+#endif
@@ -0,0 +1,273 @@
+#include "replication.h"
+#include "globals.h"
+#include "wfs.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Copies a batch collects before they are sent off early.
+#define REPLICA_BATCH_MAX 64
+
+/*
+ * Mirrors are written by one worker thread per disk. While a thread has a
+ * replica batch open, replicate() only queues its copies. Closing the batch
+ * hands the list to every worker at once and waits until all of them are
+ * done, so an operation still returns only once each mirror holds its
+ * data. Copies are taken from the primary disk's mapping when the batch is
+ * sent, since the caller's buffer may be gone by then, and a copy that
+ * continues the previous one is merged into it. Outside a batch, or when
+ * the workers are not running, replicate() copies inline as before.
+ */
+struct replica_copy {
+  size_t offset;
+  size_t size;
+  int primary;
+};
+
+struct replica_ticket {
+  const struct replica_copy *copies;
+  size_t count;
+  int pending; /* workers still copying */
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+};
+
+struct ticket_link {
+  struct replica_ticket *ticket;
+  struct ticket_link *next;
+};
+
+struct replica_worker {
+  int disk_index;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct ticket_link *head;
+  struct ticket_link **tail;
+  int stop;
+};
+
+static struct {
+  struct replica_worker *workers;
+  int num_workers;
+} replication;
+
+static _Thread_local struct {
+  struct replica_copy copies[REPLICA_BATCH_MAX];
+  size_t count;
+  int primary; /* shared by every copy, or -1 */
+  int depth;
+} replica_batch;
+
+static void copy_to_disk(const struct replica_ticket *ticket, int disk_index) {
+  char *mirror = wfs_ctx.disk_mmaps[disk_index];
+
+  for (size_t i = 0; i < ticket->count; i++) {
+    const struct replica_copy *copy = &ticket->copies[i];
+    if (copy->primary == disk_index) {
+      continue;
+    }
+    const char *primary = wfs_ctx.disk_mmaps[copy->primary];
+    memcpy(mirror + copy->offset, primary + copy->offset, copy->size);
+  }
+}
+
+static void *replica_worker_main(void *arg) {
+  struct replica_worker *worker = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&worker->lock);
+    while (!worker->head && !worker->stop) {
+      pthread_cond_wait(&worker->wake, &worker->lock);
+    }
+    struct ticket_link *link = worker->head;
+    if (link) {
+      worker->head = link->next;
+      if (!worker->head) {
+        worker->tail = &worker->head;
+      }
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    if (!link) {
+      return NULL;
+    }
+
+    struct replica_ticket *ticket = link->ticket;
+    copy_to_disk(ticket, worker->disk_index);
+
+    pthread_mutex_lock(&ticket->lock);
+    if (--ticket->pending == 0) {
+      pthread_cond_signal(&ticket->done);
+    }
+    pthread_mutex_unlock(&ticket->lock);
+  }
+}
+
+static void stop_workers(int count) {
+  for (int d = 0; d < count; d++) {
+    struct replica_worker *worker = &replication.workers[d];
+    pthread_mutex_lock(&worker->lock);
+    worker->stop = 1;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+    pthread_cond_destroy(&worker->wake);
+    pthread_mutex_destroy(&worker->lock);
+  }
+  free(replication.workers);
+  replication.workers = NULL;
+  replication.num_workers = 0;
+}
+
+/*
+ * Starts the workers. Called from the FUSE init callback, after FUSE has
+ * daemonized, since threads do not survive the fork. On failure
+ * replication simply stays inline.
+ */
+int start_replication(void) {
+  int num_disks = wfs_ctx.num_disks;
+
+  if (num_disks < 2 || replication.workers) {
+    return 0;
+  }
+
+  replication.workers = calloc(num_disks, sizeof(struct replica_worker));
+  if (!replication.workers) {
+    ERROR_LOG("Memory allocation failed for replication workers");
+    return -ENOMEM;
+  }
+
+  for (int d = 0; d < num_disks; d++) {
+    struct replica_worker *worker = &replication.workers[d];
+    worker->disk_index = d;
+    worker->tail = &worker->head;
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->wake, NULL);
+
+    int res =
+        pthread_create(&worker->thread, NULL, replica_worker_main, worker);
+    if (res != 0) {
+      ERROR_LOG("Failed to start replication worker for disk %d", d);
+      pthread_cond_destroy(&worker->wake);
+      pthread_mutex_destroy(&worker->lock);
+      stop_workers(d);
+      return -res;
+    }
+  }
+
+  replication.num_workers = num_disks;
+  DEBUG_LOG("Started %d replication workers", num_disks);
+  return 0;
+}
+
+void stop_replication(void) {
+  if (replication.workers) {
+    stop_workers(replication.num_workers);
+    DEBUG_LOG("Stopped replication workers");
+  }
+}
+
+/*
+ * Hands the queued copies to every worker with something to do and waits
+ * for all of them.
+ */
+static void send_batch(void) {
+  if (replica_batch.count == 0) {
+    return;
+  }
+
+  int num_workers = replication.num_workers;
+  struct ticket_link links[num_workers];
+  struct replica_ticket ticket = {
+      .copies = replica_batch.copies,
+      .count = replica_batch.count,
+  };
+
+  for (int d = 0; d < num_workers; d++) {
+    if (d != replica_batch.primary) {
+      ticket.pending++;
+    }
+  }
+  pthread_mutex_init(&ticket.lock, NULL);
+  pthread_cond_init(&ticket.done, NULL);
+
+  for (int d = 0; d < num_workers; d++) {
+    struct replica_worker *worker = &replication.workers[d];
+    if (d == replica_batch.primary) {
+      continue;
+    }
+
+    links[d].ticket = &ticket;
+    links[d].next = NULL;
+    pthread_mutex_lock(&worker->lock);
+    *worker->tail = &links[d];
+    worker->tail = &links[d].next;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  pthread_mutex_lock(&ticket.lock);
+  while (ticket.pending > 0) {
+    pthread_cond_wait(&ticket.done, &ticket.lock);
+  }
+  pthread_mutex_unlock(&ticket.lock);
+  pthread_cond_destroy(&ticket.done);
+  pthread_mutex_destroy(&ticket.lock);
+
+  DEBUG_LOG("Replicated %zu queued copies", replica_batch.count);
+  replica_batch.count = 0;
+}
+
+void begin_replica_batch(void) { replica_batch.depth++; }
+
+void end_replica_batch(void) {
+  if (replica_batch.depth == 0 || --replica_batch.depth > 0) {
+    return;
+  }
+  send_batch();
+}
+
+/*
+ * Makes every copy queued so far land without closing the batch. Needed
+ * before blocks are freed, since their copies are read from the primary
+ * disk and another thread could reuse them first.
+ */
+void flush_replica_batch(void) { send_batch(); }
+
+// Whether this thread has copies queued that the mirrors do not hold yet.
+int replica_batch_pending(void) { return replica_batch.count > 0; }
+
+/*
+ * Queues a copy of size bytes at offset from primary_disk_index to every
+ * other disk. Returns 0 when no batch is open and the caller has to copy
+ * itself.
+ */
+int queue_replica(size_t offset, size_t size, int primary_disk_index) {
+  if (replica_batch.depth == 0 || !replication.workers) {
+    return 0;
+  }
+
+  if (replica_batch.count > 0) {
+    struct replica_copy *last = &replica_batch.copies[replica_batch.count - 1];
+    if (last->primary == primary_disk_index &&
+        last->offset + last->size == offset) {
+      last->size += size;
+      return 1;
+    }
+  }
+
+  if (replica_batch.count == REPLICA_BATCH_MAX) {
+    send_batch();
+  }
+  if (replica_batch.count == 0) {
+    replica_batch.primary = primary_disk_index;
+  } else if (replica_batch.primary != primary_disk_index) {
+    replica_batch.primary = -1;
+  }
+
+  replica_batch.copies[replica_batch.count++] = (struct replica_copy){
+      .offset = offset, .size = size, .primary = primary_disk_index};
+  return 1;
+}
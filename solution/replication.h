@@ -0,0 +1,13 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+
+int start_replication(void);
+void stop_replication(void);
+void begin_replica_batch(void);
+void end_replica_batch(void);
+void flush_replica_batch(void);
+int replica_batch_pending(void);
+int queue_replica(size_t offset, size_t size, int primary_disk_index);
+#endif
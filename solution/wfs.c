@@ -1,9 +1,17 @@
 #define FUSE_USE_VERSION 30
 
 #include "wfs.h"
+#include "dcache.h"
+#include "dir_filter.h"
+#include "free_space.h"
+#include "fuse_file_ops.h"
+#include "inode_cache.h"
+#include "inode_lock.h"
+#include "fuse_lowlevel_ops.h"
 #include "fuse_ops.h"
 #include "globals.h"
 #include "raid.h"
+#include "read_balance.h"
 #include <fcntl.h>
 #include <fuse.h>
 #include <stdio.h>
@@ -13,11 +21,46 @@
 #include <unistd.h>
 
 static void print_usage(const char *progname) {
-  DEBUG_LOG("Usage: %s disk1 [disk2 ...] [FUSE options] mount_point\n",
+  DEBUG_LOG("Usage: %s disk1 [disk2 ...] [--lowlevel] "
+            "[--read-policy=primary|round-robin|affinity|least-busy] "
+            "[--read-stats] [FUSE options] mount_point\n",
             progname);
   DEBUG_LOG("Ensure WFS is initialized using mkfs with RAID mode and disks.\n");
 }
 
+/*
+ * Removes flag from argv if present. Used for WFS's own options, which
+ * FUSE would reject.
+ */
+static int take_flag(int *argc, char *argv[], const char *flag) {
+  for (int i = 1; i < *argc; i++) {
+    if (strcmp(argv[i], flag) == 0) {
+      // Shifts the terminating NULL down as well.
+      memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(char *));
+      (*argc)--;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Like take_flag, for options of the form name=value. Returns the value, or
+ * NULL when the option is absent.
+ */
+static const char *take_option(int *argc, char *argv[], const char *name) {
+  size_t len = strlen(name);
+  for (int i = 1; i < *argc; i++) {
+    if (strncmp(argv[i], name, len) == 0 && argv[i][len] == '=') {
+      const char *value = argv[i] + len + 1;
+      memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(char *));
+      (*argc)--;
+      return value;
+    }
+  }
+  return NULL;
+}
+
 static int parse_args(int argc, char *argv[], char ***disk_paths,
                       int *num_disks, char ***fuse_args, int *fuse_argc,
                       char **mount_point) {
@@ -70,6 +113,39 @@ int load_superblock(void *disk_mmap, struct wfs_sb *sb) {
 
   memcpy(sb, disk_mmap, sizeof(struct wfs_sb));
 
+  if (sb->magic != WFS_MAGIC) {
+    ERROR_LOG("Not a WFS image, or made by an older mkfs; recreate it.\n");
+    return -1;
+  }
+  if (sb->version != WFS_VERSION) {
+    ERROR_LOG("Unsupported superblock version %u.\n", sb->version);
+    return -1;
+  }
+  if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE ||
+      (sb->block_size & (sb->block_size - 1)) != 0) {
+    ERROR_LOG("Unsupported block size %u in superblock.\n", sb->block_size);
+    return -1;
+  }
+  if (sb->inode_size < sizeof(struct wfs_inode) ||
+      sb->inode_size > sb->block_size ||
+      (sb->inode_size & (sb->inode_size - 1)) != 0) {
+    ERROR_LOG("Unsupported inode size %u in superblock.\n", sb->inode_size);
+    return -1;
+  }
+  off_t inode_table_end =
+      sb->i_blocks_ptr + (off_t)(sb->num_inodes * sb->inode_size);
+  if (sb->d_blocks_ptr < inode_table_end) {
+    ERROR_LOG("Data blocks start inside the inode table.\n");
+    return -1;
+  }
+  if ((sb->features & WFS_FEATURE_CHECKSUMS) &&
+      (sb->csum_ptr < inode_table_end ||
+       sb->csum_ptr + (off_t)(sb->num_data_blocks * sizeof(uint32_t)) >
+           sb->d_blocks_ptr)) {
+    ERROR_LOG("Checksum table overlaps the inode table or data blocks.\n");
+    return -1;
+  }
+
   PRINT_SUPERBLOCK(*sb);
   return 0;
 }
@@ -89,6 +165,17 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
+  // Serve through the low-level, inode-based FUSE API.
+  int lowlevel = take_flag(&argc, argv, "--lowlevel");
+
+  // Which RAID-1 mirror serves each read; see read_balance.c.
+  const char *read_policy = take_option(&argc, argv, "--read-policy");
+  if (read_policy && set_read_policy(read_policy) != 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  set_read_stats(take_flag(&argc, argv, "--read-stats"));
+
   DEBUG_LOG("Parsing command-line arguments.");
   char **disk_paths = NULL;
   int num_disks = 0;
@@ -104,17 +191,23 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
-  DEBUG_LOG("Allocating memory for disk mappings and sizes.");
+  DEBUG_LOG("Allocating memory for disk mappings, descriptors and sizes.");
   void **disk_mmaps = malloc(num_disks * sizeof(void *));
+  int *disk_fds = malloc(num_disks * sizeof(int));
   size_t *disk_sizes = malloc(num_disks * sizeof(size_t));
-  if (!disk_mmaps || !disk_sizes) {
+  if (!disk_mmaps || !disk_fds || !disk_sizes) {
     ERROR_LOG("Memory allocation failed for disk mappings or sizes.");
     free(disk_paths);
     free(disk_mmaps);
+    free(disk_fds);
     free(disk_sizes);
     return EXIT_FAILURE;
   }
 
+  for (int i = 0; i < num_disks; i++) {
+    disk_fds[i] = -1;
+  }
+
   int success = 1;
   for (int i = 0; i < num_disks; i++) {
     DEBUG_LOG("Opening disk file: %s", disk_paths[i]);
@@ -161,7 +254,8 @@ int main(int argc, char *argv[]) {
     }
 
     DEBUG_LOG("Disk mapped successfully for index: %d", disk_index);
-    close(fd);
+    // Kept open so reads can be handed to FUSE as fd-backed buffers.
+    disk_fds[disk_index] = fd;
   }
 
   if (!success) {
@@ -171,8 +265,12 @@ int main(int argc, char *argv[]) {
         DEBUG_LOG("Unmapping disk at index: %d", i);
         munmap(disk_mmaps[i], disk_sizes[i]);
       }
+      if (disk_fds[i] >= 0) {
+        close(disk_fds[i]);
+      }
     }
     free(disk_mmaps);
+    free(disk_fds);
     free(disk_sizes);
     free(disk_paths);
     return EXIT_FAILURE;
@@ -184,8 +282,10 @@ int main(int argc, char *argv[]) {
         "Error reading superblock. Ensure disks are initialized using mkfs.");
     for (int i = 0; i < num_disks; i++) {
       munmap(disk_mmaps[i], disk_sizes[i]);
+      close(disk_fds[i]);
     }
     free(disk_mmaps);
+    free(disk_fds);
     free(disk_sizes);
     free(disk_paths);
     return EXIT_FAILURE;
@@ -196,24 +296,69 @@ int main(int argc, char *argv[]) {
             sb.num_inodes, sb.num_data_blocks);
 
   DEBUG_LOG("Initializing RAID configuration.");
-  initialize_raid(disk_mmaps, num_disks, sb.raid_mode, disk_sizes);
+  initialize_raid(disk_mmaps, disk_fds, num_disks, sb.raid_mode, disk_sizes);
   DEBUG_LOG("RAID initialized successfully.");
 
+  DEBUG_LOG("Building free space index.");
+  if (init_free_space() != 0) {
+    ERROR_LOG("Error building free space index.");
+    for (int i = 0; i < num_disks; i++) {
+      munmap(disk_mmaps[i], disk_sizes[i]);
+      close(disk_fds[i]);
+    }
+    free(disk_mmaps);
+    free(disk_fds);
+    free(disk_sizes);
+    free(disk_paths);
+    return EXIT_FAILURE;
+  }
+
+  if (init_inode_locks(sb.num_inodes) != 0) {
+    ERROR_LOG("Error allocating inode locks.");
+    destroy_free_space();
+    for (int i = 0; i < num_disks; i++) {
+      munmap(disk_mmaps[i], disk_sizes[i]);
+      close(disk_fds[i]);
+    }
+    free(disk_mmaps);
+    free(disk_fds);
+    free(disk_sizes);
+    free(disk_paths);
+    return EXIT_FAILURE;
+  }
+
+  // Without -s FUSE runs several threads; see set_read_staging().
+  int single_threaded = 0;
+  for (int i = 0; i < fuse_argc; i++) {
+    single_threaded |= strcmp(fuse_args[i], "-s") == 0;
+  }
+  set_read_staging(!lowlevel && !single_threaded);
+
   DEBUG_LOG("Starting FUSE with mount point: %s", mount_point);
   print_arguments(fuse_argc, fuse_args);
 
-  int ret = fuse_main(fuse_argc, fuse_args, &ops, NULL);
+  int ret = lowlevel ? wfs_lowlevel_main(fuse_argc, fuse_args)
+                     : fuse_main(fuse_argc, fuse_args, &ops, NULL);
 
   DEBUG_LOG("FUSE terminated with status: %d", ret);
 
   DEBUG_LOG("Cleaning up resources.");
+  destroy_inode_cache();
+  destroy_free_space();
+  destroy_dcache();
+  destroy_dir_filters();
+  destroy_inode_locks();
   for (int i = 0; i < num_disks; i++) {
     if (disk_mmaps[i]) {
       DEBUG_LOG("Unmapping disk at index: %d", i);
       munmap(disk_mmaps[i], disk_sizes[i]);
     }
+    if (disk_fds[i] >= 0) {
+      close(disk_fds[i]);
+    }
   }
   free(disk_mmaps);
+  free(disk_fds);
   free(disk_sizes);
   free(disk_paths);
 
@@ -5,26 +5,55 @@
 #include <sys/stat.h>
 #include <time.h>
 
-#define BLOCK_SIZE (512)
+// Block size is chosen by mkfs and stored in wfs_sb.block_size.
+#define DEFAULT_BLOCK_SIZE (512)
+#define MIN_BLOCK_SIZE (512)
+#define MAX_BLOCK_SIZE (64 * 1024)
 #define MAX_NAME (28)
 
+/*
+  Identifies a superblock in this format. The fields from `magic` on did not
+  exist in the original layout, whose inode bitmap started where `magic` is
+  now, so those images fail the magic check instead of being misread.
+*/
+#define WFS_MAGIC (0x57465331) /* "WFS1" */
+#define WFS_VERSION (1)
+
 #define D_BLOCK (6)
 #define IND_BLOCK (D_BLOCK + 1)
 #define N_BLOCKS (IND_BLOCK + 1)
+// With WFS_FEATURE_MULTI_INDIRECT the last two direct slots hold these roots.
+#define DIND_BLOCK (D_BLOCK - 1)
+#define TIND_BLOCK (D_BLOCK)
+
+// Optional on-disk format features, recorded in wfs_sb.features by mkfs.
+#define WFS_FEATURE_MULTI_INDIRECT (1 << 0) /* double/triple indirect */
+#define WFS_FEATURE_EXTENTS (1 << 1)        /* extent-mapped regular files */
+#define WFS_FEATURE_INLINE_DATA (1 << 2)    /* small contents in inode slot */
+#define WFS_FEATURE_DIR_INDEX (1 << 3)      /* hashed large directories */
+#define WFS_FEATURE_CHECKSUMS (1 << 4)      /* CRC32C of every data block */
+
+// Per-inode flags (wfs_inode.flags)
+#define WFS_INODE_EXTENTS (1 << 0) /* blocks[] holds an extent tree root */
+#define WFS_INODE_INLINE (1 << 1)  /* contents follow the inode in its slot */
+#define WFS_INODE_HASHED (1 << 2)  /* directory is a hashed bucket table */
 #define PATH_MAX 4096
 /*
   The fields in the superblock should reflect the structure of the filesystem.
   `mkfs` writes the superblock to offset 0 of the disk image.
   The disk image will have this format:
 
-          d_bitmap_ptr       d_blocks_ptr
-               v                  v
-+----+---------+---------+--------+--------------------------+
-| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        |
-+----+---------+---------+--------+--------------------------+
-0    ^                   ^
-i_bitmap_ptr        i_blocks_ptr
+          d_bitmap_ptr                d_blocks_ptr
+               v                           v
++----+---------+---------+--------+--------+--------------------------+
+| SB | IBITMAP | DBITMAP | INODES | CSUMS  |       DATA BLOCKS        |
++----+---------+---------+--------+--------+--------------------------+
+0    ^                   ^        ^
+i_bitmap_ptr        i_blocks_ptr  csum_ptr
 
+  CSUMS only exists with WFS_FEATURE_CHECKSUMS. It starts at the first block
+  boundary after the inode table, and d_blocks_ptr is block aligned after it.
+  Without the feature csum_ptr is 0 and the data blocks follow the inodes.
 */
 
 // superblock
@@ -40,16 +69,25 @@ struct wfs_sb {
   int disk_index;
   int total_disks;
   uint64_t disk_id;
+  uint32_t magic;   /* WFS_MAGIC */
+  uint32_t version; /* WFS_VERSION */
+  uint32_t features;
+  uint32_t block_size;
+  uint32_t inode_size; /* bytes per inode slot, at most block_size */
+  uint64_t free_inodes; /* same on every disk */
+  uint64_t free_blocks; /* free rows in this disk's data bitmap */
+  off_t csum_ptr;       /* WFS_FEATURE_CHECKSUMS: one uint32_t per row */
 };
 
 // Inode
 struct wfs_inode {
-  int num;     /* Inode number */
-  mode_t mode; /* File type and mode */
-  uid_t uid;   /* User ID of owner */
-  gid_t gid;   /* Group ID of owner */
-  off_t size;  /* Total size, in bytes */
-  int nlinks;  /* Number of links */
+  int num;        /* Inode number */
+  mode_t mode;    /* File type and mode */
+  uid_t uid;      /* User ID of owner */
+  gid_t gid;      /* Group ID of owner */
+  off_t size;     /* Total size, in bytes */
+  int nlinks;     /* Number of links */
+  uint32_t flags; /* WFS_INODE_* */
 
   time_t atim; /* Time of last access */
   time_t mtim; /* Time of last modification */
@@ -58,10 +96,50 @@ struct wfs_inode {
   off_t blocks[N_BLOCKS];
 };
 
+/*
+  Extent tree node. The root lives in wfs_inode.blocks, other nodes fill a
+  data block. Leaf entries (depth 0) map `length` blocks from `logical`
+  onwards to consecutive data blocks starting at `start`; index entries
+  point `start` at the child node covering blocks from `logical` onwards.
+*/
+struct wfs_extent_header {
+  uint16_t entries;
+  uint16_t max;
+  uint16_t depth;
+  uint16_t magic;
+};
+
+struct wfs_extent {
+  uint32_t logical;
+  uint32_t length;
+  int32_t start;
+};
+
 // Directory entry
 struct wfs_dentry {
   char name[MAX_NAME];
   int num;
 };
 
+/*
+  Hashed directory. The directory's own blocks, mapped like a file's, hold
+  this header followed by a table of 2^global_depth bucket block numbers,
+  indexed by the low bits of the name hash. A bucket is one data block
+  holding a wfs_dir_bucket in its first dentry slot and dentries after it.
+  Every table entry that agrees with a bucket's hash on the bucket's low
+  `depth` bits points at it.
+*/
+struct wfs_dir_index {
+  uint32_t magic;
+  uint32_t global_depth;
+  uint32_t reserved[2];
+};
+
+struct wfs_dir_bucket {
+  uint32_t magic;
+  uint32_t depth;
+  uint32_t count; /* dentries in use */
+  uint32_t reserved[5];
+};
+
 #endif
@@ -0,0 +1,53 @@
+#!/usr/bin/python3
+
+# Fill one directory with thousands of files so it is split into many hash
+# buckets, then check that every name is found by lookup, that removed names
+# are gone, and that readdir lists exactly the names that are left.
+
+import os
+
+numfiles = 2000
+
+def name(n):
+    return "d1/file%d" % n
+
+def expect_listing(names):
+    found = sorted(os.listdir("d1"))
+    if found != sorted(os.path.basename(n) for n in names):
+        print(f"readdir found {len(found)} entries, expected {len(names)}")
+        exit(1)
+
+def expect_missing(names):
+    for n in names:
+        if os.path.exists(n):
+            print(f"{n} still found after unlink")
+            exit(1)
+
+os.chdir("mnt")
+
+try:
+    os.mkdir("d1")
+    allnames = [name(n + 1) for n in range(numfiles)]
+    for n in allnames:
+        os.mknod(n)
+
+    for n in allnames:
+        os.stat(n)
+    expect_missing([name(numfiles + 1)])
+    expect_listing(allnames)
+
+    removed = allnames[0::2]
+    kept = allnames[1::2]
+    for n in removed:
+        os.unlink(n)
+
+    for n in kept:
+        os.stat(n)
+    expect_missing(removed)
+    expect_listing(kept)
+except Exception as e:
+    print(e)
+    exit(1)
+
+print("Correct")
+exit(0)
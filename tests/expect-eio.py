@@ -0,0 +1,22 @@
+#!/usr/bin/python3
+
+# Read a file with a corrupted block that has no good copy left. The read
+# must fail with EIO instead of returning the damaged data.
+
+import errno
+import sys
+
+name = sys.argv[1]
+
+try:
+    with open(name, "rb") as f:
+        f.read()
+except OSError as e:
+    if e.errno == errno.EIO:
+        print("Correct")
+        exit(0)
+    print(e)
+    exit(1)
+
+print(f"{name} read back without an error")
+exit(1)
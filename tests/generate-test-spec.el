@@ -273,6 +273,31 @@ RUN-RC return code of run command (metadata verifier)"
 	   (string-join (gen-disks numdisks) " "))
    output pre-rc run-rc ""))
 
+(defun mkfs-layout-test (desc raid numdisks inodes blocks block-size inode-size
+				output pre-rc run-rc)
+  "Test template for mkfs with a non-default block and inode size.
+
+Arguments as for `mkfs-test', plus
+BLOCK-SIZE block size passed to mkfs with -B
+INODE-SIZE inode slot size passed to mkfs with -I"
+  (define-test
+   (concat "mkfs: " desc)
+   (string-join
+    (list
+     "mkdir -p /tmp/$(whoami)"
+     (create-disk-cmd numdisks "1M")
+     (format "../solution/mkfs %s -B %d -I %d"
+	     (make-mkfs-args raid numdisks inodes blocks) block-size inode-size))
+    "; ")
+   (format "rm -f %s" (disk-path "test-disk*"))
+   (format "./wfs-check-metadata.py --mode mkfs --inodes %d --blocks %d --block-size %d --inode-size %d --disks %s"
+	   (roundup inodes 32)
+	   (roundup blocks 32)
+	   block-size
+	   inode-size
+	   (string-join (gen-disks numdisks) " "))
+   output pre-rc run-rc ""))
+
 (defun verify-metadata-cmd (fs-state extra-blocks numdisks)
   (let ((metadata (count-metadata fs-state numdisks)))
       (format
@@ -402,6 +427,111 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 		      testlist))
 		 raidconfigs)))
 
+(defun inode-cache-race-test (desc raid numdisks)
+  "Test template for appends racing inode cache evictions.
+
+mkfs makes more inodes than the inode cache has slots, and wfs is
+mounted multi-threaded, so inode-cache-race.py keeps evicting the files
+it appends to. The files are checked again on a fresh mount.
+
+DESC description of the test
+RAID raid mode as string (0, 1, or 1v)
+NUMDISKS number of disks in the filesystem"
+  (define-test
+   desc
+   (string-join
+    (list
+     "mkdir -p mnt; mkdir -p /tmp/$(whoami)"
+     (create-disk-cmd numdisks "1M")
+     (format "../solution/mkfs %s -I 128"
+	     (make-mkfs-args raid numdisks 1056 224))
+     (format "../solution/wfs %s mnt" (string-join (gen-disks numdisks) " ")))
+    " && ")
+   (teardown-cmd)
+   (string-join
+    (list
+     "./inode-cache-race.py"
+     (umount-cmd "mnt")
+     (mount-cmd numdisks "mnt")
+     "./inode-cache-race.py --check"
+     (umount-cmd "mnt")
+     ;; 1 root dentry block, 7 per directory, 4 per appended file
+     (format "./wfs-check-metadata.py --mode raid%s --blocks 103 --altblocks 103 --dirs 11 --files 1040 --inode-size 128 --disks %s"
+	     raid
+	     (string-join (gen-disks numdisks) " ")))
+    " && ")
+   "Correct\nCorrect\nCorrect" "0" "0" ""))
+
+(defun dir-index-test (desc raid numdisks)
+  "Test template for a large hashed directory.
+
+mkfs enables dir_index with room for thousands of inodes, and
+dir-index-check.py fills one directory, removes half of it and checks
+lookups and readdir along the way.
+
+DESC description of the test
+RAID raid mode as string (0, 1, or 1v)
+NUMDISKS number of disks in the filesystem"
+  (define-test
+   desc
+   (string-join
+    (list
+     "mkdir -p mnt; mkdir -p /tmp/$(whoami)"
+     (create-disk-cmd numdisks "1M")
+     (format "../solution/mkfs %s -I 128 -f dir_index"
+	     (make-mkfs-args raid numdisks 2048 512))
+     (mount-cmd numdisks "mnt"))
+    " && ")
+   (teardown-cmd)
+   (string-join
+    (list
+     "./dir-index-check.py"
+     (umount-cmd "mnt")
+     ;; 1 root dentry block, 185 bucket and table blocks for d1
+     (format "./wfs-check-metadata.py --mode raid%s --blocks 186 --altblocks 186 --dirs 2 --files 1000 --inode-size 128 --disks %s"
+	     raid
+	     (string-join (gen-disks numdisks) " ")))
+    " && ")
+   "Correct\nCorrect\nCorrect" "0" "0" ""))
+
+(defun checksum-test (desc raid numdisks readback output)
+  "Test template for reads from a disk corrupted under block checksums.
+
+mkfs enables checksum, file1 is written and the metadata checked, then
+corrupt-disk.py zeroes the data region of the first disk and READBACK
+reads file1 on a fresh mount.
+
+DESC description of the test
+RAID raid mode as string (0, 1, or 1v)
+NUMDISKS number of disks in the filesystem
+READBACK command run against file1 after the corruption
+OUTPUT expected output of the test"
+  (define-test
+   desc
+   (string-join
+    (list
+     "mkdir -p mnt; mkdir -p /tmp/$(whoami)"
+     (create-disk-cmd numdisks "1M")
+     (format "../solution/mkfs %s -f checksum"
+	     (default-fs-mkfs-args raid numdisks))
+     (mount-cmd numdisks "mnt"))
+    " && ")
+   (teardown-cmd)
+   (string-join
+    (list
+     "./read-write.py 1 50" ; create a 5000-byte file
+     "cat mnt/file1 > file1.test"
+     (umount-cmd "mnt")
+     ;; 1 root dentry block, 10 data blocks and the indirect block
+     (format "./wfs-check-metadata.py --mode raid%s --blocks 12 --altblocks 12 --dirs 1 --files 1 --disks %s"
+	     raid
+	     (string-join (gen-disks numdisks) " "))
+     (format "./corrupt-disk.py --disks %s" (disk-path "test-disk1"))
+     (mount-cmd numdisks "mnt")
+     readback)
+    " && ")
+   output "0" "0" ""))
+
 ; returns (filesystem-init-success 2 "1" "desc" '(())
 (generate-tests
  `(((testcase . ,#'mkfs-test)
@@ -503,4 +633,44 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 			  (mount-cmd 3 "mnt")
 			  "diff mnt/file1 file1.test")
 		    "; ")
-		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))))
+		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'mkfs-layout-test)
+    ; desc raid numdisks inodes blocks block-size inode-size output pre-rc run-rc
+    (configs . (("inode table not a whole number of blocks"
+		 "1" 2 32 32 16384 256 "Success" "0" "0"))))
+   ((testcase . ,#'inode-cache-race-test)
+    ; desc raid numdisks
+    (configs . (("raid1 -- appends racing inode cache evictions" "1" 2))))
+   ((testcase . ,#'filesystem-init-and-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'filesystem-workload-success
+		  `(("sparse: holes, fallocate, punch and zero range" ,'()
+		     "./sparse-check.py" ; sizes below count the blocks left allocated
+		     ,'(("file1" . 1024) ("file2" . 2048) ("file3" . 2048)) 0
+		     "Correct\nCorrect\nCorrect"))
+		  `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'filesystem-init-and-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'filesystem-workload-success
+		  `(("truncate: shrink and grow again" ,'()
+		     "./truncate-check.py" ; sizes below count the blocks left allocated
+		     ,'(("file1" . 1000) ("file2" . 512)) 0
+		     "Correct\nCorrect\nCorrect"))
+		  `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'filesystem-init-and-workload)
+    (configs . ,(gen-raid-test-with-fn
+		 #'filesystem-workload-success
+		  `(("statfs: free counts follow create, write and unlink" ,'()
+		     "./statfs-check.py"
+		     ,'() 1 "Correct\nCorrect\nCorrect"))
+		  `(("1" 2) ("0" 3)))))
+   ((testcase . ,#'dir-index-test)
+    ; desc raid numdisks
+    (configs . (("raid1 -- dir_index: thousands of entries" "1" 2)
+		("raid0 -- dir_index: thousands of entries" "0" 3))))
+   ((testcase . ,#'checksum-test)
+    ; desc raid numdisks readback output
+    (configs . (("raid1 -- checksum: read the good mirror of a corrupted disk"
+		 "1" 2 "diff mnt/file1 file1.test" "Correct\nCorrect")
+		("raid0 -- checksum: corrupted block fails with EIO"
+		 "0" 3 "./expect-eio.py mnt/file1" "Correct\nCorrect\nCorrect"))))))
@@ -0,0 +1,82 @@
+#!/usr/bin/python3
+
+# Append to a few files from several threads while other threads open every
+# file in turn. There are more files than inode cache slots, so the appended
+# files keep being evicted and read back from disk while they are written.
+# Run with --check on a fresh mount to verify no append was lost.
+
+import os
+import sys
+import threading
+
+numdirs = 10
+filesperdir = 104
+targets = ["d1/file%d" % (n + 1) for n in range(8)]
+writers = 2
+appends = 50
+
+def record(writer, seq):
+    return b"%02d%014d" % (writer, seq)
+
+def expected():
+    return sorted(record(w, s) for w in range(writers) for s in range(appends))
+
+def check():
+    for name in targets:
+        with open(name, "rb") as f:
+            contents = f.read()
+        found = sorted(contents[i:i + 16] for i in range(0, len(contents), 16))
+        if found != expected():
+            print(f"{name} lost appends: {len(contents)} bytes")
+            exit(1)
+    print("Correct")
+    exit(0)
+
+os.chdir("mnt")
+if len(sys.argv) > 1 and sys.argv[1] == "--check":
+    check()
+
+allfiles = []
+for d in range(numdirs):
+    os.mkdir("d%d" % (d + 1))
+    for n in range(filesperdir):
+        name = "d%d/file%d" % (d + 1, n + 1)
+        os.mknod(name)
+        allfiles.append(name)
+
+done = threading.Event()
+errors = []
+
+def append(name, writer):
+    try:
+        for seq in range(appends):
+            with open(name, "ab") as f:
+                f.write(record(writer, seq))
+    except Exception as e:
+        errors.append(e)
+
+def sweep():
+    try:
+        while not done.is_set():
+            for name in allfiles:
+                with open(name, "rb"):
+                    pass
+    except Exception as e:
+        errors.append(e)
+
+sweepers = [threading.Thread(target=sweep) for _ in range(4)]
+appenders = [threading.Thread(target=append, args=(name, w))
+             for name in targets for w in range(writers)]
+for t in sweepers + appenders:
+    t.start()
+for t in appenders:
+    t.join()
+done.set()
+for t in sweepers:
+    t.join()
+
+if errors:
+    print(errors[0])
+    exit(1)
+print("Correct")
+exit(0)
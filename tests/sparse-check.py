@@ -0,0 +1,60 @@
+#!/usr/bin/python3
+
+# Leave holes in files three ways and check they read back as zeros:
+# file1 is written past its end, file2 is preallocated with
+# posix_fallocate, and file3 has a hole punched and a range zeroed.
+
+import ctypes
+import ctypes.util
+import os
+
+FALLOC_FL_KEEP_SIZE = 0x01
+FALLOC_FL_PUNCH_HOLE = 0x02
+FALLOC_FL_ZERO_RANGE = 0x10
+
+libc = ctypes.CDLL(ctypes.util.find_library("c"), use_errno=True)
+
+def fallocate(fd, mode, offset, length):
+    if libc.fallocate(fd, mode, ctypes.c_int64(offset),
+                      ctypes.c_int64(length)) != 0:
+        errno = ctypes.get_errno()
+        raise OSError(errno, os.strerror(errno))
+
+def expect(name, contents):
+    with open(name, "rb") as f:
+        found = f.read()
+    if found != contents:
+        print(f"{name} does not read back as expected")
+        exit(1)
+
+os.chdir("mnt")
+
+try:
+    # blocks 0 and 5 are written, 1-4 are a hole
+    with open("file1", "wb") as f:
+        f.write(b"a" * 512)
+        f.seek(5 * 512)
+        f.write(b"b" * 512)
+    expect("file1", b"a" * 512 + bytes(4 * 512) + b"b" * 512)
+
+    # four blocks allocated and zero-filled
+    fd = os.open("file2", os.O_CREAT | os.O_WRONLY)
+    os.posix_fallocate(fd, 0, 4 * 512)
+    os.close(fd)
+    expect("file2", bytes(4 * 512))
+
+    # six blocks written, 1-2 punched out, 4 zeroed in place
+    with open("file3", "wb") as f:
+        f.write(b"c" * 6 * 512)
+    fd = os.open("file3", os.O_WRONLY)
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 512, 2 * 512)
+    fallocate(fd, FALLOC_FL_ZERO_RANGE, 4 * 512, 512)
+    os.close(fd)
+    expect("file3", b"c" * 512 + bytes(2 * 512) + b"c" * 512 +
+           bytes(512) + b"c" * 512)
+except Exception as e:
+    print(e)
+    exit(1)
+
+print("Correct")
+exit(0)
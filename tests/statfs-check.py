@@ -0,0 +1,45 @@
+#!/usr/bin/python3
+
+# Check that statvfs follows the free block and inode counts through file
+# creation, writes and unlinks, starting from a freshly made filesystem.
+
+import os
+
+def expect(step, blocks_used, inodes_used):
+    st = os.statvfs(".")
+    if st.f_bfree != st.f_blocks - blocks_used:
+        print(f"{step}: f_bfree {st.f_bfree}, expected "
+              f"{st.f_blocks - blocks_used}")
+        exit(1)
+    if st.f_ffree != st.f_files - inodes_used:
+        print(f"{step}: f_ffree {st.f_ffree}, expected "
+              f"{st.f_files - inodes_used}")
+        exit(1)
+
+os.chdir("mnt")
+
+try:
+    expect("mkfs", 0, 1)  # the root inode
+
+    os.mknod("file1")  # the root directory's first dentry block
+    expect("mknod file1", 1, 2)
+
+    with open("file1", "wb") as f:
+        f.write(b"a" * 2048)
+    expect("write file1", 5, 2)
+
+    with open("file2", "wb") as f:
+        f.write(b"b" * 1024)
+    expect("write file2", 7, 3)
+
+    os.unlink("file1")
+    expect("unlink file1", 3, 2)
+
+    os.unlink("file2")  # the dentry block stays
+    expect("unlink file2", 1, 1)
+except Exception as e:
+    print(e)
+    exit(1)
+
+print("Correct")
+exit(0)
@@ -0,0 +1,39 @@
+#!/usr/bin/python3
+
+# Shrink one file by path with os.truncate and another through an open
+# descriptor with os.ftruncate, then grow both again. The cut-off data must
+# not come back: the grown tail reads as zeros.
+
+import os
+
+def expect(name, contents):
+    with open(name, "rb") as f:
+        found = f.read()
+    if found != contents:
+        print(f"{name} does not read back as expected")
+        exit(1)
+
+os.chdir("mnt")
+
+try:
+    # 17 blocks with the indirect block, down to 2 blocks
+    with open("file1", "wb") as f:
+        f.write(b"a" * 8192)
+    os.truncate("file1", 1000)
+    expect("file1", b"a" * 1000)
+    os.truncate("file1", 3000)
+    expect("file1", b"a" * 1000 + bytes(2000))
+
+    # 6 blocks, down to 1 block
+    fd = os.open("file2", os.O_CREAT | os.O_RDWR)
+    os.write(fd, b"b" * 3072)
+    os.ftruncate(fd, 512)
+    os.ftruncate(fd, 2048)
+    os.close(fd)
+    expect("file2", b"b" * 512 + bytes(1536))
+except Exception as e:
+    print(e)
+    exit(1)
+
+print("Correct")
+exit(0)
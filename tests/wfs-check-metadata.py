@@ -56,9 +56,9 @@ def verify_inodes(inode_list, filesystem):
             exit(1)
     return (dirs, files)
 
-def verify_initial_fs_state(disk, inodes, blocks):
+def verify_initial_fs_state(disk, inodes, blocks, blksize, inodesize):
     """Verify empty filesystem after running mkfs. Ignore raid in superblock."""
-    wfs = wfsverify.WfsState(disk)
+    wfs = wfsverify.WfsState(disk, blksize, inodesize)
 
     test_eq(f"sb: num inodes [{disk}]", wfs.get_sb_inodes(), inodes)
     test_eq(f"sb: num datablocks [{disk}]", wfs.get_sb_datablocks(), blocks)
@@ -75,7 +75,7 @@ def verify_initial_fs_state(disk, inodes, blocks):
     
     test_eq(f"inode region size [{disk}]",
                  wfs.get_dblock_region() - wfs.get_iblock_region(),
-                 inodes * wfs.blksize)
+                 roundup(inodes * wfs.inodesize, wfs.blksize))
 
     # check root inode
     allocated_inodes = wfs.list_allocated_inodes()
@@ -90,10 +90,10 @@ def verify_initial_fs_state(disk, inodes, blocks):
         is_allocated_inode(disk, inodep, inode)
         test_eq(f"inode size [{disk}]", inode['size'], 0)
 
-def verify_mkfs(disks, inodes, blocks):
+def verify_mkfs(disks, inodes, blocks, blksize, inodesize):
     """Verify disk list after mkfs with expected num inodes and data blocks."""
     for disk in disks:
-        verify_initial_fs_state(disk, inodes, blocks)
+        verify_initial_fs_state(disk, inodes, blocks, blksize, inodesize)
 
     print("Success")
 
@@ -101,9 +101,10 @@ def verify_raid1v(disks, expected_dirs, expected_files, expected_blocks):
     # TODO raid1v verification?
     print("Correct")
     
-def verify_raid1(disks, expected_dirs, expected_files, expected_blocks):
+def verify_raid1(disks, expected_dirs, expected_files, expected_blocks,
+                 blksize, inodesize):
     """Verify wfs formatted as raid1."""
-    filesystems = [wfsverify.WfsState(disk) for disk in disks]
+    filesystems = [wfsverify.WfsState(disk, blksize, inodesize) for disk in disks]
     all_blocks = [(filesystem.list_allocated_inodes(),
                    filesystem.list_allocated_datablocks(), filesystem)
                   for filesystem in filesystems]
@@ -140,9 +141,10 @@ def verify_raid1(disks, expected_dirs, expected_files, expected_blocks):
 
     print("Correct")
 
-def verify_raid0(disks, expected_dirs, expected_files, expected_blocks, altblocks):
+def verify_raid0(disks, expected_dirs, expected_files, expected_blocks, altblocks,
+                 blksize, inodesize):
     """Verify wfs formatted as raid1."""
-    filesystems = [wfsverify.WfsState(disk) for disk in disks]
+    filesystems = [wfsverify.WfsState(disk, blksize, inodesize) for disk in disks]
     all_blocks = [(filesystem.list_allocated_inodes(),
                    filesystem.list_allocated_datablocks(), filesystem)
                   for filesystem in filesystems]
@@ -191,15 +193,22 @@ if __name__ == '__main__':
     parser.add_argument("--dirs", help="expected number of directories")
     parser.add_argument("--files", help="expected number of regular files")
     parser.add_argument("--disks", nargs="+", help="list of disks")
+    parser.add_argument("--block-size", type=int, default=512,
+                        help="block size passed to mkfs with -B")
+    parser.add_argument("--inode-size", type=int,
+                        help="inode slot size passed to mkfs with -I")
 
     args = parser.parse_args()
 
     if args.mode == 'mkfs':
-        verify_mkfs(args.disks, int(args.inodes), int(args.blocks))
+        verify_mkfs(args.disks, int(args.inodes), int(args.blocks),
+                    args.block_size, args.inode_size)
     elif args.mode == 'raid1':
-        verify_raid1(args.disks, int(args.dirs), int(args.files), int(args.blocks))
+        verify_raid1(args.disks, int(args.dirs), int(args.files), int(args.blocks),
+                     args.block_size, args.inode_size)
     elif args.mode == 'raid0':
-        verify_raid0(args.disks, int(args.dirs), int(args.files), int(args.blocks), int(args.altblocks))
+        verify_raid0(args.disks, int(args.dirs), int(args.files), int(args.blocks), int(args.altblocks),
+                     args.block_size, args.inode_size)
     elif args.mode == 'raid1v':
         verify_raid1v(args.disks, int(args.dirs), int(args.files), int(args.blocks))
     else:
@@ -5,10 +5,13 @@ class WfsState:
     superblock = [('inodes', 8), ('datablocks', 8), ('ibit', 8), ('dbit', 8),
                   ('iblocks', 8), ('dblocks', 8)]
     inode = [('num', 4), ('mode', 4), ('uid', 4), ('gid', 4), ('size', 8),
-             ('nlinks', 8), ('atim', 8), ('mtim', 8), ('ctim', 8), ('blocks', 64)]
+             ('nlinks', 4), ('flags', 4), ('atim', 8), ('mtim', 8), ('ctim', 8),
+             ('blocks', 64)]
 
-    def __init__(self, disk):
+    def __init__(self, disk, blksize=512, inodesize=None):
         self.disk = disk
+        self.blksize = blksize
+        self.inodesize = inodesize or blksize
         self.sb = self.read_superblock()
 
     def diskname(self):
@@ -47,7 +50,7 @@ class WfsState:
 
     def read_inode(self, inodep):
         """Read an inode from disk and return a dict of its fields."""
-        pos = self.get_iblock_region() + (inodep * self.blksize)
+        pos = self.get_iblock_region() + (inodep * self.inodesize)
         return self.read_struct(pos, self.inode)
 
     def read_superblock(self):
@@ -58,7 +61,7 @@ class WfsState:
         """Read and return the entire inode region of the disk."""
         with open(self.disk, "rb") as diskf:
             diskf.seek(self.get_iblock_region())
-            return diskf.read(self.get_sb_inodes() * self.blksize)
+            return diskf.read(self.get_sb_inodes() * self.inodesize)
 
     def read_datablock_region(self):
         """Read and return the entire data region of the disk."""